@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Simple Software Raid - verification and patching of the CRCs of a segment,
+ * shared by the driver and its KUnit tests
+ */
+
+#ifndef SSR_CRC_H_
+#define SSR_CRC_H_ 1
+
+#include <linux/bitmap.h>
+#include <linux/crc32.h>
+#include <linux/highmem.h>
+#include <linux/types.h>
+
+#include "./ssr.h"
+
+/*
+ * Check the sectors [first, last) of a segment whose CRCs all live in the
+ * same CRC sector. Splitting the segment at the CRC sector boundary keeps the
+ * per-sector loop free of any index math besides the increment.
+ *
+ * @m_data     : The mapped data page, already offset to the segment.
+ * @m_crc      : The mapped CRC page.
+ * @crc_index_f: The first index of the CRC in the two allocated SECTORS.
+ * @mismatch   : Bitmap where sectors that failed the check are marked.
+ *
+ * Returns the number of sectors that failed the check.
+ */
+static __always_inline size_t check_run(const u8 *m_data, const u32 *m_crc,
+					const size_t crc_index_f,
+					const size_t first, const size_t last,
+					unsigned long *mismatch)
+{
+	size_t i, nr_bad = 0;
+	u32 crc_comp;
+
+	for (i = first; i < last; ++i) {
+		crc_comp = crc32(CRC_SEED, m_data + i * KERNEL_SECTOR_SIZE,
+				 KERNEL_SECTOR_SIZE);
+
+		if (likely(crc_comp == m_crc[crc_index_f + i]))
+			continue;
+
+		/* We found a CRC missmatch */
+		__set_bit(i, mismatch);
+		++nr_bad;
+	}
+
+	return nr_bad;
+}
+
+/*
+ * Check each SECTOR worth of bytes from the data page for CRC missmatches.
+ * Nothing is written, the missmatches are only recorded so the caller can
+ * repair them later with the data that was already read.
+ *
+ * @pg_to_use  : The page to check.
+ * @data_len   : The length of the data.
+ * @data_offset: The offset in the page to check from.
+ * @crc_page   : The page of CRCs to check.
+ * @crc_index_f: The first index of the CRC in the two allocated SECTORS.
+ * @mismatch   : Bitmap of SSR_SEG_MAX_SECTORS bits, filled with the sectors
+ *             that failed the check.
+ *
+ * Returns true if all the data matched its CRCs.
+ */
+static inline bool check_data(struct page *pg_to_use, const size_t data_len,
+			      const size_t data_offset,
+			      struct page *crc_page, const size_t crc_index_f,
+			      unsigned long *mismatch)
+{
+	const size_t nr_sectors = data_len / KERNEL_SECTOR_SIZE;
+	/* Sectors up to split have their CRCs in the first CRC sector */
+	const size_t split = min(nr_sectors, CRC_PER_SECTOR - crc_index_f);
+	size_t nr_bad;
+	u8 *m_data;
+	u32 *m_crc;
+
+	bitmap_zero(mismatch, SSR_SEG_MAX_SECTORS);
+
+	/* Map the pages to have access to the data */
+	m_data = kmap_atomic(pg_to_use);
+	m_crc = kmap_atomic(crc_page);
+
+	nr_bad = check_run(m_data + data_offset, m_crc, crc_index_f, 0, split,
+			   mismatch);
+	if (unlikely(split != nr_sectors))
+		nr_bad += check_run(m_data + data_offset, m_crc, crc_index_f,
+				    split, nr_sectors, mismatch);
+
+	kunmap_atomic(m_crc);
+	kunmap_atomic(m_data);
+
+	return nr_bad == 0;
+}
+
+/*
+ * Patch the CRCs of the sectors that failed the check with those of the good
+ * data, and mark which of the two CRC sectors of the segment changed.
+ */
+static inline void repair_crcs(const unsigned long *mismatch,
+			       const size_t nr_sectors,
+			       struct page *good_data_page,
+			       const size_t data_offset,
+			       struct page *crc_page, const size_t crc_index_f,
+			       bool crc_dirty[2])
+{
+	u8 *m_data;
+	u32 *m_crc;
+	size_t i;
+
+	crc_dirty[0] = false;
+	crc_dirty[1] = false;
+
+	m_data = kmap_atomic(good_data_page);
+	m_crc = kmap_atomic(crc_page);
+	for_each_set_bit(i, mismatch, nr_sectors) {
+		m_crc[crc_index_f + i] =
+			crc32(CRC_SEED,
+			      m_data + data_offset + i * KERNEL_SECTOR_SIZE,
+			      KERNEL_SECTOR_SIZE);
+		crc_dirty[(crc_index_f + i) / CRC_PER_SECTOR] = true;
+	}
+	kunmap_atomic(m_crc);
+	kunmap_atomic(m_data);
+}
+
+#endif
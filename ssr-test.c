@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ssr-test.c - KUnit tests of the CRC layout and verification of ssr.c
+ *
+ * Segments of every length and page offset, at the start and end of the
+ * device and around CRC sector and region boundaries, get their CRCs laid
+ * out like on disk, straight from get_crc_sector() and get_crc_index(), in
+ * the get_crc_len() bytes the IO paths read. check_data() has to accept them
+ * and, with any one sector or CRC corrupted, report exactly that sector, and
+ * repair_crcs() has to fix a broken CRC and mark the one CRC sector it lives
+ * in. The last case times the verification of whole pages.
+ *
+ * Built as ssr-test.ko when the kernel has CONFIG_KUNIT.
+ */
+#include <kunit/test.h>
+#include <linux/bitmap.h>
+#include <linux/crc32.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#include "./ssr.h"
+#include "./ssr-crc.h"
+
+/* pages verified to time the verification loop */
+#define SSR_TEST_BENCH_PAGES 4096
+
+static const sector_t ssr_test_firsts[] = {
+	0,
+	1,
+	CRC_PER_SECTOR - SSR_SEG_MAX_SECTORS,
+	CRC_PER_SECTOR - 1,
+	2 * CRC_PER_SECTOR - 3,
+	SSR_REGION_SECTORS - 1,
+	LOGICAL_DISK_SECTORS - SSR_SEG_MAX_SECTORS,
+	LOGICAL_DISK_SECTORS - 1,
+};
+
+struct ssr_test_ctx {
+	struct page *data_page;
+	struct page *crc_page;
+};
+
+/* A segment of nr_sectors at sector, placed at offset in its page */
+struct ssr_test_seg {
+	sector_t sector;
+	size_t offset;
+	size_t nr_sectors;
+};
+
+static int ssr_test_init(struct kunit *test)
+{
+	struct ssr_test_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	ctx->data_page = alloc_page(GFP_KERNEL);
+	ctx->crc_page = alloc_page(GFP_KERNEL);
+	test->priv = ctx;
+
+	return ctx->data_page != NULL && ctx->crc_page != NULL ? 0 : -ENOMEM;
+}
+
+static void ssr_test_exit(struct kunit *test)
+{
+	struct ssr_test_ctx *ctx = test->priv;
+
+	if (ctx->data_page != NULL)
+		__free_page(ctx->data_page);
+	if (ctx->crc_page != NULL)
+		__free_page(ctx->crc_page);
+}
+
+/*
+ * Call fn for every segment shape tested, until one fails.
+ */
+static void ssr_test_for_each_seg(struct kunit *test,
+				  bool (*fn)(struct kunit *test,
+					     const struct ssr_test_seg *seg))
+{
+	struct ssr_test_seg seg;
+	size_t f, nr, off;
+
+	for (f = 0; f < ARRAY_SIZE(ssr_test_firsts); ++f) {
+		for (nr = 1; nr <= SSR_SEG_MAX_SECTORS; ++nr) {
+			if (ssr_test_firsts[f] + nr > LOGICAL_DISK_SECTORS)
+				break;
+
+			for (off = 0; off + nr <= SSR_SEG_MAX_SECTORS; ++off) {
+				seg = (struct ssr_test_seg) {
+					.sector = ssr_test_firsts[f],
+					.offset = off * KERNEL_SECTOR_SIZE,
+					.nr_sectors = nr,
+				};
+				if (!fn(test, &seg)) {
+					kunit_err(test, "sector %llu, %zu sectors at offset %zu\n",
+						  (unsigned long long)seg.sector,
+						  seg.nr_sectors, seg.offset);
+					return;
+				}
+			}
+		}
+	}
+}
+
+/* Fill a segment with data and lay out its CRCs like on disk */
+static void ssr_test_fill(struct ssr_test_ctx *ctx,
+			  const struct ssr_test_seg *seg)
+{
+	sector_t crc_sector_f = get_crc_sector(seg->sector);
+	size_t i, len = seg->nr_sectors * KERNEL_SECTOR_SIZE;
+	u8 *data;
+	u32 *crcs;
+
+	data = kmap_atomic(ctx->data_page);
+	crcs = kmap_atomic(ctx->crc_page);
+	for (i = 0; i < len; ++i)
+		data[seg->offset + i] = (seg->sector * KERNEL_SECTOR_SIZE + i) * 131;
+	for (i = 0; i < seg->nr_sectors; ++i)
+		crcs[(get_crc_sector(seg->sector + i) - crc_sector_f) *
+		     CRC_PER_SECTOR + get_crc_index(seg->sector + i)] =
+			crc32(CRC_SEED, data + seg->offset + i * KERNEL_SECTOR_SIZE,
+			      KERNEL_SECTOR_SIZE);
+	kunmap_atomic(crcs);
+	kunmap_atomic(data);
+}
+
+/* Whether check_data() reports exactly the given sector, or none if -1 */
+static bool ssr_test_check(struct ssr_test_ctx *ctx,
+			   const struct ssr_test_seg *seg, long bad)
+{
+	unsigned long mismatch[BITS_TO_LONGS(SSR_SEG_MAX_SECTORS)];
+	bool good;
+
+	good = check_data(ctx->data_page, seg->nr_sectors * KERNEL_SECTOR_SIZE,
+			  seg->offset, ctx->crc_page,
+			  get_crc_index(seg->sector), mismatch);
+	if (bad < 0)
+		return good && bitmap_empty(mismatch, seg->nr_sectors);
+
+	return !good && bitmap_weight(mismatch, seg->nr_sectors) == 1 &&
+	       test_bit(bad, mismatch);
+}
+
+static bool ssr_test_layout_seg(struct kunit *test,
+				const struct ssr_test_seg *seg)
+{
+	sector_t crc_sector_f = get_crc_sector(seg->sector);
+	sector_t crc_sector_l = get_crc_sector(seg->sector + seg->nr_sectors - 1);
+	bool straddles = get_crc_index(seg->sector) + seg->nr_sectors >
+			 CRC_PER_SECTOR;
+
+	/* The CRCs are in the CRC region, in at most the two sectors read */
+	KUNIT_EXPECT_GE(test, crc_sector_f, (sector_t)LOGICAL_DISK_SECTORS);
+	KUNIT_EXPECT_LT(test, crc_sector_l, (sector_t)SSR_SB_SECTOR);
+	KUNIT_EXPECT_LE(test, crc_sector_l - crc_sector_f, (sector_t)1);
+
+	/* Two CRC sectors are read exactly when the CRCs straddle them */
+	KUNIT_EXPECT_EQ(test, (size_t)get_crc_len(seg->sector, seg->nr_sectors),
+			(size_t)(straddles ? 2 : 1) * KERNEL_SECTOR_SIZE);
+
+	return crc_sector_f >= LOGICAL_DISK_SECTORS &&
+	       crc_sector_l < SSR_SB_SECTOR &&
+	       crc_sector_l - crc_sector_f <= 1;
+}
+
+static void ssr_test_layout(struct kunit *test)
+{
+	ssr_test_for_each_seg(test, ssr_test_layout_seg);
+}
+
+static bool ssr_test_check_data_seg(struct kunit *test,
+				    const struct ssr_test_seg *seg)
+{
+	struct ssr_test_ctx *ctx = test->priv;
+	bool ok;
+	size_t i;
+	u8 *data;
+
+	ssr_test_fill(ctx, seg);
+	KUNIT_EXPECT_TRUE(test, ssr_test_check(ctx, seg, -1));
+
+	for (i = 0; i < seg->nr_sectors; ++i) {
+		data = kmap_atomic(ctx->data_page);
+		data[seg->offset + i * KERNEL_SECTOR_SIZE] ^= 0xff;
+		kunmap_atomic(data);
+
+		ok = ssr_test_check(ctx, seg, i);
+
+		data = kmap_atomic(ctx->data_page);
+		data[seg->offset + i * KERNEL_SECTOR_SIZE] ^= 0xff;
+		kunmap_atomic(data);
+
+		KUNIT_EXPECT_TRUE_MSG(test, ok, "corrupted sector %zu", i);
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+static void ssr_test_check_data(struct kunit *test)
+{
+	ssr_test_for_each_seg(test, ssr_test_check_data_seg);
+}
+
+static bool ssr_test_repair_crcs_seg(struct kunit *test,
+				     const struct ssr_test_seg *seg)
+{
+	unsigned long mismatch[BITS_TO_LONGS(SSR_SEG_MAX_SECTORS)];
+	struct ssr_test_ctx *ctx = test->priv;
+	size_t crc_index_f = get_crc_index(seg->sector);
+	bool crc_dirty[2];
+	size_t i, c;
+	u32 *crcs;
+
+	ssr_test_fill(ctx, seg);
+
+	for (i = 0; i < seg->nr_sectors; ++i) {
+		c = crc_index_f + i;
+
+		crcs = kmap_atomic(ctx->crc_page);
+		crcs[c] = ~crcs[c];
+		kunmap_atomic(crcs);
+
+		KUNIT_EXPECT_TRUE_MSG(test, ssr_test_check(ctx, seg, i),
+				      "corrupted CRC %zu", i);
+
+		bitmap_zero(mismatch, SSR_SEG_MAX_SECTORS);
+		__set_bit(i, mismatch);
+		repair_crcs(mismatch, seg->nr_sectors, ctx->data_page,
+			    seg->offset, ctx->crc_page, crc_index_f, crc_dirty);
+
+		/* Only the CRC sector holding the CRC is written back */
+		KUNIT_EXPECT_TRUE(test, crc_dirty[c / CRC_PER_SECTOR]);
+		KUNIT_EXPECT_FALSE(test, crc_dirty[1 - c / CRC_PER_SECTOR]);
+		if (!ssr_test_check(ctx, seg, -1)) {
+			KUNIT_FAIL(test, "CRC %zu not repaired", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void ssr_test_repair_crcs(struct kunit *test)
+{
+	ssr_test_for_each_seg(test, ssr_test_repair_crcs_seg);
+}
+
+/* Time the verification of whole pages */
+static void ssr_test_bench(struct kunit *test)
+{
+	unsigned long mismatch[BITS_TO_LONGS(SSR_SEG_MAX_SECTORS)];
+	struct ssr_test_ctx *ctx = test->priv;
+	struct ssr_test_seg seg = { .nr_sectors = SSR_SEG_MAX_SECTORS };
+	u64 start, ns;
+	size_t i;
+
+	ssr_test_fill(ctx, &seg);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_TEST_BENCH_PAGES; ++i)
+		KUNIT_ASSERT_TRUE(test, check_data(ctx->data_page, PAGE_SIZE, 0,
+						   ctx->crc_page, 0, mismatch));
+	ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	kunit_info(test, "verification %llu MB/s\n",
+		   div64_u64((u64)SSR_TEST_BENCH_PAGES * PAGE_SIZE * NSEC_PER_USEC,
+			     ns));
+}
+
+static struct kunit_case ssr_test_cases[] = {
+	KUNIT_CASE(ssr_test_layout),
+	KUNIT_CASE(ssr_test_check_data),
+	KUNIT_CASE(ssr_test_repair_crcs),
+	KUNIT_CASE(ssr_test_bench),
+	{}
+};
+
+static struct kunit_suite ssr_test_suite = {
+	.name = "ssr",
+	.init = ssr_test_init,
+	.exit = ssr_test_exit,
+	.test_cases = ssr_test_cases,
+};
+
+kunit_test_suites(&ssr_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests of the Simple Software Raid CRC layout");
+MODULE_LICENSE("GPL");
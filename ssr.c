@@ -6,26 +6,55 @@
  * Author: Andrei Preda <preda.andrei174@gmail.com>
  */
 #include <linux/bio.h>
+#include <linux/bitmap.h>
 #include <linux/blk-mq.h>
 #include <linux/blk_types.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/completion.h>
 #include <linux/crc32.h>
 #include <linux/cred.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mempool.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/relay.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "./ssr.h"
+#include "./ssr-crc.h"
 
-static struct block_device *pdsks[2];
+static char *pdsk_names[] = {
+	PHYSICAL_DISK1_NAME,
+	PHYSICAL_DISK2_NAME,
+	PHYSICAL_DISK3_NAME,
+};
+module_param_array_named(disks, pdsk_names, charp, NULL, 0444);
+MODULE_PARM_DESC(disks, "Paths of the member disks");
+
+static struct block_device *pdsks[SSR_NR_DISKS];
 
 static struct my_block_dev {
 	struct blk_mq_tag_set tag_set;
@@ -34,13 +63,232 @@ static struct my_block_dev {
 	size_t size;
 } g_dev;
 
+/* Classes of user IO, each with its own limit of requests in flight */
+enum ssr_io_class {
+	SSR_IO_READ,
+	SSR_IO_WRITE,
+	SSR_IO_CLASSES,
+};
+
+/*
+ * Classes of work serviced by the scheduler, each with a target deadline.
+ * Reads are synchronous unless speculative, see my_spec_read_handler();
+ * writes are unless the submitter did not mark them REQ_SYNC.
+ */
+enum ssr_sched_class {
+	SSR_SCHED_SYNC_READ,
+	SSR_SCHED_SYNC_WRITE,
+	SSR_SCHED_ASYNC_WRITE,
+	SSR_SCHED_MAINT,
+	SSR_SCHED_SPEC_READ,
+	SSR_SCHED_CLASSES,
+};
+
+struct ssr_sched_entry {
+	struct list_head list;
+	u64 deadline;
+	enum ssr_sched_class class;
+	/* The CPU whose scheduler the entry was queued on */
+	int cpu;
+	void (*fn)(struct ssr_sched_entry *entry);
+};
+
 struct work_bio_info {
-	struct work_struct my_work;
+	struct ssr_sched_entry entry;
 	struct bio *original_bio;
+	enum ssr_io_class class;
 };
 
 struct workqueue_struct *queue;
 
+/* Backs the work_bio_info of submitters that may sleep, so they never fail */
+static mempool_t *info_pool;
+
+static unsigned int sched_deadline_ms[SSR_SCHED_CLASSES] = {
+	5, 50, 500, 1000, 100
+};
+module_param_array_named(sched_deadline_ms, sched_deadline_ms, uint, NULL,
+			 0644);
+MODULE_PARM_DESC(sched_deadline_ms,
+		 "Target deadlines of sync reads,sync writes,async writes,maintenance,speculative reads");
+
+static bool readahead = true;
+module_param(readahead, bool, 0644);
+MODULE_PARM_DESC(readahead, "Prefetch data and CRCs for sequential readers");
+
+static unsigned int max_inflight = 256;
+module_param(max_inflight, uint, 0644);
+MODULE_PARM_DESC(max_inflight, "Maximum user requests in flight, 0 for no limit");
+
+static unsigned int max_inflight_class[SSR_IO_CLASSES] = { 256, 128 };
+module_param_array_named(max_inflight_class, max_inflight_class, uint, NULL,
+			 0644);
+MODULE_PARM_DESC(max_inflight_class,
+		 "Maximum reads,writes in flight, 0 for no limit");
+
+static atomic_t inflight;
+static atomic_t inflight_class[SSR_IO_CLASSES];
+static DECLARE_WAIT_QUEUE_HEAD(inflight_wait);
+
+static unsigned int spec_read_share = 50;
+module_param(spec_read_share, uint, 0644);
+MODULE_PARM_DESC(spec_read_share,
+		 "Percent of the read slots readahead and failfast reads may take");
+
+static unsigned int qos_iops[SSR_IO_CLASSES];
+module_param_array_named(qos_iops, qos_iops, uint, NULL, 0644);
+MODULE_PARM_DESC(qos_iops, "Maximum reads,writes per second, 0 for no limit");
+
+static unsigned int qos_kbps[SSR_IO_CLASSES];
+module_param_array_named(qos_kbps, qos_kbps, uint, NULL, 0644);
+MODULE_PARM_DESC(qos_kbps,
+		 "Maximum KiB per second of reads,writes, 0 for no limit");
+
+static unsigned int qos_burst_ms = 100;
+module_param(qos_burst_ms, uint, 0644);
+MODULE_PARM_DESC(qos_burst_ms,
+		 "Time at the QoS limits an idle class may then submit at once, up to 1000");
+
+static unsigned int recent_write_ms = 1000;
+module_param(recent_write_ms, uint, 0644);
+MODULE_PARM_DESC(recent_write_ms,
+		 "Window in which written blocks are read from one disk, 0 disables");
+
+static bool resync_dirty = true;
+module_param(resync_dirty, bool, 0444);
+MODULE_PARM_DESC(resync_dirty, "Resync the disks if the array was not shut down cleanly");
+
+
+/*
+ * A readahead window holds a range of data sectors read from one mirror
+ * together with the CRC sectors covering them. Readers wait for its prefetch
+ * and copy from it without ra_lock, holding a reference in users so the
+ * window is not refilled under them.
+ */
+struct ssr_ra_window {
+	struct page *data_pages[SSR_RA_DATA_PAGES];
+	struct page *crc_page;
+	sector_t start;
+	unsigned int nr_sectors;
+	unsigned int users;
+	atomic_t pending;
+	struct completion done;
+	blk_status_t status;
+	bool valid;
+	bool in_flight;
+};
+
+/* The next sector of an idle stream, which no read can continue */
+#define SSR_RA_NO_SECTOR ((sector_t)-1)
+
+/*
+ * A sequential read stream. Each stream owns two windows so the next one can
+ * be fetched while the reader consumes the current one.
+ */
+struct ssr_ra_stream {
+	sector_t next_sector;
+	unsigned int win_sectors;
+	unsigned long last_used;
+	struct ssr_ra_window win[2];
+};
+
+/* Guards the streams and windows, never held across IO or a wait */
+static struct ssr_ra_stream ra_streams[SSR_RA_STREAMS];
+static DEFINE_SPINLOCK(ra_lock);
+
+static struct dentry *ssr_debugfs;
+
+/*
+ * Event counters. Each CPU bumps its own copy, so the dispatchers of all the
+ * CPUs count without losing updates or sharing a cache line, and the copies
+ * are summed up when a counter is read from debugfs.
+ */
+enum ssr_counter {
+	/* Requests that had to wait for a slot and REQ_NOWAIT ones turned away */
+	SSR_CNT_ADMIT_WAITS,
+	SSR_CNT_ADMIT_REJECTS,
+	/* Requests dispatched after their deadline, one counter per class */
+	SSR_CNT_SCHED_EXPIRED,
+	SSR_CNT_SCHED_EXPIRED_LAST = SSR_CNT_SCHED_EXPIRED + SSR_SCHED_CLASSES - 1,
+	/* Reads of recent blocks served from one disk and those that fell back */
+	SSR_CNT_RECENT_HITS,
+	SSR_CNT_RECENT_FALLBACKS,
+	/* Speculative reads served, failed without repair and aborted unread */
+	SSR_CNT_SPEC_SERVED,
+	SSR_CNT_SPEC_FAILED,
+	SSR_CNT_SPEC_ABORTED,
+	/* Trace records dropped because the relay buffers were full */
+	SSR_CNT_TRACE_DROPPED,
+	/* Sectors passing their own CRC check found to differ across disks */
+	SSR_CNT_DIVERGED,
+	SSR_NR_COUNTERS,
+};
+
+struct ssr_counters {
+	u64 cnt[SSR_NR_COUNTERS];
+};
+
+static DEFINE_PER_CPU(struct ssr_counters, counters);
+
+static inline void counter_add(enum ssr_counter c, u64 n)
+{
+	struct ssr_counters *cs = get_cpu_ptr(&counters);
+
+	cs->cnt[c] += n;
+	put_cpu_ptr(&counters);
+}
+
+static inline void counter_inc(enum ssr_counter c)
+{
+	counter_add(c, 1);
+}
+
+static int counter_get(void *data, u64 *val)
+{
+	size_t c = (uintptr_t)data;
+	int cpu;
+
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += READ_ONCE(per_cpu_ptr(&counters, cpu)->cnt[c]);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(counter_fops, counter_get, NULL, "%llu\n");
+
+/* A read-only debugfs file showing the sum of a counter */
+static void counter_debugfs(const char *name, struct dentry *parent,
+			    enum ssr_counter c)
+{
+	debugfs_create_file_unsafe(name, 0400, parent, (void *)(uintptr_t)c,
+				   &counter_fops);
+}
+
+/*
+ * Faults injected into the I/O of one disk, set from debugfs. Rates are in
+ * parts per million, of data sectors for data_corrupt_ppm and of CRCs for
+ * crc_corrupt_ppm, so both hit a read of one sector equally often. Sectors
+ * in [range_start, range_end) are always corrupted when read, every CRC of
+ * them for CRC sectors; the CRC region starts at LOGICAL_DISK_SECTORS.
+ */
+struct ssr_fault {
+	u32 data_corrupt_ppm;
+	u32 crc_corrupt_ppm;
+	u64 range_start;
+	u64 range_end;
+	u32 error_ppm;
+	u32 delay_us;
+	bool failed;
+};
+
+static struct ssr_fault faults[SSR_NR_DISKS];
+static bool fault_inject;
+static u64 fault_seed;
+/* Seeded from debugfs so a run of injected faults can be reproduced */
+static struct rnd_state fault_rnd;
+static DEFINE_SPINLOCK(fault_lock);
+
 static int my_block_open(struct block_device *bdev, fmode_t mode)
 {
 	return 0;
@@ -50,6 +298,567 @@ static void my_block_release(struct gendisk *gd, fmode_t mode)
 {
 }
 
+static size_t disk_index(struct block_device *blk_dev)
+{
+	size_t i;
+
+	for (i = 0; i < SSR_NR_DISKS - 1; ++i)
+		if (pdsks[i] == blk_dev)
+			break;
+
+	return i;
+}
+
+static bool fault_hit(u32 ppm)
+{
+	u32 r;
+
+	if (ppm == 0)
+		return false;
+
+	spin_lock(&fault_lock);
+	r = prandom_u32_state(&fault_rnd) % SSR_FAULT_PPM;
+	spin_unlock(&fault_lock);
+
+	return r < ppm;
+}
+
+/*
+ * Called before every IO to a disk. Delays it and decides if it fails.
+ *
+ * Returns 0 or the error the IO must fail with.
+ */
+static int fault_before_io(struct block_device *blk_dev)
+{
+	struct ssr_fault *f;
+
+	if (likely(!fault_inject))
+		return 0;
+
+	f = &faults[disk_index(blk_dev)];
+	if (f->delay_us != 0)
+		fsleep(f->delay_us);
+
+	if (f->failed || fault_hit(f->error_ppm))
+		return -EIO;
+
+	return 0;
+}
+
+/* A random byte of the len bytes at buffer */
+static void fault_flip_byte(u8 *buffer, size_t len)
+{
+	u32 r;
+
+	spin_lock(&fault_lock);
+	r = prandom_u32_state(&fault_rnd) % len;
+	spin_unlock(&fault_lock);
+
+	buffer[r] ^= 0xff;
+}
+
+/*
+ * Called after a successful read. Corrupts the sectors that were read as if
+ * they were broken on the disk: a random byte of a data sector, or of each
+ * CRC hit in a CRC sector.
+ */
+static void fault_after_read(struct page *page, const size_t len,
+			     const size_t offset,
+			     struct block_device *blk_dev, sector_t sector)
+{
+	struct ssr_fault *f;
+	bool in_range;
+	sector_t s;
+	size_t i, c;
+	u8 *buffer, *data;
+
+	if (likely(!fault_inject))
+		return;
+
+	f = &faults[disk_index(blk_dev)];
+	buffer = kmap_atomic(page);
+	for (i = 0; i < DIV_ROUND_UP(len, KERNEL_SECTOR_SIZE); ++i) {
+		s = sector + i;
+		data = buffer + offset + i * KERNEL_SECTOR_SIZE;
+		in_range = s >= f->range_start && s < f->range_end;
+
+		if (s < LOGICAL_DISK_SECTORS) {
+			if (in_range || fault_hit(f->data_corrupt_ppm))
+				fault_flip_byte(data, KERNEL_SECTOR_SIZE);
+			continue;
+		}
+
+		for (c = 0; c < CRC_PER_SECTOR; ++c)
+			if (in_range || fault_hit(f->crc_corrupt_ppm))
+				fault_flip_byte(data + c * sizeof(u32),
+						sizeof(u32));
+	}
+	kunmap_atomic(buffer);
+}
+
+static int fault_seed_get(void *data, u64 *val)
+{
+	*val = fault_seed;
+	return 0;
+}
+
+static int fault_seed_set(void *data, u64 val)
+{
+	spin_lock(&fault_lock);
+	fault_seed = val;
+	prandom_seed_state(&fault_rnd, val);
+	spin_unlock(&fault_lock);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(fault_seed_fops, fault_seed_get, fault_seed_set,
+			 "%llu\n");
+
+static void fault_debugfs_init(struct dentry *parent)
+{
+	struct dentry *fault_dir, *dir;
+	char name[16];
+	size_t i;
+
+	prandom_seed_state(&fault_rnd, fault_seed);
+
+	fault_dir = debugfs_create_dir("fault", parent);
+	debugfs_create_bool("enable", 0600, fault_dir, &fault_inject);
+	debugfs_create_file_unsafe("seed", 0600, fault_dir, NULL,
+				   &fault_seed_fops);
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		snprintf(name, sizeof(name), "disk%zu", i);
+		dir = debugfs_create_dir(name, fault_dir);
+
+		debugfs_create_u32("data_corrupt_ppm", 0600, dir,
+				   &faults[i].data_corrupt_ppm);
+		debugfs_create_u32("crc_corrupt_ppm", 0600, dir,
+				   &faults[i].crc_corrupt_ppm);
+		debugfs_create_u64("range_start", 0600, dir,
+				   &faults[i].range_start);
+		debugfs_create_u64("range_end", 0600, dir, &faults[i].range_end);
+		debugfs_create_u32("error_ppm", 0600, dir, &faults[i].error_ppm);
+		debugfs_create_u32("delay_us", 0600, dir, &faults[i].delay_us);
+		debugfs_create_bool("failed", 0600, dir, &faults[i].failed);
+	}
+}
+
+/*
+ * Health of each disk, from its recent IO errors, CRC missmatches and
+ * latency drift. Averages are fixed point with SSR_HEALTH_ONE meaning every
+ * IO failed or every sector checked missmatched. A disk whose score drops
+ * under health_threshold is reported and user reads stop reading and
+ * repairing it as long as the other disks hold good data, except for one
+ * read in health_sample, which keeps its missmatch average moving so the
+ * disk can be found healthy again.
+ */
+struct ssr_health {
+	spinlock_t lock;
+	u32 err_avg;
+	u32 mismatch_avg;
+	/* Recent and long term average IO latency */
+	u64 lat_fast_ns;
+	u64 lat_slow_ns;
+	u64 io_errors;
+	u64 mismatches;
+	bool unhealthy;
+};
+
+static struct ssr_health health[SSR_NR_DISKS];
+
+static unsigned int health_threshold = 50;
+module_param(health_threshold, uint, 0644);
+MODULE_PARM_DESC(health_threshold, "Score (0-100) under which a disk is avoided by reads");
+
+static unsigned int health_sample = 64;
+module_param(health_sample, uint, 0644);
+MODULE_PARM_DESC(health_sample,
+		 "One in this many reads also checks degrading disks, 0 for none");
+
+/* Reads since the last one that sampled the degrading disks */
+static DEFINE_PER_CPU(unsigned int, health_reads);
+
+/*
+ * Note: the disk's health lock must be held.
+ */
+static unsigned int health_score(const struct ssr_health *h)
+{
+	u64 penalty, drift;
+
+	/* A quarter of the IOs failing or a tenth of the sectors missmatching */
+	penalty = ((u64)h->err_avg * 400) >> SSR_HEALTH_SHIFT;
+	penalty += ((u64)h->mismatch_avg * 1000) >> SSR_HEALTH_SHIFT;
+
+	/*
+	 * Latency more than four times the long term average. It is noisy
+	 * under bursts and a slow disk still returns good data, so on its own
+	 * it costs at most a fifth of the score and never marks a disk
+	 * degrading.
+	 */
+	if (h->lat_slow_ns != 0 && h->lat_fast_ns > 4 * h->lat_slow_ns) {
+		drift = div64_u64(h->lat_fast_ns, h->lat_slow_ns);
+		penalty += min_t(u64, 20, 5 * (drift - 3));
+	}
+
+	return 100 - min_t(u64, penalty, 100);
+}
+
+static inline u32 health_avg(u32 avg, bool event)
+{
+	return avg - (avg >> SSR_HEALTH_AVG_SHIFT) +
+	       (event ? SSR_HEALTH_ONE >> SSR_HEALTH_AVG_SHIFT : 0);
+}
+
+/*
+ * Note: the disk's health lock must be held.
+ */
+static void health_update_state(size_t disk, struct ssr_health *h)
+{
+	unsigned int score = health_score(h);
+
+	/* Wide hysteresis, so a disk at the threshold does not flap */
+	if (!h->unhealthy && score < health_threshold) {
+		WRITE_ONCE(h->unhealthy, true);
+		pr_warn_ratelimited("disk %s is degrading, health %u\n",
+				    pdsk_names[disk], score);
+	} else if (h->unhealthy && score >= health_threshold + 20) {
+		WRITE_ONCE(h->unhealthy, false);
+		pr_info_ratelimited("disk %s recovered, health %u\n",
+				    pdsk_names[disk], score);
+	}
+}
+
+static void health_account_io(struct block_device *blk_dev, u64 lat, int err)
+{
+	size_t disk = disk_index(blk_dev);
+	struct ssr_health *h = &health[disk];
+
+	spin_lock(&h->lock);
+	h->err_avg = health_avg(h->err_avg, err != 0);
+	if (err != 0) {
+		++h->io_errors;
+	} else if (h->lat_slow_ns == 0) {
+		h->lat_fast_ns = lat;
+		h->lat_slow_ns = lat;
+	} else {
+		h->lat_fast_ns = h->lat_fast_ns - (h->lat_fast_ns >> 3) + (lat >> 3);
+		h->lat_slow_ns = h->lat_slow_ns - (h->lat_slow_ns >> 10) +
+				 (lat >> 10);
+	}
+	health_update_state(disk, h);
+	spin_unlock(&h->lock);
+}
+
+static void health_account_check(size_t disk, size_t nr_sectors,
+				 size_t nr_bad)
+{
+	struct ssr_health *h = &health[disk];
+	size_t i;
+
+	spin_lock(&h->lock);
+	for (i = 0; i < nr_sectors; ++i)
+		h->mismatch_avg = health_avg(h->mismatch_avg, i < nr_bad);
+	h->mismatches += nr_bad;
+	health_update_state(disk, h);
+	spin_unlock(&h->lock);
+}
+
+static inline bool health_good(size_t disk)
+{
+	return !READ_ONCE(health[disk].unhealthy);
+}
+
+/*
+ * Order the disks for a read, healthy ones first, starting the healthy ones
+ * from the preferred disk.
+ *
+ * Returns the number of healthy disks.
+ */
+static size_t health_read_order(size_t *order, size_t preferred)
+{
+	size_t i, n = 0, nr_good, d;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		d = (preferred + i) % SSR_NR_DISKS;
+		if (health_good(d))
+			order[n++] = d;
+	}
+	nr_good = n;
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		d = (preferred + i) % SSR_NR_DISKS;
+		if (!health_good(d))
+			order[n++] = d;
+	}
+
+	return nr_good;
+}
+
+/*
+ * Whether a read should check the degrading disks too, which it does once
+ * in health_sample reads.
+ */
+static bool health_sample_due(void)
+{
+	unsigned int every = READ_ONCE(health_sample), *reads;
+	bool due;
+
+	if (every == 0)
+		return false;
+
+	reads = get_cpu_ptr(&health_reads);
+	due = ++*reads >= every;
+	if (due)
+		*reads = 0;
+	put_cpu_ptr(&health_reads);
+
+	return due;
+}
+
+/* The disk to read from, preferably the given one */
+static inline size_t health_pick(size_t preferred)
+{
+	size_t order[SSR_NR_DISKS];
+
+	health_read_order(order, preferred % SSR_NR_DISKS);
+	return order[0];
+}
+
+static ssize_t health_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct ssr_health *h;
+	ssize_t len = 0;
+	size_t d;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d) {
+		h = &health[d];
+		spin_lock(&h->lock);
+		len += sysfs_emit_at(buf, len, "%s %u %s %llu %llu %llu\n",
+				     pdsk_names[d], health_score(h),
+				     h->unhealthy ? "degrading" : "good",
+				     h->io_errors, h->mismatches,
+				     div_u64(h->lat_fast_ns, NSEC_PER_USEC));
+		spin_unlock(&h->lock);
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(health);
+
+static void health_init(void)
+{
+	size_t d;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d)
+		spin_lock_init(&health[d].lock);
+}
+
+/*
+ * Write amplification: the bytes users write and the bytes written to the
+ * disks, by what they are written for. Counted per CPU as the IOs complete
+ * and summed up by the "write_amp" sysfs attribute.
+ */
+enum ssr_wa_class {
+	SSR_WA_DATA,
+	SSR_WA_CRC,
+	SSR_WA_REPAIR,
+	SSR_WA_RESYNC,
+	SSR_WA_SB,
+	SSR_NR_WA,
+};
+
+static const char * const wa_names[SSR_NR_WA] = {
+	[SSR_WA_DATA] = "data",
+	[SSR_WA_CRC] = "crc",
+	[SSR_WA_REPAIR] = "repair",
+	[SSR_WA_RESYNC] = "resync",
+	[SSR_WA_SB] = "superblock",
+};
+
+struct ssr_wa {
+	u64 user_bytes;
+	u64 member_bytes[SSR_NR_WA];
+};
+
+static DEFINE_PER_CPU(struct ssr_wa, wa_stats);
+
+static inline void wa_account_user(size_t len)
+{
+	struct ssr_wa *wa = get_cpu_ptr(&wa_stats);
+
+	wa->user_bytes += len;
+	put_cpu_ptr(&wa_stats);
+}
+
+static inline void wa_account(enum ssr_wa_class class, size_t len)
+{
+	struct ssr_wa *wa = get_cpu_ptr(&wa_stats);
+
+	wa->member_bytes[class] += len;
+	put_cpu_ptr(&wa_stats);
+}
+
+/* A ratio with three decimals, "-" while nothing was written */
+static ssize_t wa_emit_ratio(char *buf, ssize_t len, const char *name,
+			     u64 num, u64 den)
+{
+	u64 milli;
+
+	if (den == 0)
+		return sysfs_emit_at(buf, len, "%s -\n", name);
+
+	milli = div64_u64(num * 1000, den);
+	return sysfs_emit_at(buf, len, "%s %llu.%03llu\n", name,
+			     div_u64(milli, 1000), milli % 1000);
+}
+
+/*
+ * One "name value" pair per line: the bytes written by users, then to all
+ * the disks by class, then the disk bytes per user byte in total and for
+ * data alone, and the CRC and superblock bytes per data byte.
+ */
+static ssize_t write_amp_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
+{
+	struct ssr_wa sum = { 0 }, *wa;
+	u64 total = 0;
+	ssize_t len;
+	int cpu;
+	size_t c;
+
+	for_each_possible_cpu(cpu) {
+		wa = per_cpu_ptr(&wa_stats, cpu);
+		sum.user_bytes += READ_ONCE(wa->user_bytes);
+		for (c = 0; c < SSR_NR_WA; ++c)
+			sum.member_bytes[c] += READ_ONCE(wa->member_bytes[c]);
+	}
+
+	len = sysfs_emit(buf, "user %llu\n", sum.user_bytes);
+	for (c = 0; c < SSR_NR_WA; ++c) {
+		len += sysfs_emit_at(buf, len, "%s %llu\n", wa_names[c],
+				     sum.member_bytes[c]);
+		total += sum.member_bytes[c];
+	}
+
+	len += wa_emit_ratio(buf, len, "amplification", total, sum.user_bytes);
+	len += wa_emit_ratio(buf, len, "data_amplification",
+			     sum.member_bytes[SSR_WA_DATA], sum.user_bytes);
+	len += wa_emit_ratio(buf, len, "metadata_overhead",
+			     sum.member_bytes[SSR_WA_CRC] +
+			     sum.member_bytes[SSR_WA_SB],
+			     sum.member_bytes[SSR_WA_DATA]);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(write_amp);
+
+/*
+ * An IO of a batch, see submit_ios().
+ */
+struct ssr_io {
+	struct block_device *blk_dev;
+	sector_t sector;
+	unsigned int op;
+	struct page *page;
+	size_t len;
+	size_t offset;
+	/* What a write is for */
+	enum ssr_wa_class wa;
+	/* Set by submit_ios() */
+	int err;
+	u64 lat_ns;
+	struct bio *bio;
+	struct ssr_io_batch *batch;
+};
+
+struct ssr_io_batch {
+	atomic_t pending;
+	struct completion done;
+	u64 start_ns;
+};
+
+static void ssr_io_end(struct bio *bio)
+{
+	struct ssr_io *io = bio->bi_private;
+	struct ssr_io_batch *batch = io->batch;
+
+	io->err = blk_status_to_errno(bio->bi_status);
+	io->lat_ns = ktime_get_ns() - batch->start_ns;
+
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/*
+ * Submit a batch of single page IOs at once and wait for all of them, so the
+ * disks of the array work in parallel rather than one after the other. The
+ * IO workqueue runs on the CPU that submitted the user's bio, so the disks'
+ * IOs go to the hardware queues of that CPU and complete on it.
+ *
+ * @ios: The IOs, their err member receives the result.
+ * @n  : The number of IOs.
+ */
+static void submit_ios(struct ssr_io *ios, const size_t n)
+{
+	struct ssr_io_batch batch;
+	struct blk_plug plug;
+	struct ssr_io *io;
+	size_t i;
+
+	/* The submitter holds a reference until all IOs are issued */
+	atomic_set(&batch.pending, 1);
+	init_completion(&batch.done);
+	batch.start_ns = ktime_get_ns();
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; ++i) {
+		io = &ios[i];
+		io->bio = NULL;
+		io->err = fault_before_io(io->blk_dev);
+		if (unlikely(io->err != 0))
+			continue;
+
+		io->batch = &batch;
+		io->bio = bio_alloc(GFP_NOIO, 1);
+		io->bio->bi_disk = io->blk_dev->bd_disk;
+		io->bio->bi_iter.bi_sector = io->sector;
+		io->bio->bi_opf = io->op;
+		io->bio->bi_private = io;
+		io->bio->bi_end_io = ssr_io_end;
+		bio_add_page(io->bio, io->page, io->len, io->offset);
+
+		atomic_inc(&batch.pending);
+		submit_bio(io->bio);
+	}
+	blk_finish_plug(&plug);
+
+	if (!atomic_dec_and_test(&batch.pending))
+		wait_for_completion_io(&batch.done);
+
+	for (i = 0; i < n; ++i) {
+		io = &ios[i];
+		if (io->bio == NULL) {
+			/* Failed by fault injection, as if by the disk */
+			health_account_io(io->blk_dev, 0, io->err);
+			continue;
+		}
+
+		health_account_io(io->blk_dev, io->lat_ns, io->err);
+		bio_put(io->bio);
+
+		if (io->op == REQ_OP_WRITE && io->err == 0)
+			wa_account(io->wa, io->len);
+
+		if (io->op == REQ_OP_READ && io->err == 0)
+			fault_after_read(io->page, io->len, io->offset,
+					 io->blk_dev, io->sector);
+	}
+}
+
 /*
  * Read function to perform IO. It receives an unmapped page to write the disk
  * data to.
@@ -59,400 +868,2906 @@ static void my_block_release(struct gendisk *gd, fmode_t mode)
  * @offset : The offset in the page to write to.
  * @blk_dev: The block device to read from.
  * @sector : The sector of the block device to read from.
+ *
+ * Returns 0 or the error of the IO.
+ */
+static int read_page_from_disk(struct page *page, const size_t len,
+					const size_t offset,
+					struct block_device *blk_dev, sector_t sector)
+{
+	struct ssr_io io = {
+		.blk_dev = blk_dev,
+		.sector = sector,
+		.op = REQ_OP_READ,
+		.page = page,
+		.len = len,
+		.offset = offset,
+	};
+
+	submit_ios(&io, 1);
+
+	return io.err;
+}
+
+static int read_payload_from_disk(sector_t sector, unsigned long offset,
+				   size_t len, struct block_device *blk_dev,
+				   void *out_payload)
+{
+	struct page *page;
+	u8 *buffer;
+	int err;
+
+	page = alloc_page(GFP_NOIO);
+
+	err = read_page_from_disk(page, len, offset, blk_dev, sector);
+
+	/* Save the payload that was read in the page. */
+	buffer = kmap_atomic(page);
+	memcpy(out_payload + offset, buffer + offset, len);
+	kunmap_atomic(buffer);
+
+	__free_page(page);
+
+	return err;
+}
+
+/*
+ * Write function to perform IO. It receives an unmapped page from which to
+ * write the disk data.
+ *
+ * @page   : The page from where to take the data.
+ * @len    : The length of the data to write.
+ * @offset : The offset in the page to write from.
+ * @blk_dev: The block device to write to.
+ * @sector : The sector of the block device to write to.
+ * @wa     : What the write is for.
+ *
+ * Returns 0 or the error of the IO.
+ */
+static int write_page_to_disk(struct page *page, const size_t len,
+				const size_t offset,
+				struct block_device *blk_dev, sector_t sector,
+				enum ssr_wa_class wa)
+{
+	struct ssr_io io = {
+		.blk_dev = blk_dev,
+		.sector = sector,
+		.op = REQ_OP_WRITE,
+		.page = page,
+		.len = len,
+		.offset = offset,
+		.wa = wa,
+	};
+
+	submit_ios(&io, 1);
+
+	return io.err;
+}
+
+/* Every disk, as a mask of the disks' indexes */
+#define SSR_ALL_DISKS ((1U << SSR_NR_DISKS) - 1)
+
+/*
+ * Write the same data to every disk, in parallel.
+ *
+ * Returns the mask of the disks the write failed on.
+ */
+static unsigned int write_page_to_disks(struct page *page, const size_t len,
+					const size_t offset, sector_t sector,
+					enum ssr_wa_class wa)
+{
+	struct ssr_io ios[SSR_NR_DISKS];
+	unsigned int failed = 0;
+	size_t d;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d)
+		ios[d] = (struct ssr_io) {
+			.blk_dev = pdsks[d],
+			.sector = sector,
+			.op = REQ_OP_WRITE,
+			.page = page,
+			.len = len,
+			.offset = offset,
+			.wa = wa,
+		};
+
+	submit_ios(ios, SSR_NR_DISKS);
+
+	for (d = 0; d < SSR_NR_DISKS; ++d)
+		if (ios[d].err != 0)
+			failed |= 1U << d;
+
+	return failed;
+}
+
+static void write_payload_to_disk(void *payload, size_t len, sector_t sector,
+					unsigned long offset,
+					struct block_device *blk_dev,
+					enum ssr_wa_class wa)
+{
+	struct page *page;
+	u8 *buffer;
+
+	/* Write the payload to the page of the bio. */
+	page = alloc_page(GFP_NOIO);
+	buffer = kmap_atomic(page);
+	memcpy(buffer + offset, payload + offset, len);
+	kunmap_atomic(buffer);
+
+	/* Do the writing. */
+	write_page_to_disk(page, len, offset, blk_dev, sector, wa);
+
+	__free_page(page);
+}
+
+/*
+ * The superblock, struct ssr_superblock, records whether the array was shut
+ * down cleanly: it is marked dirty before the first write after assembly and
+ * clean again on unload, once all the data and CRCs are flushed to the disks.
+ */
+static u32 sb_state = SSR_SB_CLEAN;
+static u64 sb_events;
+/*
+ * The array was not shut down cleanly, or a write failed on some of the
+ * disks, and it has not been resynced yet. Written under op_lock and read
+ * under sb_lock, so both sides use WRITE_ONCE/READ_ONCE, like for sb_state,
+ * which is checked without sb_lock.
+ */
+static bool sb_recovery_pending;
+static DEFINE_MUTEX(sb_lock);
+
+static void flush_disks(void)
+{
+	size_t i;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i)
+		blkdev_issue_flush(pdsks[i], GFP_KERNEL);
+}
+
+/*
+ * Write the superblock with the given state to all disks and wait for it to
+ * be on stable storage.
+ *
+ * Note: sb_lock must be held.
+ */
+static void sb_write(u32 state)
+{
+	u8 buffer[KERNEL_SECTOR_SIZE] = { 0 };
+	struct ssr_superblock *sb = (struct ssr_superblock *)buffer;
+	size_t i;
+
+	sb->magic = cpu_to_le32(SSR_SB_MAGIC);
+	sb->version = cpu_to_le32(SSR_SB_VERSION);
+	sb->state = cpu_to_le32(state);
+	sb->events = cpu_to_le64(++sb_events);
+	sb->crc = cpu_to_le32(crc32(CRC_SEED, sb,
+				    offsetof(struct ssr_superblock, crc)));
+
+	for (i = 0; i < SSR_NR_DISKS; ++i)
+		write_payload_to_disk(buffer, KERNEL_SECTOR_SIZE, SSR_SB_SECTOR,
+				      0, pdsks[i], SSR_WA_SB);
+	flush_disks();
+
+	WRITE_ONCE(sb_state, state);
+}
+
+/*
+ * Must be called before anything is written to the disks.
+ */
+static void sb_mark_dirty(void)
+{
+	if (likely(READ_ONCE(sb_state) == SSR_SB_DIRTY))
+		return;
+
+	mutex_lock(&sb_lock);
+	if (sb_state != SSR_SB_DIRTY)
+		sb_write(SSR_SB_DIRTY);
+	mutex_unlock(&sb_lock);
+}
+
+/*
+ * Mark the array clean, unless it still has to be resynced.
+ *
+ * Note: no write may be in flight.
+ */
+static void sb_mark_clean(void)
+{
+	mutex_lock(&sb_lock);
+	if (sb_state == SSR_SB_DIRTY && !READ_ONCE(sb_recovery_pending)) {
+		/* The data and CRCs reach stable storage before the marker */
+		flush_disks();
+		sb_write(SSR_SB_CLEAN);
+	}
+	mutex_unlock(&sb_lock);
+}
+
+/*
+ * Read the superblocks of all disks. The array needs recovery if any disk
+ * was left dirty, can not be read or holds no valid superblock: a blank
+ * replacement disk has to be brought in sync like one left dirty. Members
+ * prepared with tools/offline/ssr-init assemble clean.
+ *
+ * Returns true if the array was shut down cleanly.
+ */
+static bool sb_load(void)
+{
+	u8 buffer[KERNEL_SECTOR_SIZE];
+	struct ssr_superblock *sb = (struct ssr_superblock *)buffer;
+	bool clean = true;
+	size_t i;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (read_payload_from_disk(SSR_SB_SECTOR, 0, KERNEL_SECTOR_SIZE,
+					   pdsks[i], buffer) != 0) {
+			clean = false;
+			continue;
+		}
+
+		if (le32_to_cpu(sb->magic) != SSR_SB_MAGIC ||
+		    le32_to_cpu(sb->crc) !=
+		    crc32(CRC_SEED, sb, offsetof(struct ssr_superblock, crc))) {
+			pr_warn("disk %s holds no valid superblock\n",
+				pdsk_names[i]);
+			clean = false;
+			continue;
+		}
+
+		if (le32_to_cpu(sb->state) != SSR_SB_CLEAN)
+			clean = false;
+
+		sb_events = max_t(u64, sb_events, le64_to_cpu(sb->events));
+	}
+
+	WRITE_ONCE(sb_state, clean ? SSR_SB_CLEAN : SSR_SB_DIRTY);
+	WRITE_ONCE(sb_recovery_pending, !clean);
+
+	return clean;
+}
+
+/*
+ * Repair the sectors of a disk that failed the check, using the data and CRCs
+ * read from it in the first pass: the good data is written over the broken
+ * sectors and the disk's own CRC sectors are patched and written back once.
+ *
+ * @mismatch      : The sectors to repair, as filled by check_data.
+ * @nr_sectors    : The number of sectors in the segment.
+ * @good_data_page: The page of good data to use to repair the broken disk.
+ * @data_offset   : The offset of the segment in good_data_page.
+ * @crc_page      : The CRCs read from the broken disk.
+ * @crc_index_f   : The first index of the CRC in the two allocated SECTORS.
+ * @sector        : The first sector of the segment.
+ * @blk_dev       : The block device to repair.
+ * @wa            : Whether this is a repair or a resync.
+ *
+ * Returns true if every write of the repair succeeded.
+ */
+static bool repair_data(const unsigned long *mismatch, const size_t nr_sectors,
+			struct page *good_data_page, const size_t data_offset,
+			struct page *crc_page, const size_t crc_index_f,
+			const sector_t sector, struct block_device *blk_dev,
+			enum ssr_wa_class wa)
+{
+	const sector_t crc_sector_f = get_crc_sector(sector);
+	bool crc_dirty[2];
+	size_t i;
+	int err = 0;
+
+	sb_mark_dirty();
+
+	repair_crcs(mismatch, nr_sectors, good_data_page, data_offset,
+		    crc_page, crc_index_f, crc_dirty);
+
+	for_each_set_bit(i, mismatch, nr_sectors) {
+		err |= write_page_to_disk(good_data_page, KERNEL_SECTOR_SIZE,
+					  data_offset + i * KERNEL_SECTOR_SIZE,
+					  blk_dev, sector + i, wa);
+	}
+
+	for (i = 0; i < 2; ++i)
+		if (crc_dirty[i])
+			err |= write_page_to_disk(crc_page, KERNEL_SECTOR_SIZE,
+						  i * KERNEL_SECTOR_SIZE,
+						  blk_dev, crc_sector_f + i, wa);
+
+	return err == 0;
+}
+
+static void copy_segment(struct page *dst, struct page *src,
+			 const size_t offset, const size_t len)
+{
+	u8 *m_src, *m_dst;
+
+	m_src = kmap_atomic(src);
+	m_dst = kmap_atomic(dst);
+	memcpy(m_dst + offset, m_src + offset, len);
+	kunmap_atomic(m_dst);
+	kunmap_atomic(m_src);
+}
+
+/*
+ * Mark the sectors of a copy that passed its own CRC check but differ from
+ * the good copy, so they are repaired from it like broken ones.
+ *
+ * Returns the number of sectors marked.
+ */
+static size_t mark_diverged(struct page *page, struct page *good_page,
+			    const size_t data_offset, const size_t nr_sectors,
+			    unsigned long *mismatch)
+{
+	size_t i, off, nr_diverged = 0;
+	u8 *m_data, *m_good;
+
+	m_data = kmap_atomic(page);
+	m_good = kmap_atomic(good_page);
+	for (i = 0; i < nr_sectors; ++i) {
+		off = data_offset + i * KERNEL_SECTOR_SIZE;
+		if (test_bit(i, mismatch) ||
+		    memcmp(m_data + off, m_good + off, KERNEL_SECTOR_SIZE) == 0)
+			continue;
+		__set_bit(i, mismatch);
+		++nr_diverged;
+	}
+	kunmap_atomic(m_good);
+	kunmap_atomic(m_data);
+
+	return nr_diverged;
+}
+
+/*
+ * Disks that missed a write to each block, as masks of their indexes. A write
+ * that fails on some disks only leaves them with old data and CRCs that may
+ * well match each other, so they are never read alone for the block and
+ * check_disks() takes them as broken until they are repaired. The array
+ * stays dirty meanwhile, see sb_recovery_pending.
+ *
+ * A block is changed with its region held exclusively and read with it held
+ * at least shared.
+ */
+static u8 stale[SSR_STALE_BLOCKS];
+
+/* The disks that missed a write to any block of the range */
+static unsigned int stale_disks(sector_t sector, size_t nr_sectors)
+{
+	unsigned int disks = 0;
+	size_t b;
+
+	for (b = sector >> SSR_STALE_SHIFT;
+	     b <= (sector + nr_sectors - 1) >> SSR_STALE_SHIFT; ++b)
+		disks |= stale[b];
+
+	return disks;
+}
+
+static void stale_set(sector_t sector, size_t nr_sectors, unsigned int disks)
+{
+	size_t b;
+
+	for (b = sector >> SSR_STALE_SHIFT;
+	     b <= (sector + nr_sectors - 1) >> SSR_STALE_SHIFT; ++b)
+		stale[b] |= disks;
+}
+
+/* Only blocks the range covers entirely were repaired */
+static void stale_clear(sector_t sector, size_t nr_sectors, unsigned int disks)
+{
+	size_t b;
+
+	for (b = DIV_ROUND_UP(sector, 1 << SSR_STALE_SHIFT);
+	     b < (sector + nr_sectors) >> SSR_STALE_SHIFT; ++b)
+		stale[b] &= ~disks;
+}
+
+/* Flags of check_disks */
+#define SSR_CHECK_REPAIR 1
+/* Read degrading disks even when a healthy one holds good data */
+#define SSR_CHECK_ALL 2
+/* The repair writes are resync traffic, see write_amp_show() */
+#define SSR_CHECK_RESYNC 4
+
+/*
+ * Read a segment from every disk, hand the first copy that matches its CRCs
+ * to the user and, if asked to, repair the other disks. Each disk is read
+ * exactly once: the data, CRCs and missmatches of every disk are kept until
+ * the repair is done. Healthy disks are read first, and unless SSR_CHECK_ALL
+ * is given or the read samples them, see health_sample_due(), degrading ones
+ * are only read if no healthy one had good data.
+ *
+ * With SSR_CHECK_ALL, copies that pass their own CRC check but differ from
+ * the good one are broken too, as in ssr-fsck: a crash between the writes
+ * of two disks leaves both consistent. They are made equal to the copy of
+ * the healthiest disk, which is also the one handed to the user. Disks that
+ * missed a write to the segment, see stale_disks(), are always broken.
+ *
+ * @bvec  : The segment, its page receives the good data.
+ * @sector: The first sector of the segment.
+ * @flags : SSR_CHECK_* flags.
+ * @res   : If not NULL, the counters of broken, repaired and lost sectors are
+ *        increased.
+ *
+ * Returns 0, or -EIO if no disk holds good data or a repair failed.
+ *
+ * Note: the regions of the segment must be held, exclusively to repair.
+ */
+static int check_disks(const struct bio_vec bvec, const sector_t sector,
+		       const unsigned int flags, struct ssr_range_result *res)
+{
+	int ret = 0;
+
+	/*
+	 * Per disk buffers and sectors that failed the check, indexed by the
+	 * position of the disk in the read order.
+	 */
+	size_t order[SSR_NR_DISKS];
+	struct page *data_pages[SSR_NR_DISKS] = { NULL };
+	struct page *crc_pages[SSR_NR_DISKS] = { NULL };
+	unsigned long mismatch[SSR_NR_DISKS][BITS_TO_LONGS(SSR_SEG_MAX_SECTORS)];
+	bool read_failed[SSR_NR_DISKS] = { false };
+	size_t good_disk_index = SSR_NR_DISKS;
+	struct ssr_io ios[2 * SSR_NR_DISKS];
+	size_t nr_first, lo, hi;
+
+	struct page *user_page = bvec.bv_page;
+	size_t data_len = bvec.bv_len;
+	size_t data_offset = bvec.bv_offset;
+	size_t nr_sectors = data_len / KERNEL_SECTOR_SIZE;
+	unsigned int stale_mask = stale_disks(sector, nr_sectors);
+	unsigned int repaired = 0;
+
+	size_t i;
+	/* CRC info for the current read operation */
+	/* First CRC's sector */
+	sector_t crc_sector_f = get_crc_sector(sector);
+	/* First CRC's index */
+	size_t   crc_index_f  = get_crc_index(sector);
+	/* Read 2 sectors of CRCs only if we have data spread between them */
+	size_t crc_data_size  = get_crc_len(sector, nr_sectors);
+
+	/*
+	 * All disks are read in the first round if asked to, if none is
+	 * healthy or if the degrading ones are due to be sampled.
+	 */
+	nr_first = health_read_order(order, 0);
+	if ((flags & SSR_CHECK_ALL) || nr_first == 0 ||
+	    (nr_first != SSR_NR_DISKS && health_sample_due()))
+		nr_first = SSR_NR_DISKS;
+
+	/* The first disk is read straight into the user's page */
+	data_pages[0] = user_page;
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (i != 0)
+			data_pages[i] = alloc_page(GFP_NOIO);
+		crc_pages[i] = alloc_page(GFP_NOIO);
+
+		if (data_pages[i] == NULL || crc_pages[i] == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/*
+	 * Check the sector on the disks, reading all the disks of a round in
+	 * parallel: healthy ones first, degrading ones only if no healthy one
+	 * had good data.
+	 */
+	for (lo = 0; lo < SSR_NR_DISKS &&
+		     good_disk_index == SSR_NR_DISKS; lo = hi) {
+		hi = lo == 0 ? nr_first : SSR_NR_DISKS;
+
+		/*
+		 * Read the data and the CRC data from the disk.
+		 * Note: offset is 0 so we have CRCs at the beggining of the page
+		 */
+		for (i = lo; i < hi; ++i) {
+			ios[2 * (i - lo)] = (struct ssr_io) {
+				.blk_dev = pdsks[order[i]],
+				.sector = sector,
+				.op = REQ_OP_READ,
+				.page = data_pages[i],
+				.len = data_len,
+				.offset = data_offset,
+			};
+			ios[2 * (i - lo) + 1] = (struct ssr_io) {
+				.blk_dev = pdsks[order[i]],
+				.sector = crc_sector_f,
+				.op = REQ_OP_READ,
+				.page = crc_pages[i],
+				.len = crc_data_size,
+				.offset = 0,
+			};
+		}
+		submit_ios(ios, 2 * (hi - lo));
+
+		for (i = lo; i < hi; ++i) {
+			if (ios[2 * (i - lo)].err != 0 ||
+			    ios[2 * (i - lo) + 1].err != 0) {
+				/* An unreadable disk is repaired like a corrupted one */
+				read_failed[i] = true;
+				bitmap_zero(mismatch[i], SSR_SEG_MAX_SECTORS);
+				bitmap_set(mismatch[i], 0, nr_sectors);
+				continue;
+			}
+
+			if (check_data(data_pages[i], data_len, data_offset,
+				       crc_pages[i], crc_index_f, mismatch[i]) &&
+			    good_disk_index == SSR_NR_DISKS &&
+			    !(stale_mask & (1U << order[i])))
+				good_disk_index = i;
+
+			health_account_check(order[i], nr_sectors,
+					     bitmap_weight(mismatch[i], nr_sectors));
+
+			/* Its old data is rewritten like broken data */
+			if (unlikely(stale_mask & (1U << order[i])))
+				bitmap_set(mismatch[i], 0, nr_sectors);
+		}
+	} /* Now we passed through all disks */
+
+	/* Leave degrading disks alone once good data was found */
+	for (i = lo; i < SSR_NR_DISKS; ++i)
+		bitmap_zero(mismatch[i], SSR_SEG_MAX_SECTORS);
+
+	if ((flags & SSR_CHECK_ALL) && good_disk_index != SSR_NR_DISKS)
+		for (i = 0; i < SSR_NR_DISKS; ++i)
+			if (i != good_disk_index && !read_failed[i])
+				counter_add(SSR_CNT_DIVERGED,
+					    mark_diverged(data_pages[i],
+							  data_pages[good_disk_index],
+							  data_offset, nr_sectors,
+							  mismatch[i]));
+
+	if (res != NULL)
+		for (i = 0; i < SSR_NR_DISKS; ++i)
+			res->nr_bad += bitmap_weight(mismatch[i], nr_sectors);
+
+	if (good_disk_index == SSR_NR_DISKS) {
+		/* No uncorrupted disk was found */
+		pr_alert_once("[WARN]: All disks are corrupted!\n");
+		if (res != NULL)
+			res->nr_lost += nr_sectors;
+		ret = -EIO;
+		goto out;
+	}
+
+	/* The user's page holds the first disk's data, which may be broken */
+	if (good_disk_index != 0)
+		copy_segment(user_page, data_pages[good_disk_index], data_offset,
+			     data_len);
+
+	if (!(flags & SSR_CHECK_REPAIR))
+		goto out;
+
+	/* Repair the broken disks from what was read in the first pass */
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (likely(bitmap_empty(mismatch[i], nr_sectors)))
+			continue;
+
+		/* The disk's own CRCs are unknown, start from the good ones */
+		if (read_failed[i])
+			copy_segment(crc_pages[i], crc_pages[good_disk_index], 0,
+				     crc_data_size);
+
+		if (!repair_data(mismatch[i], nr_sectors, user_page, data_offset,
+				 crc_pages[i], crc_index_f, sector,
+				 pdsks[order[i]],
+				 (flags & SSR_CHECK_RESYNC) ? SSR_WA_RESYNC :
+							      SSR_WA_REPAIR)) {
+			ret = -EIO;
+			continue;
+		}
+		repaired |= 1U << order[i];
+		if (res != NULL)
+			res->nr_repaired += bitmap_weight(mismatch[i], nr_sectors);
+	}
+
+	if (unlikely(stale_mask & repaired))
+		stale_clear(sector, nr_sectors, stale_mask & repaired);
+
+out:
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (i != 0 && data_pages[i] != NULL)
+			__free_page(data_pages[i]);
+		if (crc_pages[i] != NULL)
+			__free_page(crc_pages[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Read a segment for a user whose regions are held shared, so nothing is
+ * repaired: the broken copies found are counted in res->nr_bad.
+ */
+static inline int read_and_check_disks(const struct bio_vec bvec,
+				       const sector_t sector,
+				       struct ssr_range_result *res)
+{
+	return check_disks(bvec, sector, 0, res);
+}
+
+/*
+ * Blocks of a page written to all the disks within the last recent_write_ms.
+ * Once such a write completed the disks held the same data and CRCs, so a
+ * read of recent blocks checks a single disk against its CRCs and only falls
+ * back to check_disks() if that fails. Blocks are kept in two generations
+ * and the older one is dropped every window, so a block stays recent for
+ * one to two windows. Injected faults always take the full path.
+ */
+static DECLARE_BITMAP(recent_gen0, SSR_RECENT_BLOCKS);
+static DECLARE_BITMAP(recent_gen1, SSR_RECENT_BLOCKS);
+static unsigned long *recent_new = recent_gen0;
+static unsigned long *recent_old = recent_gen1;
+/* When recent_new was started, in jiffies */
+static unsigned long recent_epoch;
+static DEFINE_SPINLOCK(recent_lock);
+
+/* Called with recent_lock held */
+static void recent_rotate(void)
+{
+	unsigned long window = msecs_to_jiffies(READ_ONCE(recent_write_ms));
+
+	if (time_before(jiffies, recent_epoch + window))
+		return;
+
+	swap(recent_new, recent_old);
+	bitmap_zero(recent_new, SSR_RECENT_BLOCKS);
+	if (!time_before(jiffies, recent_epoch + 2 * window))
+		bitmap_zero(recent_old, SSR_RECENT_BLOCKS);
+	recent_epoch = jiffies;
+}
+
+/*
+ * Record the result of a write of a segment. The blocks it fully covers
+ * become recent if it reached every disk, otherwise all the blocks it
+ * touched are dropped as the disks may now differ.
+ */
+static void recent_mark(const sector_t sector, const size_t nr_sectors,
+			const bool written)
+{
+	sector_t first, end;
+
+	if (written && READ_ONCE(recent_write_ms) == 0)
+		return;
+
+	spin_lock(&recent_lock);
+	recent_rotate();
+	if (written) {
+		first = DIV_ROUND_UP(sector, 1 << SSR_RECENT_SHIFT);
+		end = (sector + nr_sectors) >> SSR_RECENT_SHIFT;
+		if (first < end)
+			bitmap_set(recent_new, first, end - first);
+	} else {
+		first = sector >> SSR_RECENT_SHIFT;
+		end = DIV_ROUND_UP(sector + nr_sectors, 1 << SSR_RECENT_SHIFT);
+		bitmap_clear(recent_new, first, end - first);
+		bitmap_clear(recent_old, first, end - first);
+	}
+	spin_unlock(&recent_lock);
+}
+
+static bool recent_covers(const sector_t sector, const size_t nr_sectors)
+{
+	sector_t b, end = DIV_ROUND_UP(sector + nr_sectors,
+				       1 << SSR_RECENT_SHIFT);
+	bool covered = true;
+
+	if (READ_ONCE(recent_write_ms) == 0 || fault_inject)
+		return false;
+
+	spin_lock(&recent_lock);
+	recent_rotate();
+	for (b = sector >> SSR_RECENT_SHIFT; b < end && covered; ++b)
+		covered = test_bit(b, recent_new) || test_bit(b, recent_old);
+	spin_unlock(&recent_lock);
+
+	return covered;
+}
+
+/*
+ * Read a segment of recently written blocks from one disk and check it
+ * against that disk's CRCs.
+ *
+ * Returns true if the user's page holds good data.
+ */
+static bool recent_read(const struct bio_vec bvec, const sector_t sector)
+{
+	size_t nr_sectors = bvec.bv_len / KERNEL_SECTOR_SIZE;
+	sector_t crc_sector_f = get_crc_sector(sector);
+	size_t crc_data_size = get_crc_len(sector, nr_sectors);
+	unsigned long mismatch[BITS_TO_LONGS(SSR_SEG_MAX_SECTORS)];
+	struct ssr_io ios[2];
+	struct page *crc_page;
+	size_t disk;
+	bool good;
+
+	/* The disk picked may have missed the last write */
+	if (unlikely(stale_disks(sector, nr_sectors) != 0))
+		return false;
+
+	crc_page = alloc_page(GFP_NOIO);
+	if (crc_page == NULL)
+		return false;
+
+	disk = health_pick(0);
+	ios[0] = (struct ssr_io) {
+		.blk_dev = pdsks[disk],
+		.sector = sector,
+		.op = REQ_OP_READ,
+		.page = bvec.bv_page,
+		.len = bvec.bv_len,
+		.offset = bvec.bv_offset,
+	};
+	ios[1] = (struct ssr_io) {
+		.blk_dev = pdsks[disk],
+		.sector = crc_sector_f,
+		.op = REQ_OP_READ,
+		.page = crc_page,
+		.len = crc_data_size,
+		.offset = 0,
+	};
+	submit_ios(ios, 2);
+
+	good = ios[0].err == 0 && ios[1].err == 0 &&
+	       check_data(bvec.bv_page, bvec.bv_len, bvec.bv_offset, crc_page,
+			  get_crc_index(sector), mismatch);
+	if (good)
+		health_account_check(disk, nr_sectors, 0);
+
+	__free_page(crc_page);
+
+	return good;
+}
+
+static void recent_debugfs_init(struct dentry *parent)
+{
+	struct dentry *dir = debugfs_create_dir("recent", parent);
+
+	counter_debugfs("hits", dir, SSR_CNT_RECENT_HITS);
+	counter_debugfs("fallbacks", dir, SSR_CNT_RECENT_FALLBACKS);
+}
+
+/*
+ * Prefetched windows bypass read_page_from_disk, so readahead is off while
+ * faults are injected to have every read see them.
+ */
+static inline bool ssr_ra_enabled(void)
+{
+	return readahead && !fault_inject;
+}
+
+static void ssr_ra_end_io(struct bio *bio)
+{
+	struct ssr_ra_window *win = bio->bi_private;
+
+	if (bio->bi_status)
+		win->status = bio->bi_status;
+	bio_put(bio);
+
+	/* Every reader of the window waits on it */
+	if (atomic_dec_and_test(&win->pending))
+		complete_all(&win->done);
+}
+
+/*
+ * Whether a window is read by someone or still being prefetched, so it can
+ * not be refilled.
+ *
+ * Note: ra_lock must be held.
+ */
+static bool ssr_ra_busy(struct ssr_ra_window *win)
+{
+	if (win->in_flight && completion_done(&win->done))
+		win->in_flight = false;
+
+	return win->users != 0 || win->in_flight;
+}
+
+/*
+ * Claim a window to prefetch [start, start + nr_sectors) into, unless it is
+ * busy: readahead is only a hint, so the stream rather skips a window than
+ * waits for it.
+ *
+ * Returns the number of sectors to read, 0 if there is nothing to do.
+ *
+ * Note: ra_lock must be held.
+ */
+static unsigned int ssr_ra_claim(struct ssr_ra_window *win, sector_t start,
+				 unsigned int nr_sectors)
+{
+	if (start >= LOGICAL_DISK_SECTORS || ssr_ra_busy(win))
+		return 0;
+	if (nr_sectors > LOGICAL_DISK_SECTORS - start)
+		nr_sectors = LOGICAL_DISK_SECTORS - start;
+
+	win->start = start;
+	win->nr_sectors = nr_sectors;
+	win->status = BLK_STS_OK;
+	win->valid = true;
+	win->in_flight = true;
+	atomic_set(&win->pending, 2);
+	reinit_completion(&win->done);
+
+	return nr_sectors;
+}
+
+/*
+ * Start reading a window claimed by ssr_ra_claim() without waiting for the
+ * result. Readers finding the window meanwhile wait for its completion.
+ */
+static void ssr_ra_issue(struct ssr_ra_window *win, struct block_device *blk_dev)
+{
+	struct bio *data_bio, *crc_bio;
+	sector_t crc_sector_f, crc_sector_l;
+	size_t data_size, i;
+
+	crc_sector_f = get_crc_sector(win->start);
+	crc_sector_l = get_crc_sector(win->start + win->nr_sectors - 1);
+	data_size = win->nr_sectors * KERNEL_SECTOR_SIZE;
+
+	data_bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(data_size, PAGE_SIZE));
+	crc_bio = bio_alloc(GFP_NOIO, 1);
+
+	data_bio->bi_disk = blk_dev->bd_disk;
+	data_bio->bi_iter.bi_sector = win->start;
+	data_bio->bi_opf = REQ_OP_READ | REQ_RAHEAD;
+	data_bio->bi_end_io = ssr_ra_end_io;
+	data_bio->bi_private = win;
+	for (i = 0; i < data_size; i += PAGE_SIZE)
+		bio_add_page(data_bio, win->data_pages[i / PAGE_SIZE],
+			     min_t(size_t, data_size - i, PAGE_SIZE), 0);
+
+	crc_bio->bi_disk = blk_dev->bd_disk;
+	crc_bio->bi_iter.bi_sector = crc_sector_f;
+	crc_bio->bi_opf = REQ_OP_READ | REQ_RAHEAD;
+	crc_bio->bi_end_io = ssr_ra_end_io;
+	crc_bio->bi_private = win;
+	bio_add_page(crc_bio, win->crc_page,
+		     (crc_sector_l - crc_sector_f + 1) * KERNEL_SECTOR_SIZE, 0);
+
+	submit_bio(data_bio);
+	submit_bio(crc_bio);
+}
+
+static inline bool ssr_ra_covers(const struct ssr_ra_window *win,
+				 sector_t sector, size_t nr_sectors)
+{
+	return win->valid && sector >= win->start &&
+	       sector + nr_sectors <= win->start + win->nr_sectors;
+}
+
+/*
+ * Try to serve a segment from a readahead window. Every sector is checked
+ * against its prefetched CRC of the one disk the window was read from; the
+ * other disks are not looked at, so they are only repaired when a missmatch
+ * sends the caller to the full check of all disks.
+ *
+ * Returns true if the segment was copied to the user's page.
+ */
+static bool ssr_ra_serve(const struct bio_vec bvec, const sector_t sector)
+{
+	struct ssr_ra_window *win = NULL;
+	size_t nr_sectors = bvec.bv_len / KERNEL_SECTOR_SIZE;
+	u8 *m_user, *m_data;
+	u32 *m_crc;
+	size_t i, s, crc_index;
+	bool served = false;
+
+	/* The window may come from a disk that missed the last write */
+	if (!ssr_ra_enabled() || unlikely(stale_disks(sector, nr_sectors) != 0))
+		return false;
+
+	spin_lock(&ra_lock);
+	for (i = 0; i < SSR_RA_STREAMS * 2 && win == NULL; ++i) {
+		struct ssr_ra_window *w = &ra_streams[i / 2].win[i % 2];
+
+		if (ssr_ra_covers(w, sector, nr_sectors))
+			win = w;
+	}
+	if (win != NULL)
+		++win->users;
+	spin_unlock(&ra_lock);
+
+	if (win == NULL)
+		return false;
+
+	/* The reference keeps the window from being refilled meanwhile */
+	wait_for_completion(&win->done);
+	if (win->status != BLK_STS_OK || !READ_ONCE(win->valid))
+		goto out;
+
+	crc_index = get_crc_index(win->start) + (sector - win->start);
+	m_crc = kmap_atomic(win->crc_page);
+	for (i = 0; i < nr_sectors; ++i) {
+		s = (sector - win->start + i) * KERNEL_SECTOR_SIZE;
+		m_data = kmap_atomic(win->data_pages[s / PAGE_SIZE]);
+		if (crc32(CRC_SEED, m_data + s % PAGE_SIZE, KERNEL_SECTOR_SIZE) !=
+		    m_crc[crc_index + i]) {
+			kunmap_atomic(m_data);
+			break;
+		}
+		m_user = kmap_atomic(bvec.bv_page);
+		memcpy(m_user + bvec.bv_offset + i * KERNEL_SECTOR_SIZE,
+		       m_data + s % PAGE_SIZE, KERNEL_SECTOR_SIZE);
+		kunmap_atomic(m_user);
+		kunmap_atomic(m_data);
+	}
+	kunmap_atomic(m_crc);
+
+	served = (i == nr_sectors);
+
+out:
+	spin_lock(&ra_lock);
+	/*
+	 * Failed reads and corrupted data are left to the full check and
+	 * never cached again
+	 */
+	if (!served)
+		win->valid = false;
+	--win->users;
+	spin_unlock(&ra_lock);
+
+	return served;
+}
+
+/*
+ * Record a completed read of [sector, sector + nr_sectors) and, if it
+ * continues a known stream, make sure the data that follows is being fetched.
+ * The window grows every time a stream consumes one, up to
+ * SSR_RA_MAX_SECTORS, and restarts from SSR_RA_MIN_SECTORS on a new stream.
+ */
+static void ssr_ra_account(sector_t sector, size_t nr_sectors)
+{
+	struct ssr_ra_stream *stream = NULL;
+	struct ssr_ra_window *cur = NULL, *next = NULL;
+	sector_t end = sector + nr_sectors;
+	size_t i, disk = 0;
+
+	if (!ssr_ra_enabled())
+		return;
+
+	spin_lock(&ra_lock);
+
+	for (i = 0; i < SSR_RA_STREAMS; ++i) {
+		if (ra_streams[i].next_sector == sector) {
+			stream = &ra_streams[i];
+			break;
+		}
+	}
+
+	if (stream == NULL) {
+		/* Not sequential: recycle the least recently used stream */
+		stream = &ra_streams[0];
+		for (i = 1; i < SSR_RA_STREAMS; ++i)
+			if (time_before(ra_streams[i].last_used, stream->last_used))
+				stream = &ra_streams[i];
+
+		stream->next_sector = end;
+		stream->win_sectors = SSR_RA_MIN_SECTORS;
+		stream->last_used = jiffies;
+		stream->win[0].valid = false;
+		stream->win[1].valid = false;
+		goto out;
+	}
+
+	stream->next_sector = end;
+	stream->last_used = jiffies;
+
+	for (i = 0; i < 2; ++i)
+		if (ssr_ra_covers(&stream->win[i], end, 1))
+			cur = &stream->win[i];
+
+	if (cur == NULL) {
+		/* The reader is past both windows, start over at its position */
+		if (ssr_ra_claim(&stream->win[0], end, stream->win_sectors))
+			next = &stream->win[0];
+		goto out;
+	}
+
+	next = (cur == &stream->win[0]) ? &stream->win[1] : &stream->win[0];
+	if (next->valid && next->start == cur->start + cur->nr_sectors) {
+		next = NULL;
+		goto out;
+	}
+
+	stream->win_sectors = min(stream->win_sectors * 2, SSR_RA_MAX_SECTORS);
+	/* Alternate the healthy mirrors the windows are read from */
+	disk = next - stream->win;
+	if (!ssr_ra_claim(next, cur->start + cur->nr_sectors,
+			  stream->win_sectors))
+		next = NULL;
+
+out:
+	spin_unlock(&ra_lock);
+
+	if (next != NULL)
+		ssr_ra_issue(next, pdsks[health_pick(disk)]);
+}
+
+/*
+ * Drop every window overlapping [sector, sector + nr_sectors), their data or
+ * CRCs are about to be changed. Prefetches take no region locks, so one may
+ * be issued while the change is in flight and read the old data and CRCs:
+ * writers call this again once their IO completed, before they release the
+ * region locks that keep readers of the range waiting.
+ */
+static void ssr_ra_invalidate(sector_t sector, size_t nr_sectors)
+{
+	size_t i;
+
+	spin_lock(&ra_lock);
+	for (i = 0; i < SSR_RA_STREAMS * 2; ++i) {
+		struct ssr_ra_window *w = &ra_streams[i / 2].win[i % 2];
+
+		if (sector < w->start + w->nr_sectors &&
+		    w->start < sector + nr_sectors)
+			w->valid = false;
+	}
+	spin_unlock(&ra_lock);
+}
+
+static void ssr_ra_free(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < SSR_RA_STREAMS * 2; ++i) {
+		struct ssr_ra_window *w = &ra_streams[i / 2].win[i % 2];
+
+		if (w->in_flight)
+			wait_for_completion(&w->done);
+		for (j = 0; j < SSR_RA_DATA_PAGES; ++j)
+			if (w->data_pages[j] != NULL)
+				__free_page(w->data_pages[j]);
+		if (w->crc_page != NULL)
+			__free_page(w->crc_page);
+	}
+}
+
+static int ssr_ra_init(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < SSR_RA_STREAMS * 2; ++i) {
+		struct ssr_ra_window *w = &ra_streams[i / 2].win[i % 2];
+
+		init_completion(&w->done);
+		for (j = 0; j < SSR_RA_DATA_PAGES; ++j) {
+			w->data_pages[j] = alloc_page(GFP_KERNEL);
+			if (w->data_pages[j] == NULL)
+				goto out_free;
+		}
+		w->crc_page = alloc_page(GFP_KERNEL);
+		if (w->crc_page == NULL)
+			goto out_free;
+	}
+
+	for (i = 0; i < SSR_RA_STREAMS; ++i) {
+		ra_streams[i].next_sector = SSR_RA_NO_SECTOR;
+		ra_streams[i].win_sectors = SSR_RA_MIN_SECTORS;
+	}
+
+	return 0;
+
+out_free:
+	ssr_ra_free();
+	return -ENOMEM;
+}
+
+/*
+ * Check-only verification. A range of sectors is read from every disk in
+ * chunks and each sector is checked against its CRC without writing
+ * anything. Missmatches are counted per disk and kind and the first
+ * SSR_VERIFY_MAX_REPORT of them are listed in debugfs:
+ *   data - the data is broken, the CRC matches the good disk's
+ *   crc  - the CRC is broken, the data matches the good disk's
+ *   both - both differ from the good disk
+ *   lost - no disk holds a good copy of the sector
+ */
+enum ssr_mismatch_kind {
+	SSR_MISMATCH_DATA,
+	SSR_MISMATCH_CRC,
+	SSR_MISMATCH_BOTH,
+	SSR_MISMATCH_LOST,
+	SSR_MISMATCH_KINDS,
+};
+
+static const char * const mismatch_kind_names[] = {
+	[SSR_MISMATCH_DATA] = "data",
+	[SSR_MISMATCH_CRC] = "crc",
+	[SSR_MISMATCH_BOTH] = "both",
+	[SSR_MISMATCH_LOST] = "lost",
+};
+
+struct ssr_mismatch {
+	sector_t sector;
+	u8 disk;
+	u8 kind;
+};
+
+static struct ssr_verify {
+	sector_t start;
+	sector_t end;
+
+	u64 counts[SSR_NR_DISKS][SSR_MISMATCH_KINDS];
+	struct ssr_mismatch *report;
+	size_t nr_report;
+	u64 nr_dropped;
+
+	/*
+	 * Only used by verify_chunk(), whose steps never run alongside each
+	 * other, see op_work()
+	 */
+	struct page *data_pages[SSR_NR_DISKS][SSR_VERIFY_DATA_PAGES];
+	struct page *crc_pages[SSR_NR_DISKS];
+	struct ssr_io ios[SSR_NR_DISKS * (SSR_VERIFY_DATA_PAGES + 1)];
+} verify;
+
+/* Guards the range, counts and report, never held across IO */
+static DEFINE_MUTEX(verify_lock);
+
+static inline u8 *verify_sector_data(size_t disk, size_t i)
+{
+	size_t off = i * KERNEL_SECTOR_SIZE;
+
+	return (u8 *)page_address(verify.data_pages[disk][off / PAGE_SIZE]) +
+	       off % PAGE_SIZE;
+}
+
+/*
+ * Note: verify_lock must be held.
+ */
+static void verify_record(size_t disk, sector_t sector,
+			  enum ssr_mismatch_kind kind)
+{
+	++verify.counts[disk][kind];
+
+	if (verify.nr_report == SSR_VERIFY_MAX_REPORT) {
+		++verify.nr_dropped;
+		return;
+	}
+
+	verify.report[verify.nr_report].sector = sector;
+	verify.report[verify.nr_report].disk = disk;
+	verify.report[verify.nr_report].kind = kind;
+	++verify.nr_report;
+}
+
+/*
+ * Check the sectors [start, start + nr_sectors) on all disks. The data and
+ * CRCs of all the disks are read in a single batch, so the disks work in
+ * parallel.
+ *
+ * Returns the number of missmatches found.
+ */
+static u64 verify_chunk(sector_t start, size_t nr_sectors)
+{
+	const sector_t crc_sector_f = get_crc_sector(start);
+	const size_t crc_index_f = get_crc_index(start);
+	const size_t crc_len = get_crc_len(start, nr_sectors);
+	const size_t data_len = nr_sectors * KERNEL_SECTOR_SIZE;
+	bool readable[SSR_NR_DISKS];
+	bool ok[SSR_NR_DISKS];
+	u32 *crcs_of[SSR_NR_DISKS];
+	size_t good, d, i, n = 0, off;
+	enum ssr_mismatch_kind kind;
+	bool data_eq, crc_eq;
+	u64 nr_bad = 0;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d) {
+		for (off = 0; off < data_len; off += PAGE_SIZE)
+			verify.ios[n++] = (struct ssr_io) {
+				.blk_dev = pdsks[d],
+				.sector = start + off / KERNEL_SECTOR_SIZE,
+				.op = REQ_OP_READ,
+				.page = verify.data_pages[d][off / PAGE_SIZE],
+				.len = min_t(size_t, data_len - off, PAGE_SIZE),
+				.offset = 0,
+			};
+		verify.ios[n++] = (struct ssr_io) {
+			.blk_dev = pdsks[d],
+			.sector = crc_sector_f,
+			.op = REQ_OP_READ,
+			.page = verify.crc_pages[d],
+			.len = crc_len,
+			.offset = 0,
+		};
+	}
+	submit_ios(verify.ios, n);
+
+	/* Each disk had its data pages and then its CRC page read */
+	for (d = 0, n = 0; d < SSR_NR_DISKS; ++d) {
+		readable[d] = true;
+		for (i = 0; i <= DIV_ROUND_UP(data_len, PAGE_SIZE); ++i)
+			if (verify.ios[n++].err != 0)
+				readable[d] = false;
+		crcs_of[d] = page_address(verify.crc_pages[d]);
+	}
+
+	mutex_lock(&verify_lock);
+
+	for (i = 0; i < nr_sectors; ++i) {
+		good = SSR_NR_DISKS;
+		for (d = 0; d < SSR_NR_DISKS; ++d) {
+			ok[d] = readable[d] &&
+				crc32(CRC_SEED, verify_sector_data(d, i),
+				      KERNEL_SECTOR_SIZE) ==
+				crcs_of[d][crc_index_f + i];
+			if (ok[d] && good == SSR_NR_DISKS)
+				good = d;
+		}
+
+		for (d = 0; d < SSR_NR_DISKS; ++d) {
+			if (likely(ok[d]))
+				continue;
+
+			if (good == SSR_NR_DISKS) {
+				kind = SSR_MISMATCH_LOST;
+			} else if (!readable[d]) {
+				kind = SSR_MISMATCH_BOTH;
+			} else {
+				data_eq = memcmp(verify_sector_data(d, i),
+						 verify_sector_data(good, i),
+						 KERNEL_SECTOR_SIZE) == 0;
+				crc_eq = crcs_of[d][crc_index_f + i] ==
+					 crcs_of[good][crc_index_f + i];
+
+				if (data_eq)
+					kind = SSR_MISMATCH_CRC;
+				else if (crc_eq)
+					kind = SSR_MISMATCH_DATA;
+				else
+					kind = SSR_MISMATCH_BOTH;
+			}
+
+			verify_record(d, start + i, kind);
+			++nr_bad;
+		}
+	}
+
+	mutex_unlock(&verify_lock);
+
+	return nr_bad;
+}
+
+static void verify_reset(sector_t start, sector_t end)
+{
+	mutex_lock(&verify_lock);
+	verify.start = start;
+	verify.end = end;
+	memset(verify.counts, 0, sizeof(verify.counts));
+	verify.nr_report = 0;
+	verify.nr_dropped = 0;
+	mutex_unlock(&verify_lock);
+}
+
+static int verify_report_show(struct seq_file *m, void *unused)
+{
+	size_t d, k;
+
+	mutex_lock(&verify_lock);
+
+	seq_printf(m, "range %llu %llu\n", (unsigned long long)verify.start,
+		   (unsigned long long)verify.end);
+	for (d = 0; d < SSR_NR_DISKS; ++d) {
+		seq_printf(m, "disk%zu", d);
+		for (k = 0; k < SSR_MISMATCH_KINDS; ++k)
+			seq_printf(m, " %s %llu", mismatch_kind_names[k],
+				   verify.counts[d][k]);
+		seq_putc(m, '\n');
+	}
+	if (verify.nr_dropped != 0)
+		seq_printf(m, "dropped %llu\n", verify.nr_dropped);
+
+	for (k = 0; k < verify.nr_report; ++k)
+		seq_printf(m, "disk%u %llu %s\n", verify.report[k].disk,
+			   (unsigned long long)verify.report[k].sector,
+			   mismatch_kind_names[verify.report[k].kind]);
+
+	mutex_unlock(&verify_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(verify_report);
+
+static void verify_free(void)
+{
+	size_t d, j;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d) {
+		for (j = 0; j < SSR_VERIFY_DATA_PAGES; ++j)
+			if (verify.data_pages[d][j] != NULL)
+				__free_page(verify.data_pages[d][j]);
+		if (verify.crc_pages[d] != NULL)
+			__free_page(verify.crc_pages[d]);
+	}
+
+	kvfree(verify.report);
+}
+
+static int verify_init(struct dentry *parent)
+{
+	struct dentry *dir;
+	size_t d, j;
+
+	verify.report = kvcalloc(SSR_VERIFY_MAX_REPORT, sizeof(*verify.report),
+				 GFP_KERNEL);
+	if (verify.report == NULL)
+		goto out_free;
+
+	for (d = 0; d < SSR_NR_DISKS; ++d) {
+		for (j = 0; j < SSR_VERIFY_DATA_PAGES; ++j) {
+			verify.data_pages[d][j] = alloc_page(GFP_KERNEL);
+			if (verify.data_pages[d][j] == NULL)
+				goto out_free;
+		}
+		verify.crc_pages[d] = alloc_page(GFP_KERNEL);
+		if (verify.crc_pages[d] == NULL)
+			goto out_free;
+	}
+
+	dir = debugfs_create_dir("verify", parent);
+	debugfs_create_file("report", 0400, dir, NULL, &verify_report_fops);
+
+	return 0;
+
+out_free:
+	verify_free();
+	return -ENOMEM;
+}
+
+/*
+ * Scheduler of the IO workqueue. Each CPU has its own scheduler, whose
+ * dispatcher runs on that CPU, so bios are served on the CPU that submitted
+ * them and the disks' IOs use that CPU's hardware queues. Work is kept in one
+ * FIFO per class and the dispatcher serves the FIFO head with the earliest
+ * deadline. A FIFO head always has the earliest deadline of its class, and a
+ * request that waited past its deadline goes before any whose deadline is
+ * later, so small reads overtake queued large writes while no class starves.
+ */
+struct ssr_sched {
+	struct list_head fifo[SSR_SCHED_CLASSES];
+	spinlock_t lock;
+	struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct ssr_sched, scheds);
+
+static void sched_entry_init(struct ssr_sched_entry *entry,
+			     void (*fn)(struct ssr_sched_entry *entry))
+{
+	INIT_LIST_HEAD(&entry->list);
+	entry->cpu = 0;
+	entry->fn = fn;
+}
+
+static bool sched_queued(struct ssr_sched_entry *entry)
+{
+	struct ssr_sched *sched = per_cpu_ptr(&scheds, entry->cpu);
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&sched->lock, flags);
+	queued = !list_empty(&entry->list);
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	return queued;
+}
+
+/*
+ * Queue an entry on the scheduler of the current CPU, unless it is already
+ * queued. The owner of an entry serializes queueing it.
+ */
+static void sched_queue(struct ssr_sched_entry *entry,
+			enum ssr_sched_class class)
+{
+	struct ssr_sched *sched;
+	unsigned long flags;
+	int cpu;
+
+	if (sched_queued(entry))
+		return;
+
+	cpu = get_cpu();
+	sched = per_cpu_ptr(&scheds, cpu);
+
+	spin_lock_irqsave(&sched->lock, flags);
+	entry->cpu = cpu;
+	entry->class = class;
+	entry->deadline = ktime_get_ns() +
+		(u64)READ_ONCE(sched_deadline_ms[class]) * NSEC_PER_MSEC;
+	list_add_tail(&entry->list, &sched->fifo[class]);
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	queue_work_on(cpu, queue, &sched->work);
+	put_cpu();
+}
+
+/*
+ * Remove an entry that is queued. The caller waits for one being run with
+ * flush_workqueue(queue).
+ */
+static void sched_cancel(struct ssr_sched_entry *entry)
+{
+	struct ssr_sched *sched = per_cpu_ptr(&scheds, entry->cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sched->lock, flags);
+	list_del_init(&entry->list);
+	spin_unlock_irqrestore(&sched->lock, flags);
+}
+
+static struct ssr_sched_entry *sched_next(struct ssr_sched *sched)
+{
+	struct ssr_sched_entry *best = NULL, *head;
+	unsigned long flags;
+	size_t c;
+
+	spin_lock_irqsave(&sched->lock, flags);
+	for (c = 0; c < SSR_SCHED_CLASSES; ++c) {
+		/* Speculative reads never go before a demand read */
+		if (c == SSR_SCHED_SPEC_READ &&
+		    !list_empty(&sched->fifo[SSR_SCHED_SYNC_READ]))
+			continue;
+		head = list_first_entry_or_null(&sched->fifo[c],
+						struct ssr_sched_entry, list);
+		if (head != NULL && (best == NULL || head->deadline < best->deadline))
+			best = head;
+	}
+	if (best != NULL)
+		list_del_init(&best->list);
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	return best;
+}
+
+static void sched_dispatch(struct work_struct *work)
+{
+	struct ssr_sched *sched = container_of(work, struct ssr_sched, work);
+	struct ssr_sched_entry *entry;
+
+	while ((entry = sched_next(sched)) != NULL) {
+		if (ktime_get_ns() > entry->deadline)
+			counter_inc(SSR_CNT_SCHED_EXPIRED + entry->class);
+
+		entry->fn(entry);
+		cond_resched();
+	}
+}
+
+static void sched_init(struct dentry *parent)
+{
+	static const char * const names[] = {
+		[SSR_SCHED_SYNC_READ] = "sync_read",
+		[SSR_SCHED_SYNC_WRITE] = "sync_write",
+		[SSR_SCHED_ASYNC_WRITE] = "async_write",
+		[SSR_SCHED_MAINT] = "maintenance",
+		[SSR_SCHED_SPEC_READ] = "spec_read",
+	};
+	struct dentry *dir = debugfs_create_dir("sched_expired", parent);
+	struct ssr_sched *sched;
+	size_t c;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sched = per_cpu_ptr(&scheds, cpu);
+		for (c = 0; c < SSR_SCHED_CLASSES; ++c)
+			INIT_LIST_HEAD(&sched->fifo[c]);
+		spin_lock_init(&sched->lock);
+		INIT_WORK(&sched->work, sched_dispatch);
+	}
+
+	for (c = 0; c < SSR_SCHED_CLASSES; ++c)
+		counter_debugfs(names[c], dir, SSR_CNT_SCHED_EXPIRED + c);
+}
+
+/*
+ * Long-running maintenance operations. One runs at a time, in steps of
+ * SSR_OP_SECTORS queued on the IO workqueue, so user IO is served between
+ * steps. They are started, paused, resumed and cancelled through the "op"
+ * sysfs attribute of the disk, which also shows the progress, and a change
+ * uevent is sent when one ends.
+ */
+enum ssr_op_type {
+	SSR_OP_NONE,
+	SSR_OP_VERIFY,
+	SSR_OP_SYNC,
+	SSR_OP_RECOVER,
+};
+
+enum ssr_op_state {
+	SSR_OP_IDLE,
+	SSR_OP_RUNNING,
+	SSR_OP_PAUSED,
+	SSR_OP_DONE,
+	SSR_OP_CANCELLED,
+};
+
+static const char * const op_type_names[] = {
+	[SSR_OP_NONE] = "none",
+	[SSR_OP_VERIFY] = "verify",
+	[SSR_OP_SYNC] = "sync",
+	[SSR_OP_RECOVER] = "recover",
+};
+
+static const char * const op_state_names[] = {
+	[SSR_OP_IDLE] = "idle",
+	[SSR_OP_RUNNING] = "running",
+	[SSR_OP_PAUSED] = "paused",
+	[SSR_OP_DONE] = "done",
+	[SSR_OP_CANCELLED] = "cancelled",
+};
+
+static void op_work(struct ssr_sched_entry *entry);
+
+/*
+ * Crash recovery resyncs the device in regions, in parallel on an unbound
+ * workqueue, while the device stays online: user IO to a region that was
+ * not resynced yet resyncs it first. Regions are aligned to CRC sectors, so
+ * no two regions share one.
+ */
+struct ssr_region {
+	struct rw_semaphore lock;
+	bool recovered;
+};
+
+struct ssr_recovery_worker {
+	struct work_struct work;
+	struct page *page;
+};
+
+static struct ssr_region regions[SSR_NR_REGIONS];
+static struct ssr_recovery_worker recovery_workers[SSR_RECOVERY_WORKERS];
+static struct workqueue_struct *recovery_wq;
+/* The next region to hand to a worker */
+static atomic_t recovery_next;
+/* User IO has to check for regions that were not resynced */
+static bool recovery_active;
+
+/*
+ * Only accessed under op_lock, except for state: the recovery workers poll
+ * it without the lock, so it is always written with WRITE_ONCE.
+ */
+static struct ssr_op {
+	enum ssr_op_type type;
+	enum ssr_op_state state;
+	sector_t start;
+	sector_t end;
+	sector_t next;
+	u64 errors;
+	/* Time spent running, not counting the current run since resumed_at */
+	u64 active_ns;
+	u64 resumed_at;
+	/* Set on unload, no operation can be started anymore */
+	bool stopped;
+	/* A step is doing its IO without op_lock held */
+	bool in_step;
+	/* Used by the steps run on the IO workqueue */
+	struct page *sync_page;
+} op;
+
+static struct ssr_sched_entry op_entry = {
+	.list = LIST_HEAD_INIT(op_entry.list),
+	.fn = op_work,
+};
+static DEFINE_MUTEX(op_lock);
+
+/*
+ * Every user of the disks holds the locks of the regions it works on:
+ * exclusively if it may write to them, repairs included, shared if it only
+ * reads. They are taken in ascending order; a range never spans more
+ * regions than lockdep has subclasses.
+ */
+static void region_lock_range(sector_t sector, sector_t nr_sectors)
+{
+	size_t first, r;
+
+	if (nr_sectors == 0)
+		return;
+
+	first = sector >> SSR_REGION_SHIFT;
+	for (r = first; r <= (sector + nr_sectors - 1) >> SSR_REGION_SHIFT; ++r)
+		down_write_nested(&regions[r].lock, r - first);
+}
+
+static void region_unlock_range(sector_t sector, sector_t nr_sectors)
+{
+	size_t r;
+
+	if (nr_sectors == 0)
+		return;
+
+	for (r = sector >> SSR_REGION_SHIFT;
+	     r <= (sector + nr_sectors - 1) >> SSR_REGION_SHIFT; ++r)
+		up_write(&regions[r].lock);
+}
+
+static void region_read_lock_range(sector_t sector, sector_t nr_sectors)
+{
+	size_t first, r;
+
+	if (nr_sectors == 0)
+		return;
+
+	first = sector >> SSR_REGION_SHIFT;
+	for (r = first; r <= (sector + nr_sectors - 1) >> SSR_REGION_SHIFT; ++r)
+		down_read_nested(&regions[r].lock, r - first);
+}
+
+static void region_read_unlock_range(sector_t sector, sector_t nr_sectors)
+{
+	size_t r;
+
+	if (nr_sectors == 0)
+		return;
+
+	for (r = sector >> SSR_REGION_SHIFT;
+	     r <= (sector + nr_sectors - 1) >> SSR_REGION_SHIFT; ++r)
+		up_read(&regions[r].lock);
+}
+
+/*
+ * Repair the broken copies a reader found in [sector, sector + nr_sectors).
+ * Readers only hold their regions shared, so they leave the repair to this,
+ * which takes them exclusively and checks the range again: a writer may
+ * have replaced the broken data meanwhile.
+ */
+static void region_repair_range(sector_t sector, sector_t nr_sectors)
+{
+	struct bio_vec bvec = { .bv_offset = 0 };
+	sector_t s;
+
+	bvec.bv_page = alloc_page(GFP_NOIO);
+	if (bvec.bv_page == NULL)
+		return;
+
+	region_lock_range(sector, nr_sectors);
+	for (s = sector; s < sector + nr_sectors;
+	     s += bvec.bv_len / KERNEL_SECTOR_SIZE) {
+		bvec.bv_len = min_t(sector_t, sector + nr_sectors - s,
+				    SSR_SEG_MAX_SECTORS) * KERNEL_SECTOR_SIZE;
+		check_disks(bvec, s, SSR_CHECK_REPAIR, NULL);
+	}
+	/* Windows read from a disk before it was repaired are stale */
+	ssr_ra_invalidate(sector, nr_sectors);
+	region_unlock_range(sector, nr_sectors);
+
+	__free_page(bvec.bv_page);
+}
+
+/*
+ * Bring the sectors [start, start + nr_sectors) of all disks in sync: every
+ * segment is read from all of them and the broken ones are repaired.
+ *
+ * Returns the number of segments left out of sync: no disk holds a good copy
+ * of them or their repair failed.
+ */
+static u64 sync_chunk(struct page *page, sector_t start, size_t nr_sectors)
+{
+	struct bio_vec bvec = { .bv_page = page, .bv_offset = 0 };
+	size_t done;
+	u64 nr_lost = 0;
+
+	for (done = 0; done < nr_sectors;
+	     done += bvec.bv_len / KERNEL_SECTOR_SIZE) {
+		bvec.bv_len = min_t(size_t, nr_sectors - done,
+				    SSR_SEG_MAX_SECTORS) * KERNEL_SECTOR_SIZE;
+		if (check_disks(bvec, start + done,
+				SSR_CHECK_REPAIR | SSR_CHECK_ALL |
+				SSR_CHECK_RESYNC, NULL) != 0)
+			++nr_lost;
+	}
+
+	return nr_lost;
+}
+
+/* Note: op_lock must be held. */
+static u64 op_active_ns(void)
+{
+	if (op.state != SSR_OP_RUNNING)
+		return op.active_ns;
+
+	return op.active_ns + ktime_get_ns() - op.resumed_at;
+}
+
+/*
+ * Note: op_lock must be held.
+ */
+static void op_finish(enum ssr_op_state state)
+{
+	char type_env[32], state_env[32], errors_env[48];
+	char *envp[] = { type_env, state_env, errors_env, NULL };
+
+	op.active_ns = op_active_ns();
+	WRITE_ONCE(op.state, state);
+
+	/*
+	 * A completed sync of the whole device is a recovery, unless a write
+	 * failed on some disks behind it: writers mark the blocks stale
+	 * before they take op_lock to keep the array dirty.
+	 */
+	if ((op.type == SSR_OP_SYNC || op.type == SSR_OP_RECOVER) &&
+	    state == SSR_OP_DONE && op.start == 0 &&
+	    op.end == LOGICAL_DISK_SECTORS && op.errors == 0 &&
+	    memchr_inv(stale, 0, sizeof(stale)) == NULL)
+		WRITE_ONCE(sb_recovery_pending, false);
+
+	if (op.type == SSR_OP_RECOVER)
+		WRITE_ONCE(recovery_active, false);
+
+	snprintf(type_env, sizeof(type_env), "SSR_OP=%s",
+		 op_type_names[op.type]);
+	snprintf(state_env, sizeof(state_env), "SSR_OP_STATE=%s",
+		 op_state_names[op.state]);
+	snprintf(errors_env, sizeof(errors_env), "SSR_OP_ERRORS=%llu",
+		 op.errors);
+	kobject_uevent_env(&disk_to_dev(g_dev.gd)->kobj, KOBJ_CHANGE, envp);
+}
+
+/*
+ * Run one step of the current operation. Its IO is done without op_lock, so
+ * the progress can be read and the operation paused meanwhile; in_step keeps
+ * a step queued by a resume from running alongside.
+ */
+static void op_work(struct ssr_sched_entry *entry)
+{
+	enum ssr_op_type type;
+	size_t nr_sectors;
+	sector_t next;
+	u64 errors;
+
+	mutex_lock(&op_lock);
+	if (op.state != SSR_OP_RUNNING || op.in_step) {
+		mutex_unlock(&op_lock);
+		return;
+	}
+	type = op.type;
+	next = op.next;
+	nr_sectors = min_t(sector_t, op.end - op.next, SSR_OP_SECTORS);
+	op.in_step = true;
+	mutex_unlock(&op_lock);
+
+	if (type == SSR_OP_VERIFY) {
+		region_read_lock_range(next, nr_sectors);
+		errors = verify_chunk(next, nr_sectors);
+		region_read_unlock_range(next, nr_sectors);
+	} else {
+		region_lock_range(next, nr_sectors);
+		errors = sync_chunk(op.sync_page, next, nr_sectors);
+		/* Windows read from a disk before it was repaired are stale */
+		ssr_ra_invalidate(next, nr_sectors);
+		region_unlock_range(next, nr_sectors);
+	}
+
+	mutex_lock(&op_lock);
+	op.in_step = false;
+	op.next = next + nr_sectors;
+	op.errors += errors;
+
+	/* Otherwise paused or cancelled while the step ran */
+	if (op.state == SSR_OP_RUNNING) {
+		if (op.next < op.end)
+			sched_queue(&op_entry, SSR_SCHED_MAINT);
+		else
+			op_finish(SSR_OP_DONE);
+	}
+	mutex_unlock(&op_lock);
+}
+
+/*
+ * Resync a region if it was not already, either for a recovery worker or
+ * for user IO about to touch it.
+ */
+static void region_recover(size_t r, struct page *page)
+{
+	struct ssr_region *region = &regions[r];
+	sector_t start = (sector_t)r << SSR_REGION_SHIFT;
+	sector_t nr_sectors = min_t(sector_t, SSR_REGION_SECTORS,
+				    LOGICAL_DISK_SECTORS - start);
+	sector_t done;
+	u64 errors = 0;
+
+	down_write(&region->lock);
+	if (region->recovered) {
+		up_write(&region->lock);
+		return;
+	}
+
+	for (done = 0; done < nr_sectors; done += SSR_OP_SECTORS)
+		errors += sync_chunk(page, start + done,
+				     min_t(sector_t, nr_sectors - done,
+					   SSR_OP_SECTORS));
+	/* Windows read from a disk before it was repaired are stale */
+	ssr_ra_invalidate(start, nr_sectors);
+	region->recovered = true;
+
+	up_write(&region->lock);
+
+	mutex_lock(&op_lock);
+	if (op.type == SSR_OP_RECOVER && READ_ONCE(recovery_active)) {
+		op.next += nr_sectors;
+		op.errors += errors;
+		if (op.next == op.end)
+			op_finish(SSR_OP_DONE);
+	}
+	mutex_unlock(&op_lock);
+}
+
+static void recovery_work(struct work_struct *work)
+{
+	struct ssr_recovery_worker *worker =
+		container_of(work, struct ssr_recovery_worker, work);
+	int r;
+
+	while (READ_ONCE(op.state) == SSR_OP_RUNNING) {
+		r = atomic_inc_return(&recovery_next) - 1;
+		if (r >= SSR_NR_REGIONS)
+			break;
+
+		region_recover(r, worker->page);
+	}
+}
+
+/*
+ * Called by user IO before touching [sector, sector + nr_sectors).
+ */
+static void recovery_touch(sector_t sector, sector_t nr_sectors)
+{
+	struct page *page;
+	size_t r;
+
+	if (likely(!READ_ONCE(recovery_active)) || nr_sectors == 0)
+		return;
+
+	page = alloc_page(GFP_NOIO);
+	if (page == NULL)
+		return;
+
+	for (r = sector >> SSR_REGION_SHIFT;
+	     r <= (sector + nr_sectors - 1) >> SSR_REGION_SHIFT; ++r)
+		region_recover(r, page);
+
+	__free_page(page);
+}
+
+/*
+ * Note: op_lock must be held.
+ */
+static void recovery_reset(void)
+{
+	size_t r;
+
+	for (r = 0; r < SSR_NR_REGIONS; ++r) {
+		down_write(&regions[r].lock);
+		regions[r].recovered = false;
+		up_write(&regions[r].lock);
+	}
+
+	atomic_set(&recovery_next, 0);
+	WRITE_ONCE(recovery_active, true);
+}
+
+/* Queue the steps of the current operation. */
+static void op_kick(void)
+{
+	size_t i;
+
+	if (op.type != SSR_OP_RECOVER) {
+		sched_queue(&op_entry, SSR_SCHED_MAINT);
+		return;
+	}
+
+	for (i = 0; i < min_t(size_t, num_online_cpus(), SSR_RECOVERY_WORKERS); ++i)
+		queue_work(recovery_wq, &recovery_workers[i].work);
+}
+
+/*
+ * Start an operation on [first, first + nr_sectors) and return without
+ * waiting for it. Recovery always covers the whole device.
+ */
+static int op_start(enum ssr_op_type type, sector_t first, sector_t nr_sectors)
+{
+	if (first >= LOGICAL_DISK_SECTORS || nr_sectors == 0)
+		return -EINVAL;
+
+	mutex_lock(&op_lock);
+	if (op.stopped) {
+		mutex_unlock(&op_lock);
+		return -ENODEV;
+	}
+	/* Including a cancelled operation whose last step is still running */
+	if (op.state == SSR_OP_RUNNING || op.state == SSR_OP_PAUSED ||
+	    op.in_step) {
+		mutex_unlock(&op_lock);
+		return -EBUSY;
+	}
+
+	if (type == SSR_OP_RECOVER) {
+		first = 0;
+		nr_sectors = LOGICAL_DISK_SECTORS;
+	}
+
+	op.type = type;
+	op.start = first;
+	op.end = first + min_t(sector_t, nr_sectors,
+			       LOGICAL_DISK_SECTORS - first);
+	op.next = first;
+	op.errors = 0;
+	op.active_ns = 0;
+	op.resumed_at = ktime_get_ns();
+	WRITE_ONCE(op.state, SSR_OP_RUNNING);
+
+	if (type == SSR_OP_VERIFY)
+		verify_reset(op.start, op.end);
+	else if (type == SSR_OP_RECOVER)
+		recovery_reset();
+
+	op_kick();
+
+	mutex_unlock(&op_lock);
+
+	return 0;
+}
+
+static int op_control(enum ssr_op_state from, enum ssr_op_state to)
+{
+	int err = 0;
+
+	mutex_lock(&op_lock);
+
+	if (op.state != from && !(to == SSR_OP_CANCELLED &&
+				  op.state == SSR_OP_PAUSED)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	switch (to) {
+	case SSR_OP_PAUSED:
+		op.active_ns = op_active_ns();
+		WRITE_ONCE(op.state, SSR_OP_PAUSED);
+		break;
+	case SSR_OP_RUNNING:
+		op.resumed_at = ktime_get_ns();
+		WRITE_ONCE(op.state, SSR_OP_RUNNING);
+		op_kick();
+		break;
+	default:
+		op_finish(to);
+		break;
+	}
+
+out:
+	mutex_unlock(&op_lock);
+	return err;
+}
+
+/*
+ * Reading gives: <type> <state> <sectors done> <sectors total>
+ * <rate in sectors/s> <ETA in s> <errors>
+ */
+static ssize_t op_show(struct device *dev, struct device_attribute *attr,
+		       char *buf)
+{
+	u64 done, total, active_ns, rate, eta;
+	ssize_t len;
+
+	mutex_lock(&op_lock);
+
+	done = op.next - op.start;
+	total = op.end - op.start;
+	active_ns = op_active_ns();
+	rate = active_ns ? div64_u64(done * NSEC_PER_SEC, active_ns) : 0;
+	eta = rate ? div64_u64(total - done, rate) : 0;
+
+	len = sysfs_emit(buf, "%s %s %llu %llu %llu %llu %llu\n",
+			 op_type_names[op.type], op_state_names[op.state],
+			 done, total, rate, eta, op.errors);
+
+	mutex_unlock(&op_lock);
+
+	return len;
+}
+
+/*
+ * Accepted commands:
+ *   verify|sync [<first sector> [<number of sectors>]]
+ *   recover
+ *   pause | resume | cancel
+ */
+static ssize_t op_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	char cmd[16];
+	unsigned long long first = 0, nr_sectors = LOGICAL_DISK_SECTORS;
+	int err;
+
+	if (sscanf(buf, "%15s %llu %llu", cmd, &first, &nr_sectors) < 1)
+		return -EINVAL;
+
+	if (strcmp(cmd, "verify") == 0)
+		err = op_start(SSR_OP_VERIFY, first, nr_sectors);
+	else if (strcmp(cmd, "sync") == 0)
+		err = op_start(SSR_OP_SYNC, first, nr_sectors);
+	else if (strcmp(cmd, "recover") == 0)
+		err = op_start(SSR_OP_RECOVER, 0, LOGICAL_DISK_SECTORS);
+	else if (strcmp(cmd, "pause") == 0)
+		err = op_control(SSR_OP_RUNNING, SSR_OP_PAUSED);
+	else if (strcmp(cmd, "resume") == 0)
+		err = op_control(SSR_OP_PAUSED, SSR_OP_RUNNING);
+	else if (strcmp(cmd, "cancel") == 0)
+		err = op_control(SSR_OP_RUNNING, SSR_OP_CANCELLED);
+	else
+		err = -EINVAL;
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR_RW(op);
+
+static struct attribute *ssr_attrs[] = {
+	&dev_attr_op.attr,
+	&dev_attr_health.attr,
+	&dev_attr_write_amp.attr,
+	NULL,
+};
+
+static const struct attribute_group ssr_attr_group = {
+	.name = LOGICAL_DISK_NAME,
+	.attrs = ssr_attrs,
+};
+
+static const struct attribute_group *ssr_attr_groups[] = {
+	&ssr_attr_group,
+	NULL,
+};
+
+static void op_free(void)
+{
+	size_t i;
+
+	mutex_lock(&op_lock);
+	op.stopped = true;
+	if (op.state == SSR_OP_RUNNING || op.state == SSR_OP_PAUSED)
+		WRITE_ONCE(op.state, SSR_OP_CANCELLED);
+	mutex_unlock(&op_lock);
+
+	sched_cancel(&op_entry);
+	flush_workqueue(queue);
+	if (recovery_wq != NULL)
+		destroy_workqueue(recovery_wq);
+
+	for (i = 0; i < SSR_RECOVERY_WORKERS; ++i)
+		if (recovery_workers[i].page != NULL)
+			__free_page(recovery_workers[i].page);
+
+	if (op.sync_page != NULL)
+		__free_page(op.sync_page);
+}
+
+static int op_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < SSR_NR_REGIONS; ++i)
+		init_rwsem(&regions[i].lock);
+
+	for (i = 0; i < SSR_RECOVERY_WORKERS; ++i) {
+		INIT_WORK(&recovery_workers[i].work, recovery_work);
+		recovery_workers[i].page = alloc_page(GFP_KERNEL);
+		if (recovery_workers[i].page == NULL)
+			goto out_free;
+	}
+
+	recovery_wq = alloc_workqueue("ssr_recovery", WQ_UNBOUND | WQ_MEM_RECLAIM,
+				      SSR_RECOVERY_WORKERS);
+	if (recovery_wq == NULL)
+		goto out_free;
+
+	op.sync_page = alloc_page(GFP_KERNEL);
+	if (op.sync_page == NULL)
+		goto out_free;
+
+	return 0;
+
+out_free:
+	op_free();
+	return -ENOMEM;
+}
+
+/*
+ * Control device for integrity tooling, /dev/ssr-ctl. Requests on it are
+ * plain reads and writes, so many of them can be kept in flight from
+ * userspace with io_uring's read and write operations:
+ *   - writing a struct ssr_range_cmd verifies or repairs a range of sectors
+ *     and stores a struct ssr_range_result at the address it gives;
+ *   - reading at offset sector * sizeof(u32) returns the stored CRCs of the
+ *     sectors from there on, taken from the first disk that can be read.
+ */
+static ssize_t ctl_write(struct file *file, const char __user *ubuf,
+			 size_t count, loff_t *ppos)
+{
+	struct ssr_range_cmd cmd;
+	struct ssr_range_result res = { 0 };
+	struct bio_vec bvec = { .bv_offset = 0 };
+	sector_t first, sector, end, region_end;
+	bool repair;
+	int err = 0;
+
+	if (count != sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(&cmd, ubuf, sizeof(cmd)))
+		return -EFAULT;
+
+	if ((cmd.opcode != SSR_CMD_VERIFY && cmd.opcode != SSR_CMD_REPAIR) ||
+	    cmd.sector >= LOGICAL_DISK_SECTORS || cmd.nr_sectors == 0)
+		return -EINVAL;
+
+	repair = cmd.opcode == SSR_CMD_REPAIR;
+	end = cmd.sector + min_t(u64, cmd.nr_sectors,
+				 LOGICAL_DISK_SECTORS - cmd.sector);
+
+	bvec.bv_page = alloc_page(GFP_KERNEL);
+	if (bvec.bv_page == NULL)
+		return -ENOMEM;
+
+	recovery_touch(cmd.sector, end - cmd.sector);
+
+	/* One region at a time so user IO to the others goes on */
+	for (first = cmd.sector; first < end; first = region_end) {
+		region_end = min_t(sector_t, end,
+				   round_down(first, SSR_REGION_SECTORS) +
+				   SSR_REGION_SECTORS);
+
+		if (repair)
+			region_lock_range(first, region_end - first);
+		else
+			region_read_lock_range(first, region_end - first);
+		for (sector = first; sector < region_end;
+		     sector += bvec.bv_len / KERNEL_SECTOR_SIZE) {
+			bvec.bv_len = min_t(sector_t, region_end - sector,
+					    SSR_SEG_MAX_SECTORS) *
+				      KERNEL_SECTOR_SIZE;
+			check_disks(bvec, sector,
+				    (repair ? SSR_CHECK_REPAIR : 0) | SSR_CHECK_ALL,
+				    &res);
+		}
+		if (repair) {
+			ssr_ra_invalidate(first, region_end - first);
+			region_unlock_range(first, region_end - first);
+		} else {
+			region_read_unlock_range(first, region_end - first);
+		}
+	}
+	res.nr_checked = end - cmd.sector;
+
+	__free_page(bvec.bv_page);
+
+	if (copy_to_user(u64_to_user_ptr(cmd.result), &res, sizeof(res)))
+		err = -EFAULT;
+
+	return err ? err : count;
+}
+
+static ssize_t ctl_read(struct file *file, char __user *ubuf, size_t count,
+			loff_t *ppos)
+{
+	struct page *page;
+	sector_t sector, end, group_end;
+	size_t crc_len, d;
+	ssize_t done = 0;
+	int err = 0;
+
+	if (*ppos % sizeof(u32) != 0 || count % sizeof(u32) != 0)
+		return -EINVAL;
+
+	sector = *ppos / sizeof(u32);
+	if (sector >= LOGICAL_DISK_SECTORS)
+		return 0;
+	end = sector + min_t(u64, count / sizeof(u32),
+			     LOGICAL_DISK_SECTORS - sector);
+
+	page = alloc_page(GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	/* At most a page of CRC sectors per read, all in the same region */
+	for (; sector < end; sector = group_end) {
+		group_end = min_t(sector_t, end,
+				  round_down(sector, SSR_CTL_CRC_GROUP) +
+				  SSR_CTL_CRC_GROUP);
+		crc_len = get_crc_len(sector, group_end - sector);
+
+		region_read_lock_range(sector, 1);
+		for (d = 0; d < SSR_NR_DISKS; ++d) {
+			err = read_page_from_disk(page, crc_len, 0, pdsks[d],
+						  get_crc_sector(sector));
+			if (err == 0)
+				break;
+		}
+		region_read_unlock_range(sector, 1);
+		if (err != 0)
+			break;
+
+		if (copy_to_user(ubuf + done,
+				 (u32 *)page_address(page) + get_crc_index(sector),
+				 (group_end - sector) * sizeof(u32))) {
+			err = -EFAULT;
+			break;
+		}
+		done += (group_end - sector) * sizeof(u32);
+	}
+
+	__free_page(page);
+
+	*ppos += done;
+	return done ? done : err;
+}
+
+static const struct file_operations ctl_fops = {
+	.owner = THIS_MODULE,
+	.read = ctl_read,
+	.write = ctl_write,
+	.llseek = default_llseek,
+};
+
+static struct miscdevice ctl_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SSR_CTL_NAME,
+	.fops = &ctl_fops,
+	.mode = 0600,
+};
+
+static void admit_done(enum ssr_io_class class);
+
+static void my_read_handler(struct ssr_sched_entry *entry)
+{
+	int err;
+
+	struct work_bio_info *info;
+	struct bio_vec bvec;
+	struct bvec_iter i;
+	struct ssr_range_result res = { 0 };
+
+	bool both_disks_corrupted = false;
+
+	info = container_of(entry, struct work_bio_info, entry);
+
+	recovery_touch(info->original_bio->bi_iter.bi_sector,
+		       bio_sectors(info->original_bio));
+	region_read_lock_range(info->original_bio->bi_iter.bi_sector,
+			       bio_sectors(info->original_bio));
+
+	bio_for_each_segment(bvec, info->original_bio, i) {
+		sector_t sector = i.bi_sector;
+
+		if (ssr_ra_serve(bvec, sector))
+			continue;
+
+		if (recent_covers(sector, bvec.bv_len / KERNEL_SECTOR_SIZE)) {
+			if (recent_read(bvec, sector)) {
+				counter_inc(SSR_CNT_RECENT_HITS);
+				continue;
+			}
+			counter_inc(SSR_CNT_RECENT_FALLBACKS);
+		}
+
+		err = read_and_check_disks(bvec, sector, &res);
+
+		if (unlikely(err != 0)) {
+			both_disks_corrupted = true;
+			break;
+		}
+	}
+
+	region_read_unlock_range(info->original_bio->bi_iter.bi_sector,
+				 bio_sectors(info->original_bio));
+
+	if (unlikely(res.nr_bad != 0))
+		region_repair_range(info->original_bio->bi_iter.bi_sector,
+				    bio_sectors(info->original_bio));
+
+	if (unlikely(both_disks_corrupted)) {
+		bio_io_error(info->original_bio);
+	} else {
+		ssr_ra_account(info->original_bio->bi_iter.bi_sector,
+			       bio_sectors(info->original_bio));
+		bio_endio(info->original_bio);
+	}
+
+	admit_done(info->class);
+	mempool_free(info, info_pool);
+}
+
+/*
+ * Speculative reads, REQ_RAHEAD and REQ_FAILFAST_*, take the cheapest path:
+ * each segment comes from one disk checked against its own CRCs, with no
+ * cross-check and no repair, and the bio fails if that is not enough; the
+ * submitter falls back to a demand read, which gets the full check. One
+ * that waited past its deadline, or that would have to recover regions
+ * first, is aborted unread.
  */
-static void read_page_from_disk(struct page *page, const size_t len,
-					const size_t offset,
-					struct block_device *blk_dev, sector_t sector)
+static void my_spec_read_handler(struct ssr_sched_entry *entry)
 {
-	struct bio *read_bio;
+	struct work_bio_info *info = container_of(entry, struct work_bio_info,
+						  entry);
+	struct bio *bio = info->original_bio;
+	blk_status_t status = BLK_STS_OK;
+	struct bio_vec bvec;
+	struct bvec_iter i;
+
+	if (ktime_get_ns() > entry->deadline || READ_ONCE(recovery_active)) {
+		counter_inc(SSR_CNT_SPEC_ABORTED);
+		status = BLK_STS_AGAIN;
+		goto out;
+	}
+
+	region_read_lock_range(bio->bi_iter.bi_sector, bio_sectors(bio));
 
-	/* Set up a bio for reading from the disk. */
-	read_bio = bio_alloc(GFP_KERNEL, 1);
-	read_bio->bi_disk = blk_dev->bd_disk;
-	read_bio->bi_iter.bi_sector = sector;
-	read_bio->bi_opf = REQ_OP_READ;
+	bio_for_each_segment(bvec, bio, i) {
+		if (!ssr_ra_serve(bvec, i.bi_sector) &&
+		    !recent_read(bvec, i.bi_sector)) {
+			status = BLK_STS_IOERR;
+			break;
+		}
+	}
 
-	bio_add_page(read_bio, page, len, offset);
+	region_read_unlock_range(bio->bi_iter.bi_sector, bio_sectors(bio));
 
-	/* Do the reading. */
-	submit_bio_wait(read_bio);
+	counter_inc(status == BLK_STS_OK ? SSR_CNT_SPEC_SERVED :
+					   SSR_CNT_SPEC_FAILED);
 
-	bio_put(read_bio);
+out:
+	bio->bi_status = status;
+	bio_endio(bio);
+	admit_done(info->class);
+	mempool_free(info, info_pool);
 }
 
-static void read_payload_from_disk(sector_t sector, unsigned long offset,
-				   size_t len, struct block_device *blk_dev,
-				   void *out_payload)
+static void my_write_handler(struct ssr_sched_entry *entry)
 {
-	struct page *page;
-	u8 *buffer;
+	struct work_bio_info *info;
+	struct bio_vec bvec;
+	struct bvec_iter i;
+	struct page *crc_page;
+	blk_status_t status = BLK_STS_OK;
+	bool partial = false;
 
-	page = alloc_page(GFP_NOIO);
+	info = container_of(entry, struct work_bio_info, entry);
 
-	read_page_from_disk(page, len, offset, blk_dev, sector);
+	crc_page = alloc_page(GFP_NOIO);
+	if (unlikely(crc_page == NULL)) {
+		status = BLK_STS_RESOURCE;
+		goto out;
+	}
 
-	/* Save the payload that was read in the page. */
-	buffer = kmap_atomic(page);
-	memcpy(out_payload + offset, buffer + offset, len);
-	kunmap_atomic(buffer);
+	recovery_touch(info->original_bio->bi_iter.bi_sector,
+		       bio_sectors(info->original_bio));
+	region_lock_range(info->original_bio->bi_iter.bi_sector,
+			  bio_sectors(info->original_bio));
 
-	__free_page(page);
-}
+	ssr_ra_invalidate(info->original_bio->bi_iter.bi_sector,
+			  bio_sectors(info->original_bio));
 
-/*
- * Write function to perform IO. It receives an unmapped page from which to
- * write the disk data.
- *
- * @page   : The page from where to take the data.
- * @len    : The length of the data to write.
- * @offset : The offset in the page to write from.
- * @blk_dev: The block device to write to.
- * @sector : The sector of the block device to write to.
- */
-static void write_page_to_disk(struct page *page, const size_t len,
-				const size_t offset,
-				struct block_device *blk_dev, sector_t sector)
-{
-	struct bio *write_bio;
+	sb_mark_dirty();
+	wa_account_user(info->original_bio->bi_iter.bi_size);
 
-	/* Set up a bio for writing to the disk. */
-	write_bio = bio_alloc(GFP_KERNEL, 1);
+	bio_for_each_segment(bvec, info->original_bio, i) {
+		sector_t sector = i.bi_sector;
+		size_t nr_sectors = bvec.bv_len / KERNEL_SECTOR_SIZE;
 
-	write_bio->bi_disk = blk_dev->bd_disk;
-	write_bio->bi_iter.bi_sector = sector;
-	write_bio->bi_opf = REQ_OP_WRITE;
+		/* The CRC sectors of the segment, two if it spans them */
+		sector_t crc_sector = get_crc_sector(sector);
+		size_t crc_len = get_crc_len(sector, nr_sectors);
 
-	bio_add_page(write_bio, page, len, offset);
+		/* The position in the CRC sector where this segment starts. */
+		size_t crc_start_index = get_crc_index(sector);
 
-	submit_bio_wait(write_bio);
+		size_t order[SSR_NR_DISKS];
+		unsigned char *data;
+		u32 *crcs;
+		unsigned int failed, crc_failed, crc_stale;
+		size_t s, d, pass;
 
-	bio_put(write_bio);
-}
+		/* Write the data to all disks. */
+		failed = write_page_to_disks(bvec.bv_page, bvec.bv_len,
+					     bvec.bv_offset, sector,
+					     SSR_WA_DATA);
+		if (failed == SSR_ALL_DISKS)
+			status = BLK_STS_IOERR;
 
-static void write_payload_to_disk(void *payload, size_t len, sector_t sector,
-					unsigned long offset,
-					struct block_device *blk_dev)
-{
-	struct page *page;
-	u8 *buffer;
+		/*
+		 * Recalculate and write the CRC for each sector of the segment.
+		 * The CRC sectors are written whole, so they are preferably
+		 * read from a disk holding no stale CRCs in them.
+		 */
+		crc_stale = stale_disks(round_down(sector, CRC_PER_SECTOR),
+					min_t(sector_t, crc_len / sizeof(u32),
+					      LOGICAL_DISK_SECTORS -
+					      round_down(sector, CRC_PER_SECTOR)));
+		health_read_order(order, 0);
+		for (pass = 0, d = SSR_NR_DISKS; pass < 2 && d == SSR_NR_DISKS;
+		     ++pass)
+			for (d = 0; d < SSR_NR_DISKS; ++d)
+				if (!!(crc_stale & (1U << order[d])) == pass &&
+				    read_page_from_disk(crc_page, crc_len, 0,
+							pdsks[order[d]],
+							crc_sector) == 0)
+					break;
+		if (unlikely(d == SSR_NR_DISKS)) {
+			status = BLK_STS_IOERR;
+			recent_mark(sector, nr_sectors, false);
+			continue;
+		}
 
-	/* Write the payload to the page of the bio. */
-	page = alloc_page(GFP_NOIO);
-	buffer = kmap_atomic(page);
-	memcpy(buffer + offset, payload + offset, len);
-	kunmap_atomic(buffer);
+		/* Map the data to make its CRC. */
+		data = kmap_atomic(bvec.bv_page);
+		crcs = kmap_atomic(crc_page);
 
-	/* Do the writing. */
-	write_page_to_disk(page, len, offset, blk_dev, sector);
+		for (s = 0; s < nr_sectors; ++s)
+			crcs[crc_start_index + s] =
+				crc32(CRC_SEED, data + bvec.bv_offset +
+				      s * KERNEL_SECTOR_SIZE, KERNEL_SECTOR_SIZE);
 
-	__free_page(page);
-}
+		kunmap_atomic(crcs);
+		kunmap_atomic(data);
 
-/*
- * Function to write a sector to the disk in order to repair it.
- *
- * @data_page_good  : Unmapped page of data that is correct.
- * @data_page_offset: The offset in the page from where to take a
- *                  KERNEL_SECTOR_SIZE worth of bytes.
- * @crc_page_good   : Unmapped page of CRCs that was corrected.
- * @crc_page_offset : The offset in the page from where to take a
- *                  KERNEL_SECTOR_SIZE worth of bytes.
- * @blk_dev         : The block device to write to.
- * @sector          : The sector of the block device to write to.
- *
- * Note: The ammount of data to write is assumed to be KERNEL_SECTOR_SIZE.
- * The CRCs's sector is computed from sector
- */
-static void write_to_repair_sector(struct page *data_page_good, const size_t data_page_offset,
-				    struct page *crc_page_good, const size_t crc_page_offset,
-					struct block_device *blk_dev, const sector_t sector)
-{
-	const sector_t crc_sector = get_crc_sector(sector);
+		/* Write the updated CRCs back to all disks */
+		crc_failed = write_page_to_disks(crc_page, crc_len, 0,
+						 crc_sector, SSR_WA_CRC);
+
+		/*
+		 * No disk holding both the new data and its CRCs fails the
+		 * write; otherwise the disks that missed part of it are stale
+		 * and the array has to be resynced.
+		 */
+		if ((failed | crc_failed) == SSR_ALL_DISKS) {
+			status = BLK_STS_IOERR;
+		} else if (unlikely((failed | crc_failed) != 0)) {
+			stale_set(sector, nr_sectors, failed | crc_failed);
+			partial = true;
+		}
+
+		recent_mark(sector, nr_sectors,
+			    failed == 0 && crc_failed == 0);
+	}
+
+	/* Windows prefetched while the write was in flight */
+	ssr_ra_invalidate(info->original_bio->bi_iter.bi_sector,
+			  bio_sectors(info->original_bio));
+
+	region_unlock_range(info->original_bio->bi_iter.bi_sector,
+			    bio_sectors(info->original_bio));
+
+	/* Keep the array dirty, it is resynced on assembly if not before */
+	if (unlikely(partial)) {
+		mutex_lock(&op_lock);
+		WRITE_ONCE(sb_recovery_pending, true);
+		mutex_unlock(&op_lock);
+	}
 
-	write_page_to_disk(data_page_good, KERNEL_SECTOR_SIZE, data_page_offset,
-			   blk_dev, sector);
-	write_page_to_disk(crc_page_good, KERNEL_SECTOR_SIZE, 0,
-			   blk_dev, crc_sector);
+	__free_page(crc_page);
+
+out:
+	info->original_bio->bi_status = status;
+	bio_endio(info->original_bio);
+	admit_done(info->class);
+	mempool_free(info, info_pool);
 }
 
 /*
- * Check each SECTOR worth of bytes from the data page for CRC missmatches. If
- * a previous good data page is known, it can be passed to also repair the
- * broken disk's data.
+ * Admission control: a request takes a slot of its class and one of the
+ * array before it is queued, so a burst can not queue unbounded work.
  *
- * @pg_to_use  : The page to check.
- * @data_len   : The length of the data.
- * @data_offset: The offset in the page to check from.
- * @crc_page   : The page of CRCs to check.
- * @crc_index_f: The first index of the CRC in the two allocated SECTORS.
- * @good_data_page: The page of good data to use to repair the broken disk.
- * @sector	      : The sector of the block device to write to.
- * @blk_dev	      : The block device to write to.
+ * Returns true if the slots were taken.
  */
-static bool check_and_repair_data(struct page *pg_to_use, const size_t data_len,
-					   const size_t data_offset,
-					   struct page *crc_page, const size_t crc_index_f,
-					   struct page *good_data_page, const sector_t sector,
-					   struct block_device *blk_dev)
+static bool admit_try(enum ssr_io_class class)
 {
-	bool is_good = true;
-	u8 *m_data, *m_crc_data;
+	unsigned int limit = READ_ONCE(max_inflight_class[class]);
 
-	size_t i;
-	size_t crc_index_local;
-	size_t crc_page_offset;
-	u32 crc_comp, crc_stored;
-
-	/* Map the pages to have access to the data */
-	m_data = kmap_atomic(pg_to_use);
-	m_crc_data = kmap_atomic(crc_page);
+	if (atomic_inc_return(&inflight_class[class]) > limit && limit != 0)
+		goto out_class;
 
-	for (i = 0; i < data_len / KERNEL_SECTOR_SIZE; ++i) {
-		/*
-		 * Calculate CRC's index in an u32 vector, taking into account if
-		 * it slipped into a new CRC sector
-		 */
-		crc_index_local = (crc_index_f + i) % CRC_PER_SECTOR;
-		/* If the local CRC index is smaller than the first CRC's index, then we passed into a new sector of CRCs */
-		crc_page_offset = ((crc_index_f <= crc_index_local) ? 0 : KERNEL_SECTOR_SIZE);
+	limit = READ_ONCE(max_inflight);
+	if (atomic_inc_return(&inflight) > limit && limit != 0)
+		goto out_array;
 
-		crc_comp = crc32(CRC_SEED,
-						 m_data + data_offset + i * KERNEL_SECTOR_SIZE,
-						 KERNEL_SECTOR_SIZE);
-		crc_stored = ((u32 *)m_crc_data)[crc_index_f + i];
+	return true;
 
-		if (crc_comp != crc_stored) { /* We found a CRC missmatch */
-			if (good_data_page != NULL) { /* We know a good data page */
+out_array:
+	atomic_dec(&inflight);
+out_class:
+	atomic_dec(&inflight_class[class]);
+	/* A slot may have been freed while we held it */
+	wake_up(&inflight_wait);
+	return false;
+}
 
-				/* Repair the broken sector */
-				((u32 *)m_crc_data)[crc_index_f + i] = crc_stored;
+static void admit_done(enum ssr_io_class class)
+{
+	atomic_dec(&inflight);
+	atomic_dec(&inflight_class[class]);
 
-				kunmap_atomic(m_data);
-				kunmap_atomic(m_crc_data);
+	if (wq_has_sleeper(&inflight_wait))
+		wake_up(&inflight_wait);
+}
 
-				write_to_repair_sector(good_data_page, i * KERNEL_SECTOR_SIZE,
-							crc_page, crc_page_offset, blk_dev, sector + i);
+/*
+ * Wait for slots of the class, or fail with BLK_STS_AGAIN if the bio can not
+ * wait.
+ *
+ * Returns true if the bio was admitted.
+ */
+static bool admit_bio(struct bio *bio, enum ssr_io_class class)
+{
+	if (likely(admit_try(class)))
+		return true;
 
-				m_data = kmap_atomic(pg_to_use);
-				m_crc_data = kmap_atomic(crc_page);
-			} else {
-				/* We can not repair now */
-				is_good = false;
-				break;
-			}
-		}
+	if (bio->bi_opf & REQ_NOWAIT) {
+		counter_inc(SSR_CNT_ADMIT_REJECTS);
+		bio_wouldblock_error(bio);
+		return false;
 	}
 
-	kunmap_atomic(m_data);
-	kunmap_atomic(m_crc_data);
-
-	return is_good;
+	counter_inc(SSR_CNT_ADMIT_WAITS);
+	wait_event(inflight_wait, admit_try(class));
+	return true;
 }
 
-static int read_and_check_disks(const struct bio_vec bvec,
-						const sector_t sector)
+static inline bool bio_is_speculative(struct bio *bio)
 {
-	int ret = 0;
-
-	u8 bad_disks[ARRAY_SIZE(pdsks)];
-	bool found_good_data = false;
-	size_t good_disk_index = -1;
+	return bio->bi_opf & (REQ_RAHEAD | REQ_FAILFAST_MASK);
+}
 
-	struct page *user_page = bvec.bv_page;
-	struct page *local_page = NULL;
-	size_t data_len = bvec.bv_len;
-	size_t data_offset = bvec.bv_offset;
+/*
+ * Speculative reads never wait for a slot and leave all but their share of
+ * the read slots to demand reads: under congestion they fail at once with
+ * BLK_STS_AGAIN.
+ *
+ * Returns true if the bio was admitted.
+ */
+static bool admit_spec_bio(struct bio *bio)
+{
+	unsigned int limit = READ_ONCE(max_inflight_class[SSR_IO_READ]);
 
-	size_t i;
-	bool was_good_data;
-	/* By default we use the user's page until we find not corrupted data */
-	struct page *pg_to_use = user_page;
-	/* CRC info for the current read operation */
-	/* First CRC's sector */
-	sector_t crc_sector_f = get_crc_sector(sector);
-	/* First CRC's index */
-	size_t   crc_index_f  = get_crc_index(sector);
-	/* Read 2 sectors of CRCs if we have data spread between them */
-	size_t crc_data_size  = KERNEL_SECTOR_SIZE * 2;
+	if ((limit == 0 || atomic_read(&inflight_class[SSR_IO_READ]) <
+	     limit * READ_ONCE(spec_read_share) / 100) &&
+	    admit_try(SSR_IO_READ))
+		return true;
 
-	struct page *crc_page = alloc_page(GFP_NOIO);
+	counter_inc(SSR_CNT_SPEC_ABORTED);
+	bio_wouldblock_error(bio);
+	return false;
+}
 
-	/* Initially we suppose all disks are good */
-	memset(bad_disks, 0, ARRAY_SIZE(bad_disks));
+static void admit_debugfs_init(struct dentry *parent)
+{
+	struct dentry *dir = debugfs_create_dir("admission", parent);
 
-	/* Check the sector on all the disks */
-	for (i = 0; i < ARRAY_SIZE(pdsks); ++i) {
-		/* Read the data from the disk */
-		read_page_from_disk(pg_to_use, data_len, data_offset, pdsks[i], sector);
-		/*
-		 * Read the CRC data from the disk.
-		 * Note: offset is 0 so we have data at the beggining of the page
-		 */
-		read_page_from_disk(crc_page, crc_data_size, 0, pdsks[i], crc_sector_f);
+	counter_debugfs("waits", dir, SSR_CNT_ADMIT_WAITS);
+	counter_debugfs("rejects", dir, SSR_CNT_ADMIT_REJECTS);
 
-		/* If we've never found a good page, we can't repair other disks */
-		if (unlikely(found_good_data == false)) {
-			was_good_data = check_and_repair_data(pg_to_use, data_len, data_offset, crc_page, crc_index_f,
-					NULL, 0, NULL);
+	dir = debugfs_create_dir("speculative", parent);
+	counter_debugfs("served", dir, SSR_CNT_SPEC_SERVED);
+	counter_debugfs("failed", dir, SSR_CNT_SPEC_FAILED);
+	counter_debugfs("aborted", dir, SSR_CNT_SPEC_ABORTED);
+}
 
-			if (was_good_data == true) {
-				/* We found good data so we will be able to repair the disk */
-				found_good_data = true;
-				good_disk_index = i;
-				/*
-				 * We found a good page of data. We leave it to the user and
-				 * for the next checks we use a locally alocated one.
-				 */
-				local_page = alloc_page(GFP_NOIO);
-				pg_to_use = local_page;
-			} else {
-				bad_disks[i] = 1;
-			}
-		} else {
-			check_and_repair_data(pg_to_use, data_len, data_offset, crc_page, crc_index_f,
-					user_page, sector, pdsks[i]);
-		}
+/*
+ * QoS: each class has a token bucket per limit, holding up to qos_burst_ms
+ * of its rate and refilled as time passes. A bio takes its tokens even if
+ * that leaves the bucket in debt and its submitter sleeps until the debt
+ * would be repaid, so bios pass at the rate in the order they arrived.
+ * Bios that can not sleep leave their tokens and fail with BLK_STS_AGAIN
+ * instead. Tokens are kept in millionths, so time is counted in
+ * microseconds with no division on the way.
+ */
+enum ssr_qos_limit {
+	SSR_QOS_IOPS,
+	SSR_QOS_BPS,
+	SSR_QOS_LIMITS,
+};
 
-	} /* Now we passed through all disks */
+/* Bounds the burst and refill of a bucket, so the tokens can not overflow */
+#define SSR_QOS_MAX_IDLE_US USEC_PER_SEC
+
+struct ssr_qos {
+	spinlock_t lock;
+	u64 last_us;
+	s64 tokens[SSR_QOS_LIMITS];
+	/* Bios delayed, for how long in all, and those turned away */
+	u64 throttled;
+	u64 throttled_us;
+	u64 rejected;
+};
 
-	if (found_good_data == false) {
-		/* No uncorrupted disk was found */
-		pr_alert_once("[WARN]: All disks are corrupted!\n");
-		ret = -EIO;
-		goto out;
-	}
+static struct ssr_qos qos[SSR_IO_CLASSES];
 
-	/* If we have any broken disks that were not repaired, we do it now */
+static inline bool qos_limited(enum ssr_io_class class)
+{
+	return READ_ONCE(qos_iops[class]) != 0 ||
+	       READ_ONCE(qos_kbps[class]) != 0;
+}
 
-	for (i = 0; i < ARRAY_SIZE(pdsks); ++i) {
-		if (likely(bad_disks[i] == 0))
+/*
+ * Take the tokens of a bio of the given size.
+ *
+ * Returns the microseconds to wait before submitting it; if it may not
+ * wait and has to, the tokens are left in the buckets.
+ */
+static u64 qos_charge(enum ssr_io_class class, unsigned int bytes,
+		      bool may_wait)
+{
+	u64 rate[SSR_QOS_LIMITS] = {
+		[SSR_QOS_IOPS] = READ_ONCE(qos_iops[class]),
+		[SSR_QOS_BPS] = (u64)READ_ONCE(qos_kbps[class]) * 1024,
+	};
+	const s64 cost[SSR_QOS_LIMITS] = {
+		[SSR_QOS_IOPS] = USEC_PER_SEC,
+		[SSR_QOS_BPS] = (s64)bytes * USEC_PER_SEC,
+	};
+	u64 burst_us = clamp_t(u64, READ_ONCE(qos_burst_ms) * USEC_PER_MSEC,
+			       USEC_PER_MSEC, SSR_QOS_MAX_IDLE_US);
+	u64 now = div_u64(ktime_get_ns(), NSEC_PER_USEC);
+	struct ssr_qos *q = &qos[class];
+	u64 elapsed, delay = 0;
+	size_t l;
+
+	spin_lock(&q->lock);
+	elapsed = min_t(u64, now - q->last_us, SSR_QOS_MAX_IDLE_US);
+	q->last_us = now;
+
+	for (l = 0; l < SSR_QOS_LIMITS; ++l) {
+		if (rate[l] == 0)
 			continue;
-
-		read_page_from_disk(pg_to_use, data_len, data_offset, pdsks[i], sector);
-		read_page_from_disk(crc_page, crc_data_size, 0, pdsks[i], crc_sector_f);
-
-		check_and_repair_data(pg_to_use, data_len, data_offset, crc_page, crc_index_f,
-				user_page, sector, pdsks[i]);
+		q->tokens[l] = min_t(s64, q->tokens[l] + elapsed * rate[l],
+				     burst_us * rate[l]) - cost[l];
+		if (q->tokens[l] < 0)
+			delay = max_t(u64, delay,
+				      div64_u64(-q->tokens[l], rate[l]));
 	}
 
-out:
-	if (local_page != NULL)
-		__free_page(local_page);
+	if (delay != 0 && !may_wait) {
+		for (l = 0; l < SSR_QOS_LIMITS; ++l)
+			if (rate[l] != 0)
+				q->tokens[l] += cost[l];
+		++q->rejected;
+	} else if (delay != 0) {
+		++q->throttled;
+		q->throttled_us += delay;
+	}
+	spin_unlock(&q->lock);
 
-	return ret;
+	return delay;
 }
 
-static void my_read_handler(struct work_struct *work)
+/*
+ * Hold the bio to the QoS limits of its class, before it is admitted.
+ * Speculative bios never wait.
+ *
+ * Returns true if the bio may go on.
+ */
+static bool qos_throttle(struct bio *bio, enum ssr_io_class class,
+			 bool speculative)
 {
-	int err;
+	bool may_wait = !speculative && !(bio->bi_opf & REQ_NOWAIT);
+	u64 delay;
 
-	struct work_bio_info *info;
-	struct bio_vec bvec;
-	struct bvec_iter i;
-
-	bool both_disks_corrupted = false;
+	if (likely(!qos_limited(class)))
+		return true;
 
-	info = container_of(work, struct work_bio_info, my_work);
+	delay = qos_charge(class, bio->bi_iter.bi_size, may_wait);
+	if (delay == 0)
+		return true;
 
-	bio_for_each_segment(bvec, info->original_bio, i) {
-		sector_t sector = i.bi_sector;
+	if (!may_wait) {
+		bio_wouldblock_error(bio);
+		return false;
+	}
 
-		err = read_and_check_disks(bvec, sector);
+	fsleep(delay);
+	return true;
+}
 
-		if (unlikely(err != 0)) {
-			both_disks_corrupted = true;
-			break;
-		}
+static void qos_init(struct dentry *parent)
+{
+	static const char * const names[] = {
+		[SSR_IO_READ] = "read",
+		[SSR_IO_WRITE] = "write",
+	};
+	struct dentry *dir, *qos_dir = debugfs_create_dir("qos", parent);
+	size_t c;
+
+	for (c = 0; c < SSR_IO_CLASSES; ++c) {
+		spin_lock_init(&qos[c].lock);
+
+		dir = debugfs_create_dir(names[c], qos_dir);
+		debugfs_create_u64("throttled", 0400, dir, &qos[c].throttled);
+		debugfs_create_u64("throttled_us", 0400, dir,
+				   &qos[c].throttled_us);
+		debugfs_create_u64("rejected", 0400, dir, &qos[c].rejected);
 	}
+}
 
-	if (unlikely(both_disks_corrupted))
-		bio_io_error(info->original_bio);
-	else
-		bio_endio(info->original_bio);
-
-	kfree(info);
+/*
+ * Bio trace: while enabled, every bio submitted is logged as a struct
+ * ssr_trace_rec to the per-CPU relay files ssr/trace/bios<cpu>, to be
+ * replayed with tools/trace/ssr-replay. The channel is opened on the first
+ * enable and kept until unload so readers stay attached across captures;
+ * records that find the buffers full are counted and dropped.
+ */
+static struct rchan *trace_chan;
+static bool trace_on;
+static DEFINE_MUTEX(trace_lock);
+static struct dentry *trace_dir;
+
+static struct dentry *trace_create_buf_file(const char *filename,
+					    struct dentry *parent, umode_t mode,
+					    struct rchan_buf *buf, int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
 }
 
-static u32 crcs[CRC_PER_SECTOR];
-static void my_write_handler(struct work_struct *work)
+static int trace_remove_buf_file(struct dentry *dentry)
 {
-	struct work_bio_info *info;
-	struct bio_vec bvec;
-	struct bvec_iter i;
+	debugfs_remove(dentry);
+	return 0;
+}
 
-	info = container_of(work, struct work_bio_info, my_work);
+static int trace_subbuf_start(struct rchan_buf *buf, void *subbuf,
+			      void *prev_subbuf, size_t prev_padding)
+{
+	if (relay_buf_full(buf)) {
+		counter_inc(SSR_CNT_TRACE_DROPPED);
+		return 0;
+	}
 
-	bio_for_each_segment(bvec, info->original_bio, i) {
-		sector_t sector = i.bi_sector;
-		size_t data_len = bvec.bv_len;
+	return 1;
+}
 
-		sector_t crc_sector =
-			LOGICAL_DISK_SECTORS + sector / CRC_PER_SECTOR;
+static struct rchan_callbacks trace_callbacks = {
+	.subbuf_start = trace_subbuf_start,
+	.create_buf_file = trace_create_buf_file,
+	.remove_buf_file = trace_remove_buf_file,
+};
 
-		/* The position in the CRC sector where this page starts. */
-		unsigned long crc_start_index = sector % CRC_PER_SECTOR;
+static void trace_bio(struct bio *bio)
+{
+	struct ssr_trace_rec rec = {
+		.time_ns = ktime_get_ns(),
+		.sector = bio->bi_iter.bi_sector,
+		.nr_sectors = bio_sectors(bio),
+	};
+
+	if (op_is_write(bio_op(bio)))
+		rec.flags |= SSR_TRACE_WRITE;
+	if (op_is_sync(bio->bi_opf))
+		rec.flags |= SSR_TRACE_SYNC;
+	if (bio->bi_opf & REQ_FUA)
+		rec.flags |= SSR_TRACE_FUA;
+	if (bio->bi_opf & REQ_PREFLUSH)
+		rec.flags |= SSR_TRACE_PREFLUSH;
+	if (bio->bi_opf & REQ_RAHEAD)
+		rec.flags |= SSR_TRACE_RAHEAD;
+	if (bio->bi_opf & REQ_NOWAIT)
+		rec.flags |= SSR_TRACE_NOWAIT;
+
+	relay_write(trace_chan, &rec, sizeof(rec));
+}
 
-		unsigned char *data;
-		int i;
+static int trace_enable_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(trace_on);
+	return 0;
+}
 
-		/* Write the data to both disks. */
-		write_page_to_disk(bvec.bv_page, data_len, bvec.bv_offset, pdsks[0], sector);
-		write_page_to_disk(bvec.bv_page, data_len, bvec.bv_offset, pdsks[1], sector);
+static int trace_enable_set(void *data, u64 val)
+{
+	int err = 0;
 
-		/* Recalculate and write the CRC for each sector of the page. */
-		read_payload_from_disk(crc_sector, 0, KERNEL_SECTOR_SIZE,
-				       pdsks[0], crcs);
+	mutex_lock(&trace_lock);
+	if (val != 0 && trace_chan == NULL) {
+		trace_chan = relay_open("bios", trace_dir, SSR_TRACE_SUBBUF_SIZE,
+					SSR_TRACE_NR_SUBBUFS, &trace_callbacks,
+					NULL);
+		if (trace_chan == NULL)
+			err = -ENOMEM;
+	}
+	if (err == 0) {
+		/* Submitters see the channel before they see tracing on */
+		smp_store_release(&trace_on, val != 0);
+		if (val == 0 && trace_chan != NULL)
+			relay_flush(trace_chan);
+	}
+	mutex_unlock(&trace_lock);
 
-		/* Map the data to make its CRC. */
-		data = kmap_atomic(bvec.bv_page);
+	return err;
+}
 
-		for (i = 0; i < data_len / KERNEL_SECTOR_SIZE; i += 1) {
-			crcs[crc_start_index + i] =
-				crc32(0, data + i * KERNEL_SECTOR_SIZE,
-				      KERNEL_SECTOR_SIZE);
-		}
-		/* Unmap the data */
-		kunmap_atomic(data);
+DEFINE_DEBUGFS_ATTRIBUTE(trace_enable_fops, trace_enable_get,
+			 trace_enable_set, "%llu\n");
 
-		/* Write the updated CRCs back to both disks */
-		write_payload_to_disk(crcs, KERNEL_SECTOR_SIZE, crc_sector, 0,
-					pdsks[0]);
-		write_payload_to_disk(crcs, KERNEL_SECTOR_SIZE, crc_sector, 0,
-					pdsks[1]);
-	}
+static void trace_init(struct dentry *parent)
+{
+	trace_dir = debugfs_create_dir("trace", parent);
+	debugfs_create_file_unsafe("enable", 0600, trace_dir, NULL,
+				   &trace_enable_fops);
+	counter_debugfs("dropped", trace_dir, SSR_CNT_TRACE_DROPPED);
+}
 
-	bio_endio(info->original_bio);
-	kfree(info);
+/* Called once no more bios come in, before debugfs is removed */
+static void trace_exit(void)
+{
+	WRITE_ONCE(trace_on, false);
+	if (trace_chan != NULL)
+		relay_close(trace_chan);
 }
 
 static blk_qc_t my_submit_bio(struct bio *bio)
 {
 	int should_write = bio_data_dir(bio) == REQ_OP_WRITE;
+	enum ssr_io_class class = should_write ? SSR_IO_WRITE : SSR_IO_READ;
+	bool speculative = !should_write && bio_is_speculative(bio);
 	struct work_bio_info *info;
 
-	info = kmalloc(sizeof(*info), GFP_ATOMIC);
+	if (smp_load_acquire(&trace_on))
+		trace_bio(bio);
+
+	if (!qos_throttle(bio, class, speculative))
+		return BLK_QC_T_NONE;
+
+	if (speculative ? !admit_spec_bio(bio) : !admit_bio(bio, class))
+		return BLK_QC_T_NONE;
+
+	/* Submitters that can not wait are never put to sleep */
+	info = mempool_alloc(info_pool,
+			     (bio->bi_opf & REQ_NOWAIT) || speculative ?
+			     GFP_NOWAIT : GFP_NOIO);
 	if (!info)
 		goto error_exit;
 
 	info->original_bio = bio;
-	if (should_write)
-		INIT_WORK(&info->my_work, my_write_handler);
-	else
-		INIT_WORK(&info->my_work, my_read_handler);
-
-	queue_work(queue, &info->my_work);
+	info->class = class;
+	if (should_write) {
+		sched_entry_init(&info->entry, my_write_handler);
+		sched_queue(&info->entry, op_is_sync(bio->bi_opf) ?
+			    SSR_SCHED_SYNC_WRITE : SSR_SCHED_ASYNC_WRITE);
+	} else if (speculative) {
+		sched_entry_init(&info->entry, my_spec_read_handler);
+		sched_queue(&info->entry, SSR_SCHED_SPEC_READ);
+	} else {
+		sched_entry_init(&info->entry, my_read_handler);
+		sched_queue(&info->entry, SSR_SCHED_SYNC_READ);
+	}
 
 	return BLK_QC_T_NONE;
 
 error_exit:
-	bio_endio(bio);
+	admit_done(class);
+	bio_wouldblock_error(bio);
 	return BLK_QC_T_NONE;
 }
 
+/*
+ * SSR_IOCTL_SYNC starts bringing the whole device in sync and returns at
+ * once; its progress is read from the "op" sysfs attribute.
+ */
+static int my_block_ioctl(struct block_device *bdev, fmode_t mode,
+			  unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case SSR_IOCTL_SYNC:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EACCES;
+		return op_start(SSR_OP_SYNC, 0, LOGICAL_DISK_SECTORS);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct block_device_operations my_block_ops = {
 	.owner = THIS_MODULE,
 	.open = my_block_open,
 	.release = my_block_release,
+	.ioctl = my_block_ioctl,
 	.submit_bio = my_submit_bio,
 };
 
@@ -470,6 +3785,10 @@ static int create_block_device(struct my_block_dev *dev)
 		goto out_blk_init;
 	}
 	blk_queue_logical_block_size(dev->queue, KERNEL_SECTOR_SIZE);
+#ifdef QUEUE_FLAG_NOWAIT
+	/* Submission never sleeps for REQ_NOWAIT bios, see my_submit_bio */
+	blk_queue_flag_set(QUEUE_FLAG_NOWAIT, dev->queue);
+#endif
 	dev->queue->queuedata = dev;
 
 	/* initialize the gendisk structure */
@@ -488,7 +3807,7 @@ static int create_block_device(struct my_block_dev *dev)
 	snprintf(dev->gd->disk_name, DISK_NAME_LEN, LOGICAL_DISK_NAME);
 	set_capacity(dev->gd, LOGICAL_DISK_SECTORS);
 
-	add_disk(dev->gd);
+	device_add_disk(NULL, dev->gd, ssr_attr_groups);
 
 	return 0;
 
@@ -512,7 +3831,7 @@ static void delete_block_device(struct my_block_dev *dev)
 		blk_mq_free_tag_set(&dev->tag_set);
 }
 
-static struct block_device *open_disk(char *name)
+static struct block_device *open_disk(const char *name)
 {
 	struct block_device *bdev;
 
@@ -531,40 +3850,109 @@ static inline void close_disk(struct block_device *bdev)
 	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
 }
 
+static void close_disks(size_t nr_disks)
+{
+	size_t i;
+
+	for (i = 0; i < nr_disks; ++i)
+		close_disk(pdsks[i]);
+}
+
 static int __init ssr_init(void)
 {
 	int err = 0;
+	size_t i;
+
+	BUILD_BUG_ON(SSR_NR_DISKS < 2 || SSR_NR_DISKS > ARRAY_SIZE(pdsk_names));
+	/* The CRC region covers the data exactly and the superblock follows */
+	BUILD_BUG_ON(LOGICAL_DISK_SECTORS % CRC_PER_SECTOR != 0);
+	BUILD_BUG_ON(get_crc_sector(LOGICAL_DISK_SECTORS - 1) != SSR_SB_SECTOR - 1);
+	/* A segment's CRCs span at most two CRC sectors */
+	BUILD_BUG_ON(SSR_SEG_MAX_SECTORS > CRC_PER_SECTOR);
+	/* No two regions share a CRC sector */
+	BUILD_BUG_ON(SSR_REGION_SECTORS % CRC_PER_SECTOR != 0);
+
+	health_init();
 
 	err = register_blkdev(SSR_MAJOR, LOGICAL_DISK_NAME);
 	if (err < 0)
 		return err;
 
-	create_block_device(&g_dev);
-
 	/* open physical disks */
-	pdsks[0] = open_disk(PHYSICAL_DISK1_NAME);
-	if (pdsks[0] == NULL)
-		goto remove_block_device;
-
-	pdsks[1] = open_disk(PHYSICAL_DISK2_NAME);
-	if (pdsks[1] == NULL)
-		goto remove_block_device;
-
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		pdsks[i] = open_disk(pdsk_names[i]);
+		if (pdsks[i] == NULL) {
+			close_disks(i);
+			goto unregister;
+		}
+	}
 
-	queue = create_singlethread_workqueue("myworkqueue");
+	queue = alloc_workqueue("myworkqueue", WQ_MEM_RECLAIM, 0);
 	if (queue == NULL)
 		goto remove_disks;
 
+	info_pool = mempool_create_kmalloc_pool(SSR_INFO_POOL_MIN,
+						sizeof(struct work_bio_info));
+	if (info_pool == NULL)
+		goto remove_queue;
 
-	return 0;
+	if (ssr_ra_init() != 0)
+		goto remove_pool;
 
-remove_disks:
-	close_disk(pdsks[0]);
-	close_disk(pdsks[1]);
+	ssr_debugfs = debugfs_create_dir(LOGICAL_DISK_NAME, NULL);
+	fault_debugfs_init(ssr_debugfs);
+	admit_debugfs_init(ssr_debugfs);
+	qos_init(ssr_debugfs);
+	recent_debugfs_init(ssr_debugfs);
+	trace_init(ssr_debugfs);
+	sched_init(ssr_debugfs);
+	counter_debugfs("diverged", ssr_debugfs, SSR_CNT_DIVERGED);
+
+	if (verify_init(ssr_debugfs) != 0)
+		goto remove_debugfs;
+
+	if (op_init() != 0)
+		goto remove_verify;
+
+	if (!sb_load())
+		pr_warn("array was not shut down cleanly\n");
+
+	/* The disk is added last, IO may arrive as soon as it is */
+	if (create_block_device(&g_dev) != 0)
+		goto remove_op;
+
+	if (misc_register(&ctl_dev) != 0)
+		goto remove_block_device;
+
+	if (READ_ONCE(sb_recovery_pending) && resync_dirty)
+		op_start(SSR_OP_RECOVER, 0, LOGICAL_DISK_SECTORS);
+
+	return 0;
 
 remove_block_device:
 	delete_block_device(&g_dev);
 
+remove_op:
+	op_free();
+
+remove_verify:
+	verify_free();
+
+remove_debugfs:
+	trace_exit();
+	debugfs_remove_recursive(ssr_debugfs);
+	ssr_ra_free();
+
+remove_pool:
+	mempool_destroy(info_pool);
+
+remove_queue:
+	destroy_workqueue(queue);
+
+remove_disks:
+	close_disks(SSR_NR_DISKS);
+
+unregister:
 	unregister_blkdev(SSR_MAJOR, LOGICAL_DISK_NAME);
 
 	return -ENXIO;
@@ -572,11 +3960,21 @@ remove_block_device:
 
 static void __exit ssr_exit(void)
 {
-	close_disk(pdsks[0]);
-	close_disk(pdsks[1]);
-
+	misc_deregister(&ctl_dev);
+	op_free();
 	delete_block_device(&g_dev);
 
+	trace_exit();
+	debugfs_remove_recursive(ssr_debugfs);
+
+	verify_free();
+	destroy_workqueue(queue);
+	ssr_ra_free();
+	mempool_destroy(info_pool);
+
+	sb_mark_clean();
+	close_disks(SSR_NR_DISKS);
+
 	unregister_blkdev(SSR_MAJOR, LOGICAL_DISK_NAME);
 }
 
@@ -6,12 +6,18 @@
 #ifndef SSR_H_
 #define SSR_H_ 1
 
+#include <linux/types.h>
+
 #define SSR_MAJOR 240
 #define SSR_FIRST_MINOR 0
 #define SSR_NUM_MINORS 1
 
 #define PHYSICAL_DISK1_NAME "/dev/vdb"
 #define PHYSICAL_DISK2_NAME "/dev/vdc"
+#define PHYSICAL_DISK3_NAME "/dev/vdd"
+
+/* number of mirrors, 2 or 3 (fixed at build time so I/O loops unroll) */
+#define SSR_NR_DISKS 2
 
 /* sector size */
 #define KERNEL_SECTOR_SIZE 512
@@ -28,8 +34,115 @@
 #define CRC_PER_SECTOR (KERNEL_SECTOR_SIZE / sizeof(uint32_t))
 #define get_crc_sector(ith_sect) (LOGICAL_DISK_SECTORS + ((ith_sect) / CRC_PER_SECTOR))
 #define get_crc_index(ith_sect) ((ith_sect) % CRC_PER_SECTOR)
+/* bytes of the CRC sectors of [first, first + nr), two sectors if it spans them */
+#define get_crc_len(first, nr) \
+	((get_crc_sector((first) + (nr) - 1) - get_crc_sector(first) + 1) * \
+	 KERNEL_SECTOR_SIZE)
+
+/* superblock, right after the CRC region */
+#define SSR_SB_SECTOR (LOGICAL_DISK_SECTORS + LOGICAL_DISK_CRC_SECTORS)
+#define SSR_SB_MAGIC 0x31525353 /* "SSR1" */
+#define SSR_SB_VERSION 1
+#define SSR_SB_CLEAN 0
+#define SSR_SB_DIRTY 1
+
+/* in the sector right after the CRC region of every disk, little endian */
+struct ssr_superblock {
+	__le32 magic;
+	__le32 version;
+	__le32 state;
+	__le32 reserved;
+	__le64 events;
+	/* CRC of the fields above */
+	__le32 crc;
+} __attribute__((packed));
+
+/* a bio segment never spans more than one page */
+#define SSR_SEG_MAX_SECTORS (PAGE_SIZE / KERNEL_SECTOR_SIZE)
+
+/* requests whose bookkeeping is always available */
+#define SSR_INFO_POOL_MIN 16
+
+/* readahead: sequential streams tracked and per-stream window bounds */
+#define SSR_RA_STREAMS 4
+#define SSR_RA_MIN_SECTORS 16
+#define SSR_RA_MAX_SECTORS 256
+#define SSR_RA_DATA_PAGES ((SSR_RA_MAX_SECTORS * KERNEL_SECTOR_SIZE) / PAGE_SIZE)
+
+/* member health: fixed point averages and how fast they move */
+#define SSR_HEALTH_SHIFT 16
+#define SSR_HEALTH_ONE (1 << SSR_HEALTH_SHIFT)
+#define SSR_HEALTH_AVG_SHIFT 10
+
+/* fault injection rates are given in parts per million */
+#define SSR_FAULT_PPM 1000000
+
+/* maintenance operations: sectors handled per step */
+#define SSR_OP_SECTORS 256
+
+/* crash recovery: regions resynced in parallel, aligned to CRC sectors */
+#define SSR_REGION_SHIFT 14
+#define SSR_REGION_SECTORS (1 << SSR_REGION_SHIFT)
+#define SSR_NR_REGIONS ((LOGICAL_DISK_SECTORS + SSR_REGION_SECTORS - 1) / SSR_REGION_SECTORS)
+#define SSR_RECOVERY_WORKERS 16
+
+/* check-only verification: buffers for one step and mismatches listed */
+#define SSR_VERIFY_DATA_PAGES ((SSR_OP_SECTORS * KERNEL_SECTOR_SIZE) / PAGE_SIZE)
+#define SSR_VERIFY_MAX_REPORT 4096
+
+/* recently written blocks: tracked per page and read from a single disk */
+#define SSR_RECENT_SHIFT 3
+#define SSR_RECENT_BLOCKS (LOGICAL_DISK_SECTORS >> SSR_RECENT_SHIFT)
+
+/* writes that failed on some disks: the disks that missed them, per block */
+#define SSR_STALE_SHIFT 3
+#define SSR_STALE_BLOCKS (LOGICAL_DISK_SECTORS >> SSR_STALE_SHIFT)
+
+/* bio trace: relay sub-buffers per CPU and the records logged to them */
+#define SSR_TRACE_SUBBUF_SIZE (64 * 1024)
+#define SSR_TRACE_NR_SUBBUFS 64
+
+#define SSR_TRACE_WRITE 1
+#define SSR_TRACE_SYNC 2
+#define SSR_TRACE_FUA 4
+#define SSR_TRACE_PREFLUSH 8
+#define SSR_TRACE_RAHEAD 16
+#define SSR_TRACE_NOWAIT 32
+
+struct ssr_trace_rec {
+	/* submission time, CLOCK_MONOTONIC */
+	__u64 time_ns;
+	__u64 sector;
+	__u32 nr_sectors;
+	__u32 flags;
+};
 
 /* sync data */
 #define SSR_IOCTL_SYNC 1
 
+/* control device: range commands written to it, CRCs read from it */
+#define SSR_CTL_NAME "ssr-ctl"
+#define SSR_CTL_CRC_GROUP (CRC_PER_SECTOR * (PAGE_SIZE / KERNEL_SECTOR_SIZE))
+
+#define SSR_CMD_VERIFY 1
+#define SSR_CMD_REPAIR 2
+
+struct ssr_range_cmd {
+	__u32 opcode;
+	__u32 reserved;
+	__u64 sector;
+	__u64 nr_sectors;
+	/* user address of a struct ssr_range_result */
+	__u64 result;
+};
+
+struct ssr_range_result {
+	__u64 nr_checked;
+	/* sectors that failed the check, counted once per disk */
+	__u64 nr_bad;
+	__u64 nr_repaired;
+	/* sectors no disk holds a good copy of */
+	__u64 nr_lost;
+};
+
 #endif
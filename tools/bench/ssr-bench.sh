@@ -0,0 +1,201 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0+
+#
+# Assemble ssr over brd, null_blk or loop members and run a fixed matrix of
+# fio jobs in clean, degraded and corrupted states. Every job leaves fio's
+# JSON in the output directory, and summarize.py collects them in
+# summary.json, to compare against the one of a baseline:
+#
+#   ssr-bench.sh -k ssr.ko -o base
+#   ... change ssr.c, rebuild ...
+#   ssr-bench.sh -k ssr.ko -o new
+#   summarize.py --compare base/summary.json new/summary.json
+#
+# The matrix is narrowed through the environment, e.g.
+#   STATES=clean RWS=randread BSS=4k DEPTHS="1 32" ssr-bench.sh
+#
+# Needs root, fio, make and debugfs mounted; the degraded and corrupted
+# states are set up with the fault injection files of ssr in debugfs. Every
+# state starts from members freshly written by tools/offline/ssr-init, so a
+# state never runs on a mirror left stale by the faults of the one before
+# and the results do not depend on the order of STATES. Fault injection
+# turns off readahead and the single-disk read of recently written blocks,
+# so those states measure the array without them as well: compare a state
+# with the same state of another run, not clean with degraded.
+
+set -eu
+
+MEMBERS=brd
+MODULE=ssr.ko
+OUT=bench-$(date +%Y%m%d-%H%M%S)
+RUNTIME=10
+RAMP=2
+
+# Must match SSR_NR_DISKS of the module
+NR_DISKS=${NR_DISKS:-2}
+# Enough for the data, CRCs and superblock of a member
+MEMBER_MIB=128
+
+STATES=${STATES:-"clean degraded corrupted"}
+RWS=${RWS:-"randread randwrite read write randrw"}
+BSS=${BSS:-"4k 16k 64k 128k"}
+DEPTHS=${DEPTHS:-"1 4 16 32 128"}
+IOENGINE=${IOENGINE:-libaio}
+
+DEV=/dev/ssr
+DEBUGFS=/sys/kernel/debug/ssr
+OFFLINE=$(dirname "$0")/../offline
+
+usage() {
+	echo "usage: $0 [-m brd|null_blk|loop] [-k MODULE] [-o DIR] [-t SECS]" >&2
+	exit 2
+}
+
+while getopts "m:k:o:t:" opt; do
+	case $opt in
+	m) MEMBERS=$OPTARG ;;
+	k) MODULE=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	t) RUNTIME=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+disks=()
+loop_dir=
+
+members_up() {
+	local i d
+
+	case $MEMBERS in
+	brd)
+		modprobe brd rd_nr="$NR_DISKS" rd_size=$((MEMBER_MIB * 1024))
+		for ((i = 0; i < NR_DISKS; ++i)); do
+			disks+=("/dev/ram$i")
+		done
+		;;
+	null_blk)
+		modprobe null_blk nr_devices=0
+		for ((i = 0; i < NR_DISKS; ++i)); do
+			d=/sys/kernel/config/nullb/ssr$i
+			mkdir "$d"
+			echo "$MEMBER_MIB" > "$d/size"
+			echo 1 > "$d/memory_backed"
+			echo 512 > "$d/blocksize"
+			echo 1 > "$d/power"
+			disks+=("/dev/nullb$(cat "$d/index")")
+		done
+		;;
+	loop)
+		loop_dir=$(mktemp -d)
+		for ((i = 0; i < NR_DISKS; ++i)); do
+			truncate -s "${MEMBER_MIB}M" "$loop_dir/disk$i"
+			disks+=("$(losetup -f --show --direct-io=on "$loop_dir/disk$i")")
+		done
+		;;
+	*)
+		usage
+		;;
+	esac
+}
+
+members_down() {
+	local i d
+
+	case $MEMBERS in
+	brd)
+		rmmod brd 2>/dev/null || true
+		;;
+	null_blk)
+		for ((i = 0; i < NR_DISKS; ++i)); do
+			d=/sys/kernel/config/nullb/ssr$i
+			[ -d "$d" ] && echo 0 > "$d/power" && rmdir "$d"
+		done
+		rmmod null_blk 2>/dev/null || true
+		;;
+	loop)
+		for d in "${disks[@]}"; do
+			losetup -d "$d"
+		done
+		[ -n "$loop_dir" ] && rm -rf "$loop_dir"
+		;;
+	esac
+}
+
+cleanup() {
+	rmmod ssr 2>/dev/null || true
+	members_down
+}
+
+# Write zeroes, their CRCs and clean superblocks to the members and assemble
+# the array over them, so every sector reads back and no resync runs
+array_up() {
+	rmmod ssr 2>/dev/null || true
+	"$OFFLINE/build/ssr-init" -f "${disks[@]}"
+	insmod "$MODULE" disks="$(IFS=,; echo "${disks[*]}")"
+}
+
+# Faults are seeded so a corrupted run injects the same faults every time
+set_state() {
+	array_up
+	echo 1 > "$DEBUGFS/fault/seed"
+
+	case $1 in
+	clean)
+		;;
+	degraded)
+		echo 1 > "$DEBUGFS/fault/disk1/failed"
+		echo 1 > "$DEBUGFS/fault/enable"
+		;;
+	corrupted)
+		echo 1000 > "$DEBUGFS/fault/disk1/data_corrupt_ppm"
+		echo 1 > "$DEBUGFS/fault/enable"
+		;;
+	esac
+}
+
+run_job() {
+	local state=$1 rw=$2 bs=$3 qd=$4
+	local name=$state-$rw-$bs-qd$qd
+	local extra=()
+
+	[ "$rw" = randrw ] && extra+=(--rwmixread=70)
+
+	echo "$name"
+	fio --name="$name" --filename="$DEV" --direct=1 \
+		--ioengine="$IOENGINE" --rw="$rw" --bs="$bs" --iodepth="$qd" \
+		--runtime="$RUNTIME" --ramp_time="$RAMP" --time_based \
+		--randseed=1 --percentile_list=50:90:99:99.9:99.99 \
+		"${extra[@]}" --output-format=json --output="$OUT/$name.json"
+}
+
+trap cleanup EXIT
+
+mkdir -p "$OUT"
+make -s -C "$OFFLINE"
+members_up
+
+cat > "$OUT/meta.json" <<META
+{
+	"kernel": "$(uname -r)",
+	"commit": "$(git -C "$(dirname "$0")" rev-parse HEAD 2>/dev/null || echo unknown)",
+	"members": "$MEMBERS",
+	"nr_disks": $NR_DISKS,
+	"ioengine": "$IOENGINE",
+	"runtime": $RUNTIME,
+	"notes": "fault injection turns off readahead and recent-write reads in the degraded and corrupted states"
+}
+META
+
+for state in $STATES; do
+	set_state "$state"
+	for rw in $RWS; do
+		for bs in $BSS; do
+			for qd in $DEPTHS; do
+				run_job "$state" "$rw" "$bs" "$qd"
+			done
+		done
+	done
+done
+
+"$(dirname "$0")/summarize.py" "$OUT"
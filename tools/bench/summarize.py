@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0+
+"""Collect the fio results of ssr-bench.sh in one JSON file, or compare two.
+
+usage: summarize.py DIR
+           writes DIR/summary.json from the job results in DIR
+       summarize.py --compare BASE NEW [--threshold PCT]
+           prints how every job changed between two summaries and fails if
+           IOPS dropped or p99 latency grew by more than PCT percent
+"""
+
+import argparse
+import glob
+import json
+import os
+import sys
+
+PERCENTILES = ["50.000000", "90.000000", "99.000000", "99.900000", "99.990000"]
+
+
+def job_direction(res):
+    clat = res["clat_ns"]
+    pct = clat.get("percentile", {})
+    return {
+        "iops": res["iops"],
+        "bw_kib": res["bw"],
+        "lat_mean_us": res["lat_ns"]["mean"] / 1000,
+        "clat_us": {p.rstrip("0").rstrip("."): pct.get(p, 0) / 1000
+                    for p in PERCENTILES},
+    }
+
+
+def summarize(out):
+    jobs = []
+    for path in sorted(glob.glob(os.path.join(out, "*-qd*.json"))):
+        with open(path) as f:
+            job = json.load(f)["jobs"][0]
+        state, rw, bs, qd = job["jobname"].split("-")
+        entry = {
+            "job": job["jobname"],
+            "state": state,
+            "rw": rw,
+            "bs": bs,
+            "iodepth": int(qd[2:]),
+            "errors": job["error"],
+        }
+        for direction in ("read", "write"):
+            if job[direction]["total_ios"] > 0:
+                entry[direction] = job_direction(job[direction])
+        jobs.append(entry)
+
+    meta = {}
+    meta_path = os.path.join(out, "meta.json")
+    if os.path.exists(meta_path):
+        with open(meta_path) as f:
+            meta = json.load(f)
+
+    with open(os.path.join(out, "summary.json"), "w") as f:
+        json.dump({"meta": meta, "jobs": jobs}, f, indent=1)
+        f.write("\n")
+
+
+def change(base, new):
+    return (new - base) * 100 / base if base else 0.0
+
+
+def compare(base_path, new_path, threshold):
+    with open(base_path) as f:
+        base = {j["job"]: j for j in json.load(f)["jobs"]}
+    with open(new_path) as f:
+        new = {j["job"]: j for j in json.load(f)["jobs"]}
+
+    regressions = 0
+    print("%-36s %-5s %12s %8s %12s %8s" %
+          ("job", "dir", "iops", "change", "p99 us", "change"))
+    for name in sorted(base.keys() & new.keys()):
+        for direction in ("read", "write"):
+            if direction not in base[name] or direction not in new[name]:
+                continue
+            b, n = base[name][direction], new[name][direction]
+            iops = change(b["iops"], n["iops"])
+            p99 = change(b["clat_us"]["99"], n["clat_us"]["99"])
+            bad = iops < -threshold or p99 > threshold
+            regressions += bad
+            print("%-36s %-5s %12.0f %+7.1f%% %12.1f %+7.1f%%%s" %
+                  (name, direction, n["iops"], iops, n["clat_us"]["99"], p99,
+                   "  <--" if bad else ""))
+
+    for name in sorted(base.keys() ^ new.keys()):
+        print("%-36s only in %s" % (name, "base" if name in base else "new"))
+
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("dir", nargs="?")
+    parser.add_argument("--compare", nargs=2, metavar=("BASE", "NEW"))
+    parser.add_argument("--threshold", type=float, default=5.0)
+    args = parser.parse_args()
+
+    if args.compare:
+        return compare(*args.compare, args.threshold)
+    if not args.dir:
+        parser.error("a results directory or --compare is needed")
+    summarize(args.dir)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
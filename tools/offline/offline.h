@@ -0,0 +1,321 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Simple Software Raid - helpers of the offline tools
+ *
+ * The on-disk layout comes from ssr.h: data in [0, LOGICAL_DISK_SECTORS),
+ * one little endian CRC32 per data sector right after it, then the
+ * superblock. Members are processed in chunks of data sectors whose CRCs
+ * fill whole pages, so every read and write is page aligned for O_DIRECT.
+ */
+#ifndef SSR_OFFLINE_H_
+#define SSR_OFFLINE_H_
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ssr.h"
+
+#define OFF_ALIGN 4096
+/* data sectors whose CRCs fill one aligned block */
+#define OFF_CHUNK_UNIT (OFF_ALIGN / sizeof(uint32_t))
+#define OFF_CHUNK_SECTORS (2 * OFF_CHUNK_UNIT)
+#define OFF_NR_CHUNKS(chunk) DIV_ROUND_UP(LOGICAL_DISK_SECTORS, (chunk))
+#define OFF_MEMBER_SIZE ((off_t)(SSR_SB_SECTOR + 1) * KERNEL_SECTOR_SIZE)
+
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+struct off_member {
+	const char *path;
+	int fd;
+};
+
+/*
+ * CRC32 of lib/crc32.c as used by the driver: little endian, polynomial
+ * 0xedb88320, no inversion. Sliced by 8 bytes, which keeps a core ahead of
+ * a disk, and all cores are used.
+ */
+static uint32_t off_crc_table[8][256];
+
+static void off_crc_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (k = 0; k < 8; ++k)
+			c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
+		off_crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i)
+		for (k = 1; k < 8; ++k)
+			off_crc_table[k][i] = (off_crc_table[k - 1][i] >> 8) ^
+				off_crc_table[0][off_crc_table[k - 1][i] & 0xff];
+}
+
+static uint32_t off_crc32(uint32_t crc, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	uint64_t w;
+
+	for (; len >= 8; len -= 8, b += 8) {
+		memcpy(&w, b, 8);
+		w = le64toh(w) ^ crc;
+		crc = off_crc_table[7][w & 0xff] ^
+		      off_crc_table[6][(w >> 8) & 0xff] ^
+		      off_crc_table[5][(w >> 16) & 0xff] ^
+		      off_crc_table[4][(w >> 24) & 0xff] ^
+		      off_crc_table[3][(w >> 32) & 0xff] ^
+		      off_crc_table[2][(w >> 40) & 0xff] ^
+		      off_crc_table[1][(w >> 48) & 0xff] ^
+		      off_crc_table[0][w >> 56];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ off_crc_table[0][(crc ^ *b++) & 0xff];
+
+	return crc;
+}
+
+static uint64_t off_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *off_alloc(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, OFF_ALIGN, len) != 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(8);
+	}
+	return buf;
+}
+
+/*
+ * Open a member with O_DIRECT, falling back to the page cache for files on
+ * filesystems without it, and check it is large enough for the layout.
+ */
+static int off_member_open(struct off_member *m, int flags)
+{
+	struct stat st;
+	off_t size;
+
+	m->fd = open(m->path, flags | O_DIRECT);
+	if (m->fd < 0 && errno == EINVAL) {
+		fprintf(stderr, "%s: no O_DIRECT, using the page cache\n",
+			m->path);
+		m->fd = open(m->path, flags);
+	}
+	if (m->fd < 0) {
+		perror(m->path);
+		return -1;
+	}
+
+	size = fstat(m->fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size :
+	       lseek(m->fd, 0, SEEK_END);
+	if (size < OFF_MEMBER_SIZE) {
+		fprintf(stderr, "%s: %lld bytes, needs at least %lld\n",
+			m->path, (long long)size, (long long)OFF_MEMBER_SIZE);
+		close(m->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int off_pread(const struct off_member *m, void *buf, size_t len,
+		     off_t offset)
+{
+	ssize_t done;
+
+	for (; len != 0; len -= done, buf = (char *)buf + done,
+	     offset += done) {
+		done = pread(m->fd, buf, len, offset);
+		if (done <= 0) {
+			fprintf(stderr, "%s: read at %lld: %s\n", m->path,
+				(long long)offset,
+				done < 0 ? strerror(errno) : "end of file");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int off_pwrite(const struct off_member *m, const void *buf, size_t len,
+		      off_t offset)
+{
+	ssize_t done;
+
+	for (; len != 0; len -= done, buf = (const char *)buf + done,
+	     offset += done) {
+		done = pwrite(m->fd, buf, len, offset);
+		if (done <= 0) {
+			fprintf(stderr, "%s: write at %lld: %s\n", m->path,
+				(long long)offset,
+				done < 0 ? strerror(errno) : "no space");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Data and CRCs of the chunk starting at data sector first */
+static off_t off_data_offset(uint64_t first)
+{
+	return (off_t)first * KERNEL_SECTOR_SIZE;
+}
+
+static off_t off_crc_offset(uint64_t first)
+{
+	return (off_t)LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE +
+	       first * sizeof(uint32_t);
+}
+
+/*
+ * The superblock is read and written with the aligned block it starts, the
+ * rest of which is past the layout.
+ */
+static ssize_t off_sb_block_read(const struct off_member *m, uint8_t *buf)
+{
+	return pread(m->fd, buf, OFF_ALIGN,
+		     (off_t)SSR_SB_SECTOR * KERNEL_SECTOR_SIZE);
+}
+
+static int off_sb_read(const struct off_member *m, struct ssr_superblock *sb)
+{
+	uint8_t *buf = off_alloc(OFF_ALIGN);
+	ssize_t done = off_sb_block_read(m, buf);
+
+	if (done >= (ssize_t)sizeof(*sb))
+		memcpy(sb, buf, sizeof(*sb));
+	free(buf);
+
+	return done >= (ssize_t)sizeof(*sb) ? 0 : -1;
+}
+
+static bool off_sb_valid(const struct ssr_superblock *sb)
+{
+	return le32toh(sb->magic) == SSR_SB_MAGIC &&
+	       le32toh(sb->crc) ==
+		       off_crc32(CRC_SEED, sb,
+				 offsetof(struct ssr_superblock, crc));
+}
+
+/* Write a superblock like sb_write() of the driver, and sync it */
+static int off_sb_write(const struct off_member *m, uint32_t state,
+			uint64_t events)
+{
+	uint8_t *buf = off_alloc(OFF_ALIGN);
+	struct ssr_superblock *sb = (struct ssr_superblock *)buf;
+	ssize_t len = off_sb_block_read(m, buf);
+	int err = -1;
+
+	if (len >= KERNEL_SECTOR_SIZE) {
+		memset(buf, 0, KERNEL_SECTOR_SIZE);
+		sb->magic = htole32(SSR_SB_MAGIC);
+		sb->version = htole32(SSR_SB_VERSION);
+		sb->state = htole32(state);
+		sb->events = htole64(events);
+		sb->crc = htole32(off_crc32(CRC_SEED, sb,
+					    offsetof(struct ssr_superblock, crc)));
+
+		if (pwrite(m->fd, buf, len,
+			   (off_t)SSR_SB_SECTOR * KERNEL_SECTOR_SIZE) == len &&
+		    fsync(m->fd) == 0)
+			err = 0;
+	}
+	if (err != 0)
+		fprintf(stderr, "%s: cannot write the superblock: %s\n",
+			m->path, strerror(errno));
+	free(buf);
+
+	return err;
+}
+
+/*
+ * Run fn on every chunk of the device from nr_threads threads, each owning
+ * the chunks it takes, so no two threads ever touch the same CRC block.
+ */
+struct off_pool {
+	size_t chunk_sectors;
+	int nr_threads;
+	int (*fn)(void *ctx, uint64_t first, size_t nr_sectors);
+	/* one per thread, nr_threads of ctx_size bytes */
+	void *ctxs;
+	size_t ctx_size;
+	/* shared */
+	size_t next;
+	int err;
+};
+
+struct off_pool_thread {
+	struct off_pool *pool;
+	void *ctx;
+};
+
+static void *off_pool_thread_fn(void *arg)
+{
+	struct off_pool_thread *t = arg;
+	struct off_pool *pool = t->pool;
+	uint64_t first;
+	size_t chunk;
+	int err;
+
+	while ((chunk = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	       OFF_NR_CHUNKS(pool->chunk_sectors)) {
+		if (__atomic_load_n(&pool->err, __ATOMIC_RELAXED) != 0)
+			break;
+		first = (uint64_t)chunk * pool->chunk_sectors;
+		err = pool->fn(t->ctx, first,
+			       LOGICAL_DISK_SECTORS - first < pool->chunk_sectors ?
+			       LOGICAL_DISK_SECTORS - first : pool->chunk_sectors);
+		if (err != 0)
+			__atomic_store_n(&pool->err, err, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static int off_pool_run(struct off_pool *pool)
+{
+	pthread_t *threads = calloc(pool->nr_threads, sizeof(*threads));
+	struct off_pool_thread *ts = calloc(pool->nr_threads, sizeof(*ts));
+	int i, started;
+
+	if (threads == NULL || ts == NULL)
+		return -ENOMEM;
+
+	for (started = 0; started < pool->nr_threads; ++started) {
+		ts[started].pool = pool;
+		ts[started].ctx = (char *)pool->ctxs + started * pool->ctx_size;
+		if (pthread_create(&threads[started], NULL, off_pool_thread_fn,
+				   &ts[started]) != 0)
+			break;
+	}
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(ts);
+	free(threads);
+	return started == 0 ? -EAGAIN : pool->err;
+}
+
+#endif /* SSR_OFFLINE_H_ */
@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - offline check and repair of members
+ *
+ * Checks every data sector of every member against its CRC and the members
+ * against each other, without the module: for arrays that will not
+ * assemble, or to check members before they are assembled. Chunks of the
+ * device are read from all members at once by a pool of threads, so every
+ * member sees as many reads in flight as there are threads.
+ *
+ * With -r, sectors that fail their CRC are rewritten, data and CRC, from a
+ * member holding a good copy, and members that both hold a good but
+ * different copy are made equal to the first one listed. If every member
+ * was given and nothing is left unrepaired, the superblocks are then marked
+ * clean; with members missing they are left alone, so the array still
+ * resyncs the others when assembled.
+ *
+ * Exit status as fsck(8): 0 clean, 1 errors repaired, 4 errors left,
+ * 8 operational error.
+ */
+
+#include "offline.h"
+
+#include <getopt.h>
+
+#define FSCK_MAX_REPORT 32
+
+static struct {
+	bool repair;
+	bool verbose;
+	int threads;
+	size_t chunk_sectors;
+} opts = {
+	.threads = 16,
+	.chunk_sectors = OFF_CHUNK_SECTORS,
+};
+
+static struct off_member members[SSR_NR_DISKS];
+static int nr_members;
+
+struct fsck_ctx {
+	uint8_t *data[SSR_NR_DISKS];
+	uint32_t *crcs[SSR_NR_DISKS];
+	/* sectors failing their CRC, per member */
+	uint64_t bad[SSR_NR_DISKS];
+	/* sectors good on several members, with different data */
+	uint64_t diverged;
+	/* sectors with no good copy */
+	uint64_t lost;
+	uint64_t repaired;
+};
+
+static uint64_t nr_reported;
+
+static void report(const char *what, uint64_t sector, int member)
+{
+	if (!opts.verbose ||
+	    __atomic_fetch_add(&nr_reported, 1, __ATOMIC_RELAXED) >=
+	    FSCK_MAX_REPORT)
+		return;
+
+	if (member < 0)
+		printf("sector %llu: %s\n", (unsigned long long)sector, what);
+	else
+		printf("sector %llu: %s on %s\n", (unsigned long long)sector,
+		       what, members[member].path);
+}
+
+static int fsck_chunk(void *arg, uint64_t first, size_t nr_sectors)
+{
+	struct fsck_ctx *c = arg;
+	bool good[SSR_NR_DISKS], dirty[SSR_NR_DISKS] = { false };
+	const uint8_t *src_data;
+	uint8_t *data;
+	size_t s;
+	int i, src;
+
+	for (i = 0; i < nr_members; ++i)
+		if (off_pread(&members[i], c->data[i],
+			      nr_sectors * KERNEL_SECTOR_SIZE,
+			      off_data_offset(first)) != 0 ||
+		    off_pread(&members[i], c->crcs[i],
+			      nr_sectors * sizeof(uint32_t),
+			      off_crc_offset(first)) != 0)
+			return -EIO;
+
+	for (s = 0; s < nr_sectors; ++s) {
+		src = -1;
+		for (i = 0; i < nr_members; ++i) {
+			data = c->data[i] + s * KERNEL_SECTOR_SIZE;
+			good[i] = off_crc32(CRC_SEED, data, KERNEL_SECTOR_SIZE) ==
+				  le32toh(c->crcs[i][s]);
+			if (!good[i]) {
+				++c->bad[i];
+				report("bad CRC", first + s, i);
+			} else if (src < 0) {
+				src = i;
+			}
+		}
+
+		if (src < 0) {
+			++c->lost;
+			report("no good copy", first + s, -1);
+			continue;
+		}
+
+		src_data = c->data[src] + s * KERNEL_SECTOR_SIZE;
+		for (i = src + 1; i < nr_members; ++i) {
+			if (good[i] &&
+			    memcmp(c->data[i] + s * KERNEL_SECTOR_SIZE, src_data,
+				   KERNEL_SECTOR_SIZE) != 0) {
+				++c->diverged;
+				report("differs from the first good copy",
+				       first + s, i);
+				good[i] = false;
+			}
+		}
+
+		if (!opts.repair)
+			continue;
+
+		for (i = 0; i < nr_members; ++i) {
+			if (good[i] || i == src)
+				continue;
+			memcpy(c->data[i] + s * KERNEL_SECTOR_SIZE, src_data,
+			       KERNEL_SECTOR_SIZE);
+			c->crcs[i][s] = c->crcs[src][s];
+			dirty[i] = true;
+			++c->repaired;
+		}
+	}
+
+	for (i = 0; i < nr_members; ++i)
+		if (dirty[i] &&
+		    (off_pwrite(&members[i], c->data[i],
+				nr_sectors * KERNEL_SECTOR_SIZE,
+				off_data_offset(first)) != 0 ||
+		     off_pwrite(&members[i], c->crcs[i],
+				nr_sectors * sizeof(uint32_t),
+				off_crc_offset(first)) != 0))
+			return -EIO;
+
+	return 0;
+}
+
+/* Print the superblocks and return the highest event count */
+static uint64_t fsck_superblocks(void)
+{
+	static const char * const states[] = { "clean", "dirty" };
+	struct ssr_superblock sb;
+	uint64_t events = 0;
+	uint32_t state;
+	int i;
+
+	for (i = 0; i < nr_members; ++i) {
+		if (off_sb_read(&members[i], &sb) != 0) {
+			printf("%s: superblock can not be read\n",
+			       members[i].path);
+		} else if (le32toh(sb.magic) != SSR_SB_MAGIC) {
+			printf("%s: no superblock\n", members[i].path);
+		} else if (!off_sb_valid(&sb)) {
+			printf("%s: superblock with a bad CRC\n",
+			       members[i].path);
+		} else {
+			state = le32toh(sb.state);
+			printf("%s: superblock version %u, %s, events %llu\n",
+			       members[i].path, le32toh(sb.version),
+			       state < 2 ? states[state] : "unknown",
+			       (unsigned long long)le64toh(sb.events));
+			if (le64toh(sb.events) > events)
+				events = le64toh(sb.events);
+		}
+	}
+
+	return events;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] MEMBER...\n"
+		"  -r          repair, otherwise the members are only read\n"
+		"  -j N        threads, each with a chunk of every member in flight (%d)\n"
+		"  -c KIB      chunk size, a multiple of %zu KiB (%zu)\n"
+		"  -v          list the first %d bad sectors\n",
+		prog, opts.threads, OFF_CHUNK_UNIT * KERNEL_SECTOR_SIZE / 1024,
+		opts.chunk_sectors * KERNEL_SECTOR_SIZE / 1024,
+		FSCK_MAX_REPORT);
+	exit(8);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t bad[SSR_NR_DISKS] = { 0 }, diverged = 0, lost = 0;
+	uint64_t repaired = 0, events, start;
+	struct off_pool pool = { 0 };
+	struct fsck_ctx *ctxs;
+	double secs;
+	int c, i, t, err;
+
+	while ((c = getopt(argc, argv, "rj:c:v")) != -1) {
+		switch (c) {
+		case 'r':
+			opts.repair = true;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'c':
+			opts.chunk_sectors = strtoul(optarg, NULL, 0) * 1024 /
+					     KERNEL_SECTOR_SIZE;
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nr_members = argc - optind;
+	if (nr_members < 1 || nr_members > SSR_NR_DISKS || opts.threads < 1 ||
+	    opts.chunk_sectors == 0 || opts.chunk_sectors % OFF_CHUNK_UNIT != 0)
+		usage(argv[0]);
+
+	off_crc_init();
+	for (i = 0; i < nr_members; ++i) {
+		members[i].path = argv[optind + i];
+		if (off_member_open(&members[i],
+				    opts.repair ? O_RDWR : O_RDONLY) != 0)
+			return 8;
+	}
+
+	events = fsck_superblocks();
+
+	ctxs = calloc(opts.threads, sizeof(*ctxs));
+	if (ctxs == NULL)
+		return 8;
+	for (t = 0; t < opts.threads; ++t) {
+		for (i = 0; i < nr_members; ++i) {
+			ctxs[t].data[i] = off_alloc(opts.chunk_sectors *
+						    KERNEL_SECTOR_SIZE);
+			ctxs[t].crcs[i] = off_alloc(opts.chunk_sectors *
+						    sizeof(uint32_t));
+		}
+	}
+
+	pool.chunk_sectors = opts.chunk_sectors;
+	pool.nr_threads = opts.threads;
+	pool.fn = fsck_chunk;
+	pool.ctxs = ctxs;
+	pool.ctx_size = sizeof(*ctxs);
+
+	start = off_now_ns();
+	err = off_pool_run(&pool);
+	secs = (off_now_ns() - start) / 1e9;
+
+	for (t = 0; t < opts.threads; ++t) {
+		for (i = 0; i < nr_members; ++i) {
+			bad[i] += ctxs[t].bad[i];
+			free(ctxs[t].data[i]);
+			free(ctxs[t].crcs[i]);
+		}
+		diverged += ctxs[t].diverged;
+		lost += ctxs[t].lost;
+		repaired += ctxs[t].repaired;
+	}
+	free(ctxs);
+
+	if (err != 0) {
+		fprintf(stderr, "check stopped: %s\n", strerror(-err));
+		return 8;
+	}
+
+	printf("%llu sectors checked on %d members in %.2f s, %.0f MiB/s\n",
+	       (unsigned long long)LOGICAL_DISK_SECTORS, nr_members, secs,
+	       (double)LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE * nr_members /
+	       secs / (1 << 20));
+	for (i = 0; i < nr_members; ++i)
+		printf("%s: %llu sectors with a bad CRC\n", members[i].path,
+		       (unsigned long long)bad[i]);
+	printf("%llu sectors diverged, %llu with no good copy, %llu repaired\n",
+	       (unsigned long long)diverged, (unsigned long long)lost,
+	       (unsigned long long)repaired);
+
+	if (lost != 0)
+		return 4;
+	if (!opts.repair) {
+		for (i = 0; i < nr_members; ++i)
+			if (bad[i] != 0)
+				return 4;
+		return diverged != 0 ? 4 : 0;
+	}
+
+	if (nr_members != SSR_NR_DISKS) {
+		printf("superblocks left as they are, %d of %d members checked\n",
+		       nr_members, SSR_NR_DISKS);
+		return repaired != 0 ? 1 : 0;
+	}
+
+	/* The members agree: the module needs no resync when assembled */
+	for (i = 0; i < nr_members; ++i)
+		if (fsync(members[i].fd) != 0 ||
+		    off_sb_write(&members[i], SSR_SB_CLEAN, events + 1) != 0)
+			return 8;
+
+	return repaired != 0 ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - offline initialization of new members
+ *
+ * Writes the data area with a byte pattern, the matching CRC region and a
+ * clean superblock to every member, so the array assembles with no resync
+ * and every sector reads back. Chunks of the device go to all members at
+ * once from a pool of threads, in large sequential O_DIRECT writes.
+ *
+ * With -a (assume clean), the members are taken to already hold the same
+ * data, e.g. new disks that read back zeroes: the data of the first member
+ * is read to compute the CRCs and only the CRC region and the superblocks
+ * are written.
+ */
+
+#include "offline.h"
+
+#include <getopt.h>
+
+static struct {
+	bool assume_clean;
+	bool force;
+	int pattern;
+	int threads;
+	size_t chunk_sectors;
+} opts = {
+	.threads = 16,
+	.chunk_sectors = 16 * OFF_CHUNK_SECTORS,
+};
+
+static struct off_member members[SSR_NR_DISKS];
+
+struct init_ctx {
+	uint8_t *data;
+	uint32_t *crcs;
+};
+
+static int init_chunk(void *arg, uint64_t first, size_t nr_sectors)
+{
+	struct init_ctx *c = arg;
+	size_t s;
+	int i;
+
+	if (opts.assume_clean) {
+		if (off_pread(&members[0], c->data,
+			      nr_sectors * KERNEL_SECTOR_SIZE,
+			      off_data_offset(first)) != 0)
+			return -EIO;
+		for (s = 0; s < nr_sectors; ++s)
+			c->crcs[s] = htole32(off_crc32(CRC_SEED,
+						       c->data + s * KERNEL_SECTOR_SIZE,
+						       KERNEL_SECTOR_SIZE));
+	}
+
+	/* Otherwise the buffers were filled once, every sector is the same */
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (!opts.assume_clean &&
+		    off_pwrite(&members[i], c->data,
+			       nr_sectors * KERNEL_SECTOR_SIZE,
+			       off_data_offset(first)) != 0)
+			return -EIO;
+		if (off_pwrite(&members[i], c->crcs,
+			       nr_sectors * sizeof(uint32_t),
+			       off_crc_offset(first)) != 0)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/* Refuse to overwrite the members of an array, unless forced */
+static bool init_in_use(void)
+{
+	struct ssr_superblock sb;
+	bool in_use = false;
+	int i;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (off_sb_read(&members[i], &sb) == 0 && off_sb_valid(&sb)) {
+			fprintf(stderr, "%s: holds an ssr superblock\n",
+				members[i].path);
+			in_use = true;
+		}
+	}
+
+	return in_use;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] MEMBER...   (%d members)\n"
+		"  -a          assume the members hold the same data, write the CRCs only\n"
+		"  -p BYTE     data pattern, without -a (%d)\n"
+		"  -f          overwrite members that hold a superblock\n"
+		"  -j N        threads, each with a chunk of every member in flight (%d)\n"
+		"  -c KIB      chunk size, a multiple of %zu KiB (%zu)\n",
+		prog, SSR_NR_DISKS, opts.pattern, opts.threads,
+		OFF_CHUNK_UNIT * KERNEL_SECTOR_SIZE / 1024,
+		opts.chunk_sectors * KERNEL_SECTOR_SIZE / 1024);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct off_pool pool = { 0 };
+	struct init_ctx *ctxs;
+	uint64_t start, bytes;
+	uint32_t crc;
+	double secs;
+	size_t s;
+	int c, i, t, err;
+
+	while ((c = getopt(argc, argv, "ap:fj:c:")) != -1) {
+		switch (c) {
+		case 'a':
+			opts.assume_clean = true;
+			break;
+		case 'p':
+			opts.pattern = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			opts.force = true;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'c':
+			opts.chunk_sectors = strtoul(optarg, NULL, 0) * 1024 /
+					     KERNEL_SECTOR_SIZE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != SSR_NR_DISKS || opts.threads < 1 ||
+	    opts.pattern < 0 || opts.pattern > 0xff ||
+	    opts.chunk_sectors == 0 || opts.chunk_sectors % OFF_CHUNK_UNIT != 0)
+		usage(argv[0]);
+
+	off_crc_init();
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		members[i].path = argv[optind + i];
+		if (off_member_open(&members[i], O_RDWR) != 0)
+			return 1;
+	}
+	if (!opts.force && init_in_use()) {
+		fprintf(stderr, "not initializing, -f to do it anyway\n");
+		return 1;
+	}
+
+	ctxs = calloc(opts.threads, sizeof(*ctxs));
+	if (ctxs == NULL)
+		return 1;
+	for (t = 0; t < opts.threads; ++t) {
+		ctxs[t].data = off_alloc(opts.chunk_sectors * KERNEL_SECTOR_SIZE);
+		ctxs[t].crcs = off_alloc(opts.chunk_sectors * sizeof(uint32_t));
+		if (opts.assume_clean)
+			continue;
+
+		memset(ctxs[t].data, opts.pattern,
+		       opts.chunk_sectors * KERNEL_SECTOR_SIZE);
+		crc = htole32(off_crc32(CRC_SEED, ctxs[t].data,
+					KERNEL_SECTOR_SIZE));
+		for (s = 0; s < opts.chunk_sectors; ++s)
+			ctxs[t].crcs[s] = crc;
+	}
+
+	pool.chunk_sectors = opts.chunk_sectors;
+	pool.nr_threads = opts.threads;
+	pool.fn = init_chunk;
+	pool.ctxs = ctxs;
+	pool.ctx_size = sizeof(*ctxs);
+
+	start = off_now_ns();
+	err = off_pool_run(&pool);
+	for (i = 0; i < SSR_NR_DISKS && err == 0; ++i)
+		if (fsync(members[i].fd) != 0)
+			err = -errno;
+	secs = (off_now_ns() - start) / 1e9;
+
+	for (t = 0; t < opts.threads; ++t) {
+		free(ctxs[t].data);
+		free(ctxs[t].crcs);
+	}
+	free(ctxs);
+
+	if (err != 0) {
+		fprintf(stderr, "initialization stopped: %s\n", strerror(-err));
+		return 1;
+	}
+
+	/* Last, once the data and CRCs are on stable storage */
+	for (i = 0; i < SSR_NR_DISKS; ++i)
+		if (off_sb_write(&members[i], SSR_SB_CLEAN, 1) != 0)
+			return 1;
+
+	bytes = (uint64_t)LOGICAL_DISK_SECTORS *
+		((opts.assume_clean ? 0 : KERNEL_SECTOR_SIZE) + sizeof(uint32_t));
+	printf("%d members initialized in %.2f s, %.0f MiB/s written per member\n",
+	       SSR_NR_DISKS, secs, bytes / secs / (1 << 20));
+
+	return 0;
+}
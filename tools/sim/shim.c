@@ -0,0 +1,939 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - userspace runtime of the kernel shim
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shim.h"
+
+int sim_nr_cpus = 1;
+__thread int sim_cpu;
+
+struct gendisk *sim_disk;
+
+/*
+ * Completions and wait queues
+ */
+void init_completion(struct completion *x)
+{
+	pthread_mutex_init(&x->lock, NULL);
+	pthread_cond_init(&x->cond, NULL);
+	x->done = 0;
+}
+
+void complete(struct completion *x)
+{
+	pthread_mutex_lock(&x->lock);
+	++x->done;
+	pthread_cond_signal(&x->cond);
+	pthread_mutex_unlock(&x->lock);
+}
+
+/* As in the kernel, done stays at UINT_MAX and every waiter passes */
+void complete_all(struct completion *x)
+{
+	pthread_mutex_lock(&x->lock);
+	x->done = UINT_MAX;
+	pthread_cond_broadcast(&x->cond);
+	pthread_mutex_unlock(&x->lock);
+}
+
+void wait_for_completion(struct completion *x)
+{
+	pthread_mutex_lock(&x->lock);
+	while (x->done == 0)
+		pthread_cond_wait(&x->cond, &x->lock);
+	if (x->done != UINT_MAX)
+		--x->done;
+	pthread_mutex_unlock(&x->lock);
+}
+
+bool completion_done(struct completion *x)
+{
+	bool done;
+
+	pthread_mutex_lock(&x->lock);
+	done = x->done != 0;
+	pthread_mutex_unlock(&x->lock);
+
+	return done;
+}
+
+void sim_wait_timeout(wait_queue_head_t *wq)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += NSEC_PER_MSEC;
+	if (ts.tv_nsec >= (long)NSEC_PER_SEC) {
+		ts.tv_nsec -= NSEC_PER_SEC;
+		++ts.tv_sec;
+	}
+	pthread_cond_timedwait(&wq->cond, &wq->lock, &ts);
+}
+
+void wake_up(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * Time
+ */
+u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void fsleep(unsigned long usecs)
+{
+	usleep(usecs);
+}
+
+/*
+ * CRC32, the little endian variant with the reflected 0xedb88320 polynomial
+ * and no inversion, like crc32_le() of the kernel.
+ */
+static u32 crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	u32 c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (k = 0; k < 8; ++k)
+			c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
+		crc32_table[i] = c;
+	}
+}
+
+u32 crc32_le(u32 crc, const void *p, size_t len)
+{
+	const u8 *b = p;
+
+	pthread_once(&crc32_once, crc32_init);
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ *b++) & 0xff];
+	return crc;
+}
+
+/*
+ * Pseudo random numbers, splitmix64
+ */
+void prandom_seed_state(struct rnd_state *state, u64 seed)
+{
+	state->s = seed;
+}
+
+u32 prandom_u32_state(struct rnd_state *state)
+{
+	u64 z = (state->s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (u32)((z ^ (z >> 31)) >> 32);
+}
+
+/*
+ * Memory
+ */
+struct page *alloc_page(gfp_t gfp)
+{
+	struct page *page = malloc(sizeof(*page));
+
+	if (page == NULL)
+		return NULL;
+	if (posix_memalign(&page->addr, PAGE_SIZE, PAGE_SIZE) != 0) {
+		free(page);
+		return NULL;
+	}
+	return page;
+}
+
+void __free_page(struct page *page)
+{
+	free(page->addr);
+	free(page);
+}
+
+mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size)
+{
+	mempool_t *pool = malloc(sizeof(*pool));
+
+	if (pool != NULL)
+		pool->size = size;
+	return pool;
+}
+
+void *mempool_alloc(mempool_t *pool, gfp_t gfp)
+{
+	return malloc(pool->size);
+}
+
+void mempool_free(void *element, mempool_t *pool)
+{
+	free(element);
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+	free(pool);
+}
+
+/*
+ * Workqueues. A bound workqueue has one thread per CPU, each serving the
+ * work queued on its CPU; an unbound one has max_active threads sharing a
+ * single list. Like in the kernel a work is queued at most once until it
+ * starts running.
+ */
+struct sim_worker {
+	pthread_t thread;
+	struct workqueue_struct *wq;
+	int index;
+};
+
+struct sim_wq_list {
+	struct work_struct *head, *tail;
+};
+
+struct workqueue_struct {
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t idle;
+	bool unbound;
+	bool stop;
+	/* Queued and running works */
+	unsigned int busy;
+	int nr_workers;
+	struct sim_worker *workers;
+	struct sim_wq_list *lists;
+};
+
+static void *sim_worker_fn(void *arg)
+{
+	struct sim_worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
+	struct sim_wq_list *list;
+	struct work_struct *work;
+
+	sim_cpu = worker->index % sim_nr_cpus;
+	list = &wq->lists[wq->unbound ? 0 : worker->index];
+
+	pthread_mutex_lock(&wq->lock);
+	for (;;) {
+		while (list->head == NULL && !wq->stop)
+			pthread_cond_wait(&wq->more, &wq->lock);
+		if (list->head == NULL)
+			break;
+
+		work = list->head;
+		list->head = work->next;
+		if (list->head == NULL)
+			list->tail = NULL;
+		work->pending = false;
+		pthread_mutex_unlock(&wq->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->lock);
+		if (--wq->busy == 0)
+			pthread_cond_broadcast(&wq->idle);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...)
+{
+	struct workqueue_struct *wq = calloc(1, sizeof(*wq));
+	int i;
+
+	if (wq == NULL)
+		return NULL;
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->more, NULL);
+	pthread_cond_init(&wq->idle, NULL);
+	wq->unbound = flags & WQ_UNBOUND;
+	wq->nr_workers = sim_nr_cpus;
+	if (wq->unbound && max_active > 0)
+		wq->nr_workers = max_active;
+
+	wq->workers = calloc(wq->nr_workers, sizeof(*wq->workers));
+	wq->lists = calloc(wq->nr_workers, sizeof(*wq->lists));
+	if (wq->workers == NULL || wq->lists == NULL)
+		goto out_free;
+
+	for (i = 0; i < wq->nr_workers; ++i) {
+		wq->workers[i].wq = wq;
+		wq->workers[i].index = i;
+		if (pthread_create(&wq->workers[i].thread, NULL, sim_worker_fn,
+				   &wq->workers[i]) != 0)
+			goto out_stop;
+	}
+
+	return wq;
+
+out_stop:
+	wq->nr_workers = i;
+	destroy_workqueue(wq);
+	return NULL;
+
+out_free:
+	free(wq->workers);
+	free(wq->lists);
+	free(wq);
+	return NULL;
+}
+
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		   struct work_struct *work)
+{
+	struct sim_wq_list *list;
+	bool queued = false;
+
+	pthread_mutex_lock(&wq->lock);
+	if (!work->pending) {
+		list = &wq->lists[wq->unbound ? 0 : cpu % wq->nr_workers];
+		work->pending = true;
+		work->next = NULL;
+		if (list->tail != NULL)
+			list->tail->next = work;
+		else
+			list->head = work;
+		list->tail = work;
+		++wq->busy;
+		queued = true;
+		pthread_cond_broadcast(&wq->more);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return queued;
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	while (wq->busy != 0)
+		pthread_cond_wait(&wq->idle, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	flush_workqueue(wq);
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->more);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_workers; ++i)
+		pthread_join(wq->workers[i].thread, NULL);
+
+	free(wq->workers);
+	free(wq->lists);
+	free(wq);
+}
+
+/*
+ * Module parameters, debugfs and sysfs. Parameters and debugfs files are
+ * kept in registries so the benchmark can set them and dump the counters.
+ */
+struct sim_param {
+	const char *name;
+	enum sim_param_type type;
+	void *ptr;
+	size_t nr;
+	struct sim_param *next;
+};
+
+static struct sim_param *sim_params;
+
+void sim_param_add(const char *name, enum sim_param_type type, void *ptr,
+		   size_t nr)
+{
+	struct sim_param *param = malloc(sizeof(*param));
+
+	if (param == NULL)
+		abort();
+	*param = (struct sim_param) {
+		.name = name,
+		.type = type,
+		.ptr = ptr,
+		.nr = nr,
+		.next = sim_params,
+	};
+	sim_params = param;
+}
+
+/* Values of arrays are separated by commas */
+int sim_param_set(const char *name, const char *value)
+{
+	struct sim_param *param;
+	const char *p = value;
+	char *end;
+	size_t i;
+
+	for (param = sim_params; param != NULL; param = param->next)
+		if (strcmp(param->name, name) == 0)
+			break;
+	if (param == NULL)
+		return -ENOENT;
+
+	for (i = 0; i < param->nr; ++i) {
+		unsigned long v = strtoul(p, &end, 0);
+
+		if (param->type == SIM_PARAM_CHARP) {
+			end = strchrnul(p, ',');
+			((char **)param->ptr)[i] = strndup(p, end - p);
+		} else if (end == p) {
+			return -EINVAL;
+		} else if (param->type == SIM_PARAM_BOOL) {
+			((bool *)param->ptr)[i] = v != 0;
+		} else {
+			((unsigned int *)param->ptr)[i] = v;
+		}
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+
+	return 0;
+}
+
+enum sim_debugfs_type {
+	SIM_DEBUGFS_DIR,
+	SIM_DEBUGFS_BOOL,
+	SIM_DEBUGFS_U32,
+	SIM_DEBUGFS_U64,
+	SIM_DEBUGFS_FILE,
+};
+
+struct dentry {
+	char path[128];
+	enum sim_debugfs_type type;
+	void *ptr;
+	const struct file_operations *fops;
+	struct dentry *next;
+};
+
+static struct dentry *sim_dentries;
+static pthread_mutex_t sim_dentries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dentry *sim_debugfs_add(const char *name, struct dentry *parent,
+				      enum sim_debugfs_type type, void *ptr,
+				      const struct file_operations *fops)
+{
+	struct dentry *dentry = calloc(1, sizeof(*dentry));
+
+	if (dentry == NULL)
+		return NULL;
+
+	if (parent != NULL) {
+		strcpy(dentry->path, parent->path);
+		strcat(dentry->path, "/");
+	}
+	strncat(dentry->path, name,
+		sizeof(dentry->path) - strlen(dentry->path) - 1);
+	dentry->type = type;
+	dentry->ptr = ptr;
+	dentry->fops = fops;
+
+	pthread_mutex_lock(&sim_dentries_lock);
+	dentry->next = sim_dentries;
+	sim_dentries = dentry;
+	pthread_mutex_unlock(&sim_dentries_lock);
+
+	return dentry;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return sim_debugfs_add(name, parent, SIM_DEBUGFS_DIR, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	return sim_debugfs_add(name, parent, SIM_DEBUGFS_FILE, data, fops);
+}
+
+void debugfs_create_bool(const char *name, umode_t mode,
+			 struct dentry *parent, bool *value)
+{
+	sim_debugfs_add(name, parent, SIM_DEBUGFS_BOOL, value, NULL);
+}
+
+void debugfs_create_u32(const char *name, umode_t mode,
+			struct dentry *parent, u32 *value)
+{
+	sim_debugfs_add(name, parent, SIM_DEBUGFS_U32, value, NULL);
+}
+
+void debugfs_create_u64(const char *name, umode_t mode,
+			struct dentry *parent, u64 *value)
+{
+	sim_debugfs_add(name, parent, SIM_DEBUGFS_U64, value, NULL);
+}
+
+/* Only the whole tree is ever removed */
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	struct dentry *next;
+
+	pthread_mutex_lock(&sim_dentries_lock);
+	for (; sim_dentries != NULL; sim_dentries = next) {
+		next = sim_dentries->next;
+		free(sim_dentries);
+	}
+	pthread_mutex_unlock(&sim_dentries_lock);
+}
+
+/* Files are only ever removed with the whole tree */
+void debugfs_remove(struct dentry *dentry)
+{
+}
+
+const struct file_operations relay_file_operations;
+const char *sim_relay_dir;
+
+struct rchan {
+	FILE *file;
+	pthread_mutex_t lock;
+};
+
+struct rchan *relay_open(const char *base_filename, struct dentry *parent,
+			 size_t subbuf_size, size_t n_subbufs,
+			 struct rchan_callbacks *cb, void *private_data)
+{
+	char path[PATH_MAX];
+	struct rchan *chan;
+
+	if (sim_relay_dir == NULL)
+		return NULL;
+
+	chan = calloc(1, sizeof(*chan));
+	if (chan == NULL)
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s0", sim_relay_dir, base_filename);
+	chan->file = fopen(path, "w");
+	if (chan->file == NULL) {
+		free(chan);
+		return NULL;
+	}
+	pthread_mutex_init(&chan->lock, NULL);
+
+	return chan;
+}
+
+void relay_write(struct rchan *chan, const void *data, size_t length)
+{
+	pthread_mutex_lock(&chan->lock);
+	fwrite(data, length, 1, chan->file);
+	pthread_mutex_unlock(&chan->lock);
+}
+
+void relay_flush(struct rchan *chan)
+{
+	pthread_mutex_lock(&chan->lock);
+	fflush(chan->file);
+	pthread_mutex_unlock(&chan->lock);
+}
+
+void relay_close(struct rchan *chan)
+{
+	fclose(chan->file);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+}
+
+/* The path is relative to the debugfs root, e.g. "ssr/fault/enable" */
+int sim_debugfs_set(const char *path, const char *value)
+{
+	struct dentry *d;
+	u64 v = strtoull(value, NULL, 0);
+	int err = -ENOENT;
+
+	pthread_mutex_lock(&sim_dentries_lock);
+	for (d = sim_dentries; d != NULL; d = d->next) {
+		if (strcmp(d->path, path) != 0)
+			continue;
+
+		err = 0;
+		switch (d->type) {
+		case SIM_DEBUGFS_BOOL:
+			WRITE_ONCE(*(bool *)d->ptr, v != 0);
+			break;
+		case SIM_DEBUGFS_U32:
+			WRITE_ONCE(*(u32 *)d->ptr, v);
+			break;
+		case SIM_DEBUGFS_U64:
+			WRITE_ONCE(*(u64 *)d->ptr, v);
+			break;
+		case SIM_DEBUGFS_FILE:
+			err = d->fops->sim_set ? d->fops->sim_set(d->ptr, v) :
+						 -EPERM;
+			break;
+		default:
+			err = -EISDIR;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&sim_dentries_lock);
+
+	return err;
+}
+
+void sim_debugfs_dump(FILE *out)
+{
+	struct seq_file m = { .out = out };
+	struct dentry *d;
+	u64 v;
+
+	pthread_mutex_lock(&sim_dentries_lock);
+	for (d = sim_dentries; d != NULL; d = d->next) {
+		switch (d->type) {
+		case SIM_DEBUGFS_BOOL:
+			fprintf(out, "%s: %d\n", d->path, *(bool *)d->ptr);
+			break;
+		case SIM_DEBUGFS_U32:
+			fprintf(out, "%s: %u\n", d->path, *(u32 *)d->ptr);
+			break;
+		case SIM_DEBUGFS_U64:
+			fprintf(out, "%s: %llu\n", d->path,
+				(unsigned long long)*(u64 *)d->ptr);
+			break;
+		case SIM_DEBUGFS_FILE:
+			if (d->fops->sim_get != NULL &&
+			    d->fops->sim_get(d->ptr, &v) == 0)
+				fprintf(out, "%s: %llu\n", d->path,
+					(unsigned long long)v);
+			if (d->fops->sim_show != NULL) {
+				fprintf(out, "%s:\n", d->path);
+				d->fops->sim_show(&m, NULL);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim_dentries_lock);
+}
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(m->out, fmt, args);
+	va_end(args);
+}
+
+loff_t default_llseek(struct file *file, loff_t offset, int whence)
+{
+	return -EINVAL;
+}
+
+int kobject_uevent_env(struct kobject *kobj, int action, char *envp[])
+{
+	return 0;
+}
+
+int sysfs_emit(char *buf, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, PAGE_SIZE, fmt, args);
+	va_end(args);
+
+	return min_t(int, len, PAGE_SIZE - 1);
+}
+
+int sysfs_emit_at(char *buf, int at, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf + at, PAGE_SIZE - at, fmt, args);
+	va_end(args);
+
+	return min_t(int, len, PAGE_SIZE - at - 1);
+}
+
+static struct device_attribute *sim_sysfs_find(const char *name)
+{
+	const struct attribute_group **group;
+	struct attribute **attr;
+
+	if (sim_disk == NULL || sim_disk->groups == NULL)
+		return NULL;
+
+	for (group = sim_disk->groups; *group != NULL; ++group)
+		for (attr = (*group)->attrs; *attr != NULL; ++attr)
+			if (strcmp((*attr)->name, name) == 0)
+				return container_of(*attr,
+						    struct device_attribute,
+						    attr);
+	return NULL;
+}
+
+/* buf holds at least PAGE_SIZE bytes */
+ssize_t sim_sysfs_show(const char *name, char *buf)
+{
+	struct device_attribute *attr = sim_sysfs_find(name);
+
+	if (attr == NULL || attr->show == NULL)
+		return -ENOENT;
+	return attr->show(disk_to_dev(sim_disk), attr, buf);
+}
+
+ssize_t sim_sysfs_store(const char *name, const char *buf)
+{
+	struct device_attribute *attr = sim_sysfs_find(name);
+
+	if (attr == NULL || attr->store == NULL)
+		return -ENOENT;
+	return attr->store(disk_to_dev(sim_disk), attr, buf, strlen(buf));
+}
+
+int misc_register(struct miscdevice *misc)
+{
+	return 0;
+}
+
+void misc_deregister(struct miscdevice *misc)
+{
+}
+
+/*
+ * Block layer. Members are files, or memory files, read and written
+ * synchronously by the thread that submits the bio.
+ */
+#define SIM_MAX_MEMBERS 8
+
+static struct {
+	const char *path;
+	struct gendisk disk;
+	struct block_device bdev;
+} sim_members[SIM_MAX_MEMBERS];
+
+int sim_member_add(const char *path, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < SIM_MAX_MEMBERS; ++i) {
+		if (sim_members[i].path != NULL)
+			continue;
+
+		sim_members[i].path = path;
+		snprintf(sim_members[i].disk.disk_name, DISK_NAME_LEN, "%s",
+			 path);
+		sim_members[i].disk.sim_fd = fd;
+		sim_members[i].bdev.bd_disk = &sim_members[i].disk;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
+					void *holder)
+{
+	size_t i;
+
+	for (i = 0; i < SIM_MAX_MEMBERS; ++i)
+		if (sim_members[i].path != NULL &&
+		    strcmp(sim_members[i].path, path) == 0)
+			return &sim_members[i].bdev;
+
+	return ERR_PTR(-ENODEV);
+}
+
+void blkdev_put(struct block_device *bdev, fmode_t mode)
+{
+}
+
+int blkdev_issue_flush(struct block_device *bdev, gfp_t gfp)
+{
+	return fdatasync(bdev->bd_disk->sim_fd) == 0 ? 0 : -errno;
+}
+
+int blk_status_to_errno(blk_status_t status)
+{
+	switch (status) {
+	case BLK_STS_OK:
+		return 0;
+	case BLK_STS_NOTSUPP:
+		return -EOPNOTSUPP;
+	case BLK_STS_RESOURCE:
+		return -ENOMEM;
+	case BLK_STS_AGAIN:
+		return -EAGAIN;
+	default:
+		return -EIO;
+	}
+}
+
+struct bio *bio_alloc(gfp_t gfp, unsigned int nr_vecs)
+{
+	struct bio *bio = calloc(1, sizeof(*bio) +
+				    nr_vecs * sizeof(struct bio_vec));
+
+	if (bio == NULL)
+		return NULL;
+	bio->bi_io_vec = (struct bio_vec *)(bio + 1);
+	bio->bi_max_vecs = nr_vecs;
+	return bio;
+}
+
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len,
+		 unsigned int offset)
+{
+	if (bio->bi_vcnt == bio->bi_max_vecs)
+		return 0;
+
+	bio->bi_io_vec[bio->bi_vcnt++] = (struct bio_vec) {
+		.bv_page = page,
+		.bv_len = len,
+		.bv_offset = offset,
+	};
+	bio->bi_iter.bi_size += len;
+	return len;
+}
+
+void bio_put(struct bio *bio)
+{
+	free(bio);
+}
+
+void bio_endio(struct bio *bio)
+{
+	if (bio->bi_end_io != NULL)
+		bio->bi_end_io(bio);
+}
+
+static void sim_member_io(struct bio *bio)
+{
+	int fd = bio->bi_disk->sim_fd;
+	off_t pos = (off_t)bio->bi_iter.bi_sector * 512;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	ssize_t done;
+
+	if (bio_op(bio) == REQ_OP_FLUSH) {
+		if (fdatasync(fd) != 0)
+			bio->bi_status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	bio_for_each_segment(bv, bio, iter) {
+		void *buf = (char *)page_address(bv.bv_page) + bv.bv_offset;
+
+		if (op_is_write(bio_op(bio)))
+			done = pwrite(fd, buf, bv.bv_len, pos);
+		else
+			done = pread(fd, buf, bv.bv_len, pos);
+		if (done != (ssize_t)bv.bv_len) {
+			bio->bi_status = BLK_STS_IOERR;
+			break;
+		}
+		pos += bv.bv_len;
+	}
+
+out:
+	bio_endio(bio);
+}
+
+blk_qc_t submit_bio(struct bio *bio)
+{
+	if (bio->bi_disk->fops != NULL)
+		return bio->bi_disk->fops->submit_bio(bio);
+
+	sim_member_io(bio);
+	return BLK_QC_T_NONE;
+}
+
+static void submit_bio_wait_endio(struct bio *bio)
+{
+	complete(bio->bi_private);
+}
+
+int submit_bio_wait(struct bio *bio)
+{
+	struct completion done;
+
+	init_completion(&done);
+	bio->bi_private = &done;
+	bio->bi_end_io = submit_bio_wait_endio;
+	submit_bio(bio);
+	wait_for_completion(&done);
+
+	return blk_status_to_errno(bio->bi_status);
+}
+
+int register_blkdev(unsigned int major, const char *name)
+{
+	return 0;
+}
+
+void unregister_blkdev(unsigned int major, const char *name)
+{
+}
+
+struct request_queue *blk_alloc_queue(int node)
+{
+	return calloc(1, sizeof(struct request_queue));
+}
+
+void blk_cleanup_queue(struct request_queue *q)
+{
+	free(q);
+}
+
+struct gendisk *alloc_disk(int minors)
+{
+	struct gendisk *disk = calloc(1, sizeof(*disk));
+
+	if (disk != NULL)
+		disk->sim_fd = -1;
+	return disk;
+}
+
+void put_disk(struct gendisk *disk)
+{
+	free(disk);
+}
+
+void device_add_disk(struct device *parent, struct gendisk *disk,
+		     const struct attribute_group **groups)
+{
+	disk->groups = groups;
+	sim_disk = disk;
+}
+
+void del_gendisk(struct gendisk *disk)
+{
+	sim_disk = NULL;
+}
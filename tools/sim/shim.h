@@ -0,0 +1,876 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Simple Software Raid - userspace shim of the kernel APIs used by ssr.c
+ *
+ * Every <linux/...> header included by ssr.c resolves to this file when
+ * building the simulator, so the driver is compiled unchanged. Members are
+ * backed by files or memory, workqueues by threads and each submitting
+ * thread plays one CPU.
+ */
+
+#ifndef SSR_SIM_SHIM_H_
+#define SSR_SIM_SHIM_H_ 1
+
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int32_t s32;
+typedef long long s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef unsigned long long __u64;
+typedef uint32_t __le32;
+typedef unsigned long long __le64;
+typedef u64 sector_t;
+typedef unsigned int fmode_t;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+typedef u8 blk_status_t;
+typedef unsigned int blk_qc_t;
+
+/* Compiler */
+#define __user
+#define __init
+#define __exit
+#define __packed __attribute__((packed))
+#undef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+/* Helpers of linux/kernel.h */
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define round_down(x, y) ((x) & ~((__typeof__(x))((y) - 1)))
+#define round_up(x, y) ((((x) - 1) | ((__typeof__(x))((y) - 1))) + 1)
+#define min(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); \
+		     _a < _b ? _a : _b; })
+#define max(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); \
+		     _a > _b ? _a : _b; })
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+#define swap(a, b) do { __typeof__(a) _t = (a); (a) = (b); (b) = _t; } while (0)
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+
+#define cpu_to_le32(x) htole32(x)
+#define cpu_to_le64(x) htole64(x)
+#define le32_to_cpu(x) le32toh(x)
+#define le64_to_cpu(x) le64toh(x)
+
+static inline u64 div_u64(u64 a, u32 b)
+{
+	return a / b;
+}
+
+static inline u64 div64_u64(u64 a, u64 b)
+{
+	return a / b;
+}
+
+/* Errors */
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE(ptr);
+}
+
+/* printk */
+#define pr_fmt(fmt) "ssr: " fmt
+#define pr_err(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_alert(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+/* Messages are never dropped */
+#define pr_warn_ratelimited(fmt, ...) pr_warn(fmt, ##__VA_ARGS__)
+#define pr_info_ratelimited(fmt, ...) pr_info(fmt, ##__VA_ARGS__)
+#define pr_alert_once(fmt, ...) do {					\
+		static bool _printed;					\
+		if (!_printed) {					\
+			_printed = true;				\
+			pr_alert(fmt, ##__VA_ARGS__);			\
+		}							\
+	} while (0)
+
+/* Modules, parameters are registered so the simulator can set them */
+struct module;
+#define THIS_MODULE ((struct module *)NULL)
+#define MODULE_DESCRIPTION(x) extern int sim_module_info
+#define MODULE_AUTHOR(x) extern int sim_module_info
+#define MODULE_LICENSE(x) extern int sim_module_info
+#define MODULE_PARM_DESC(name, desc) extern int sim_module_info
+
+enum sim_param_type {
+	SIM_PARAM_BOOL,
+	SIM_PARAM_UINT,
+	SIM_PARAM_CHARP,
+};
+
+void sim_param_add(const char *name, enum sim_param_type type, void *ptr,
+		   size_t nr);
+
+#define sim_param_type_bool SIM_PARAM_BOOL
+#define sim_param_type_uint SIM_PARAM_UINT
+#define sim_param_type_charp SIM_PARAM_CHARP
+
+#define module_param_array_named(name, var, type, nump, perm)		\
+	static void __attribute__((constructor)) sim_param_##name(void)	\
+	{								\
+		sim_param_add(#name, sim_param_type_##type, (var),	\
+			      ARRAY_SIZE(var));				\
+	}								\
+	extern int sim_module_info
+#define module_param(name, type, perm)					\
+	static void __attribute__((constructor)) sim_param_##name(void)	\
+	{								\
+		sim_param_add(#name, sim_param_type_##type, &(name), 1); \
+	}								\
+	extern int sim_module_info
+
+#define module_init(fn)							\
+	int sim_module_init(void)					\
+	{								\
+		return fn();						\
+	}								\
+	extern int sim_module_info
+#define module_exit(fn)							\
+	void sim_module_exit(void)					\
+	{								\
+		fn();							\
+	}								\
+	extern int sim_module_info
+
+/* CPUs, each submitting thread and bound worker plays one */
+#define SIM_MAX_CPUS 64
+extern int sim_nr_cpus;
+extern __thread int sim_cpu;
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name[SIM_MAX_CPUS]
+#define per_cpu_ptr(ptr, cpu) (&(*(ptr))[cpu])
+#define get_cpu_ptr(ptr) per_cpu_ptr(ptr, sim_cpu)
+#define put_cpu_ptr(ptr) do { } while (0)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < sim_nr_cpus; ++(cpu))
+#define num_online_cpus() ((unsigned int)sim_nr_cpus)
+#define get_cpu() (sim_cpu)
+#define put_cpu() do { } while (0)
+#define raw_smp_processor_id() (sim_cpu)
+
+static inline void cond_resched(void)
+{
+}
+
+/* Locks */
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = { PTHREAD_MUTEX_INITIALIZER }
+#define DEFINE_MUTEX(x) struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define spin_lock_irqsave(l, flags) ((flags) = 0, spin_lock(l))
+#define spin_unlock_irqrestore(l, flags) ((void)(flags), spin_unlock(l))
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_lock_nested(l, subclass) ((void)(subclass), mutex_lock(l))
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+struct rw_semaphore {
+	pthread_rwlock_t l;
+};
+
+#define init_rwsem(s) pthread_rwlock_init(&(s)->l, NULL)
+#define down_read(s) pthread_rwlock_rdlock(&(s)->l)
+#define down_read_nested(s, subclass) ((void)(subclass), down_read(s))
+#define up_read(s) pthread_rwlock_unlock(&(s)->l)
+#define down_write(s) pthread_rwlock_wrlock(&(s)->l)
+#define down_write_nested(s, subclass) ((void)(subclass), down_write(s))
+#define up_write(s) pthread_rwlock_unlock(&(s)->l)
+
+/* Atomics */
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v) ((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v) ((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_return(v) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) (atomic_dec_return(v) == 0)
+
+/* Completions and wait queues */
+struct completion {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int done;
+};
+
+void init_completion(struct completion *x);
+void complete(struct completion *x);
+void complete_all(struct completion *x);
+void wait_for_completion(struct completion *x);
+bool completion_done(struct completion *x);
+#define reinit_completion(x) ((x)->done = 0)
+#define wait_for_completion_io(x) wait_for_completion(x)
+
+typedef struct wait_queue_head {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleepers;
+} wait_queue_head_t;
+
+#define DECLARE_WAIT_QUEUE_HEAD(name)					\
+	wait_queue_head_t name = { PTHREAD_MUTEX_INITIALIZER,		\
+				   PTHREAD_COND_INITIALIZER, 0 }
+
+void sim_wait_timeout(wait_queue_head_t *wq);
+void wake_up(wait_queue_head_t *wq);
+#define wq_has_sleeper(wq) (__atomic_load_n(&(wq)->sleepers, __ATOMIC_SEQ_CST) != 0)
+
+/*
+ * The condition is rechecked every millisecond, like a missed wake up would.
+ * Like in the kernel it is evaluated without the wait queue's lock held, as
+ * it may wake the queue up itself.
+ */
+#define wait_event(wq, condition) do {					\
+		if (condition)						\
+			break;						\
+		__atomic_add_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+		while (!(condition)) {					\
+			pthread_mutex_lock(&(wq).lock);			\
+			sim_wait_timeout(&(wq));			\
+			pthread_mutex_unlock(&(wq).lock);		\
+		}							\
+		__atomic_sub_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+	} while (0)
+
+/* Time */
+#define HZ 1000
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+#define USEC_PER_SEC 1000000ULL
+#define USEC_PER_MSEC 1000ULL
+
+u64 ktime_get_ns(void);
+#define jiffies ((unsigned long)(ktime_get_ns() / NSEC_PER_MSEC))
+#define msecs_to_jiffies(m) ((unsigned long)(m))
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b) time_after_eq(b, a)
+
+void fsleep(unsigned long usecs);
+#define msleep(ms) fsleep((ms) * 1000UL)
+
+/* The simulator runs as the administrator */
+#define CAP_SYS_ADMIN 21
+#define capable(cap) true
+
+/* Lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline bool list_empty(const struct list_head *head)
+{
+	return READ_ONCE(head->next) == head;
+}
+
+#define list_first_entry_or_null(head, type, member)			\
+	(list_empty(head) ? NULL : container_of((head)->next, type, member))
+
+/* Bitmaps */
+#define BITS_PER_LONG (sizeof(long) * CHAR_BIT)
+#define BITS_TO_LONGS(nr) DIV_ROUND_UP(nr, BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_LONG))
+
+static inline void __set_bit(unsigned long nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(unsigned long nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline bool test_bit(unsigned long nr, const unsigned long *addr)
+{
+	return addr[BIT_WORD(nr)] & BIT_MASK(nr);
+}
+
+static inline void bitmap_zero(unsigned long *dst, unsigned int nbits)
+{
+	memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline void bitmap_set(unsigned long *map, unsigned int start,
+			      unsigned int len)
+{
+	while (len--)
+		__set_bit(start++, map);
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned int start,
+				unsigned int len)
+{
+	while (len--)
+		__clear_bit(start++, map);
+}
+
+static inline unsigned int bitmap_weight(const unsigned long *src,
+					 unsigned int nbits)
+{
+	unsigned int i, w = 0;
+
+	for (i = 0; i < nbits; ++i)
+		w += test_bit(i, src);
+	return w;
+}
+
+static inline bool bitmap_empty(const unsigned long *src, unsigned int nbits)
+{
+	return bitmap_weight(src, nbits) == 0;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr,
+					  unsigned long size,
+					  unsigned long offset)
+{
+	while (offset < size && !test_bit(offset, addr))
+		++offset;
+	return offset;
+}
+
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_next_bit((addr), (size), 0);			\
+	     (bit) < (size);						\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+/* CRCs, the little endian CRC32 of lib/crc32.c */
+u32 crc32_le(u32 crc, const void *p, size_t len);
+#define crc32(seed, data, length) crc32_le(seed, (const void *)(data), length)
+
+/* Pseudo random numbers */
+struct rnd_state {
+	u64 s;
+};
+
+void prandom_seed_state(struct rnd_state *state, u64 seed);
+u32 prandom_u32_state(struct rnd_state *state);
+
+/* Memory */
+#define PAGE_SIZE 4096UL
+#define GFP_KERNEL 0x1u
+#define GFP_NOIO 0x2u
+#define GFP_NOWAIT 0x4u
+#define GFP_ATOMIC 0x8u
+
+struct page {
+	void *addr;
+};
+
+struct page *alloc_page(gfp_t gfp);
+void __free_page(struct page *page);
+#define page_address(page) ((page)->addr)
+#define kmap_atomic(page) page_address(page)
+#define kunmap_atomic(addr) ((void)(addr))
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kvcalloc(n, size, gfp) calloc(n, size)
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define vfree(p) free(p)
+
+static inline void *memchr_inv(const void *start, int c, size_t bytes)
+{
+	const u8 *p = start;
+
+	for (; bytes != 0; ++p, --bytes)
+		if (*p != (u8)c)
+			return (void *)p;
+
+	return NULL;
+}
+
+typedef struct mempool_s {
+	size_t size;
+} mempool_t;
+
+mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size);
+void *mempool_alloc(mempool_t *pool, gfp_t gfp);
+void mempool_free(void *element, mempool_t *pool);
+void mempool_destroy(mempool_t *pool);
+
+/* Workqueues, served by threads bound to a simulated CPU unless unbound */
+#define WQ_UNBOUND (1u << 1)
+#define WQ_HIGHPRI (1u << 4)
+#define WQ_MEM_RECLAIM (1u << 3)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+	work_func_t func;
+	bool pending;
+	struct work_struct *next;
+};
+
+struct workqueue_struct;
+
+#define INIT_WORK(w, f) do {						\
+		(w)->func = (f);					\
+		(w)->pending = false;					\
+		(w)->next = NULL;					\
+	} while (0)
+#define DECLARE_WORK(n, f) struct work_struct n = { .func = (f) }
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...);
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		   struct work_struct *work);
+#define queue_work(wq, work) queue_work_on(sim_cpu, wq, work)
+void flush_workqueue(struct workqueue_struct *wq);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+/* Files, sysfs and debugfs */
+struct inode;
+
+struct file {
+	void *private_data;
+	loff_t f_pos;
+};
+
+struct seq_file {
+	FILE *out;
+	void *private;
+};
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *inode, struct file *file);
+	ssize_t (*read)(struct file *file, char __user *buf, size_t count,
+			loff_t *pos);
+	ssize_t (*write)(struct file *file, const char __user *buf,
+			 size_t count, loff_t *pos);
+	loff_t (*llseek)(struct file *file, loff_t offset, int whence);
+	long (*unlocked_ioctl)(struct file *file, unsigned int cmd,
+			       unsigned long arg);
+	/* Simple attributes and seq_file shows */
+	int (*sim_get)(void *data, u64 *val);
+	int (*sim_set)(void *data, u64 val);
+	int (*sim_show)(struct seq_file *m, void *v);
+};
+
+loff_t default_llseek(struct file *file, loff_t offset, int whence);
+
+#define copy_to_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+#define seq_putc(m, c) fputc((c), (m)->out)
+#define seq_puts(m, s) fputs((s), (m)->out)
+
+#define DEFINE_SHOW_ATTRIBUTE(name)					\
+	static const struct file_operations name##_fops = {		\
+		.sim_show = name##_show,				\
+	}
+#define DEFINE_DEBUGFS_ATTRIBUTE(name, get, set, fmt)			\
+	static const struct file_operations name = {			\
+		.sim_get = (get),					\
+		.sim_set = (set),					\
+	}
+
+struct dentry;
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+#define debugfs_create_file_unsafe debugfs_create_file
+void debugfs_create_bool(const char *name, umode_t mode,
+			 struct dentry *parent, bool *value);
+void debugfs_create_u32(const char *name, umode_t mode,
+			struct dentry *parent, u32 *value);
+void debugfs_create_u64(const char *name, umode_t mode,
+			struct dentry *parent, u64 *value);
+void debugfs_remove_recursive(struct dentry *dentry);
+void debugfs_remove(struct dentry *dentry);
+
+/* Relay channels: the records of all CPUs go to one file, bios0 */
+struct rchan;
+struct rchan_buf;
+
+struct rchan_callbacks {
+	int (*subbuf_start)(struct rchan_buf *buf, void *subbuf,
+			    void *prev_subbuf, size_t prev_padding);
+	struct dentry *(*create_buf_file)(const char *filename,
+					  struct dentry *parent, umode_t mode,
+					  struct rchan_buf *buf, int *is_global);
+	int (*remove_buf_file)(struct dentry *dentry);
+};
+
+extern const struct file_operations relay_file_operations;
+
+/* Directory the relay files are written to, no channel can open if NULL */
+extern const char *sim_relay_dir;
+
+struct rchan *relay_open(const char *base_filename, struct dentry *parent,
+			 size_t subbuf_size, size_t n_subbufs,
+			 struct rchan_callbacks *cb, void *private_data);
+void relay_write(struct rchan *chan, const void *data, size_t length);
+void relay_flush(struct rchan *chan);
+void relay_close(struct rchan *chan);
+
+/* Writes go straight to the file, the buffers are never full */
+static inline bool relay_buf_full(struct rchan_buf *buf)
+{
+	return false;
+}
+
+struct kobject {
+	int unused;
+};
+
+#define KOBJ_CHANGE 2
+int kobject_uevent_env(struct kobject *kobj, int action, char *envp[]);
+
+struct device {
+	struct kobject kobj;
+};
+
+struct attribute {
+	const char *name;
+	umode_t mode;
+};
+
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+
+#define DEVICE_ATTR_RO(_name)						\
+	struct device_attribute dev_attr_##_name = {			\
+		.attr = { .name = #_name, .mode = 0444 },		\
+		.show = _name##_show,					\
+	}
+#define DEVICE_ATTR_RW(_name)						\
+	struct device_attribute dev_attr_##_name = {			\
+		.attr = { .name = #_name, .mode = 0644 },		\
+		.show = _name##_show,					\
+		.store = _name##_store,					\
+	}
+
+int sysfs_emit(char *buf, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int sysfs_emit_at(char *buf, int at, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#define MISC_DYNAMIC_MINOR 255
+
+struct miscdevice {
+	int minor;
+	const char *name;
+	const struct file_operations *fops;
+	umode_t mode;
+};
+
+int misc_register(struct miscdevice *misc);
+void misc_deregister(struct miscdevice *misc);
+
+/* Block layer */
+#define KERNEL_SECTOR_SHIFT 9
+#define DISK_NAME_LEN 32
+#define NUMA_NO_NODE (-1)
+#define BLK_QC_T_NONE -1U
+
+#define FMODE_READ 0x1u
+#define FMODE_WRITE 0x2u
+#define FMODE_EXCL 0x80u
+
+#define BLK_STS_OK 0
+#define BLK_STS_NOTSUPP 1
+#define BLK_STS_RESOURCE 9
+#define BLK_STS_IOERR 10
+#define BLK_STS_AGAIN 12
+
+#define REQ_OP_BITS 8
+#define REQ_OP_MASK ((1u << REQ_OP_BITS) - 1)
+#define REQ_OP_READ 0u
+#define REQ_OP_WRITE 1u
+#define REQ_OP_FLUSH 2u
+#define REQ_FAILFAST_DEV (1u << 8)
+#define REQ_FAILFAST_TRANSPORT (1u << 9)
+#define REQ_FAILFAST_DRIVER (1u << 10)
+#define REQ_SYNC (1u << 11)
+#define REQ_META (1u << 12)
+#define REQ_PRIO (1u << 13)
+#define REQ_NOMERGE (1u << 14)
+#define REQ_IDLE (1u << 15)
+#define REQ_INTEGRITY (1u << 16)
+#define REQ_FUA (1u << 17)
+#define REQ_PREFLUSH (1u << 18)
+#define REQ_RAHEAD (1u << 19)
+#define REQ_BACKGROUND (1u << 20)
+#define REQ_NOWAIT (1u << 21)
+#define REQ_FAILFAST_MASK \
+	(REQ_FAILFAST_DEV | REQ_FAILFAST_TRANSPORT | REQ_FAILFAST_DRIVER)
+
+#define READ 0
+#define WRITE 1
+
+#define QUEUE_FLAG_NOWAIT 29
+
+struct request_queue {
+	void *queuedata;
+	unsigned long queue_flags;
+	unsigned int logical_block_size;
+};
+
+struct blk_mq_tag_set {
+	void *tags;
+};
+
+struct block_device;
+struct gendisk;
+struct bio;
+
+struct block_device_operations {
+	blk_qc_t (*submit_bio)(struct bio *bio);
+	int (*open)(struct block_device *bdev, fmode_t mode);
+	void (*release)(struct gendisk *disk, fmode_t mode);
+	int (*ioctl)(struct block_device *bdev, fmode_t mode, unsigned int cmd,
+		     unsigned long arg);
+	struct module *owner;
+};
+
+struct gendisk {
+	int major;
+	int first_minor;
+	char disk_name[DISK_NAME_LEN];
+	const struct block_device_operations *fops;
+	struct request_queue *queue;
+	void *private_data;
+	sector_t capacity;
+	const struct attribute_group **groups;
+	struct device dev;
+	/* Backing file of a member */
+	int sim_fd;
+};
+
+struct block_device {
+	struct gendisk *bd_disk;
+};
+
+struct bio_vec {
+	struct page *bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bvec_iter {
+	sector_t bi_sector;
+	unsigned int bi_size;
+	unsigned int bi_idx;
+	unsigned int bi_bvec_done;
+};
+
+typedef void (bio_end_io_t)(struct bio *bio);
+
+struct bio {
+	struct gendisk *bi_disk;
+	unsigned int bi_opf;
+	blk_status_t bi_status;
+	struct bvec_iter bi_iter;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	unsigned short bi_vcnt;
+	unsigned short bi_max_vecs;
+	struct bio_vec *bi_io_vec;
+};
+
+struct blk_plug {
+	int unused;
+};
+
+#define bio_op(bio) ((bio)->bi_opf & REQ_OP_MASK)
+#define op_is_write(op) ((op) & 1)
+#define bio_data_dir(bio) (op_is_write(bio_op(bio)) ? WRITE : READ)
+#define bio_sectors(bio) ((bio)->bi_iter.bi_size >> KERNEL_SECTOR_SHIFT)
+
+static inline bool op_is_sync(unsigned int op)
+{
+	return (op & REQ_OP_MASK) == REQ_OP_READ ||
+	       (op & (REQ_SYNC | REQ_FUA | REQ_PREFLUSH));
+}
+
+/* Segments never span pages here: bios are built from single page vectors */
+static inline struct bio_vec sim_bvec_iter(const struct bio *bio,
+					   const struct bvec_iter *iter)
+{
+	struct bio_vec bv = bio->bi_io_vec[iter->bi_idx];
+
+	bv.bv_offset += iter->bi_bvec_done;
+	bv.bv_len = min(bv.bv_len - iter->bi_bvec_done, iter->bi_size);
+	return bv;
+}
+
+static inline void sim_bvec_advance(const struct bio *bio,
+				    struct bvec_iter *iter, unsigned int bytes)
+{
+	iter->bi_sector += bytes >> KERNEL_SECTOR_SHIFT;
+	iter->bi_size -= bytes;
+	iter->bi_bvec_done += bytes;
+	if (iter->bi_bvec_done == bio->bi_io_vec[iter->bi_idx].bv_len) {
+		iter->bi_bvec_done = 0;
+		++iter->bi_idx;
+	}
+}
+
+#define bio_for_each_segment(bvl, bio, iter)				\
+	for ((iter) = (bio)->bi_iter;					\
+	     (iter).bi_size && ((bvl) = sim_bvec_iter((bio), &(iter)), 1); \
+	     sim_bvec_advance((bio), &(iter), (bvl).bv_len))
+
+struct bio *bio_alloc(gfp_t gfp, unsigned int nr_vecs);
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len,
+		 unsigned int offset);
+void bio_put(struct bio *bio);
+void bio_endio(struct bio *bio);
+blk_qc_t submit_bio(struct bio *bio);
+int submit_bio_wait(struct bio *bio);
+int blk_status_to_errno(blk_status_t status);
+
+static inline void bio_io_error(struct bio *bio)
+{
+	bio->bi_status = BLK_STS_IOERR;
+	bio_endio(bio);
+}
+
+static inline void bio_wouldblock_error(struct bio *bio)
+{
+	bio->bi_status = BLK_STS_AGAIN;
+	bio_endio(bio);
+}
+
+#define blk_start_plug(plug) ((void)(plug))
+#define blk_finish_plug(plug) ((void)(plug))
+
+struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
+					void *holder);
+void blkdev_put(struct block_device *bdev, fmode_t mode);
+int blkdev_issue_flush(struct block_device *bdev, gfp_t gfp);
+
+int register_blkdev(unsigned int major, const char *name);
+void unregister_blkdev(unsigned int major, const char *name);
+struct request_queue *blk_alloc_queue(int node);
+void blk_cleanup_queue(struct request_queue *q);
+#define blk_queue_logical_block_size(q, size) ((q)->logical_block_size = (size))
+#define blk_queue_flag_set(flag, q) ((q)->queue_flags |= 1UL << (flag))
+#define blk_mq_free_tag_set(set) ((void)(set))
+struct gendisk *alloc_disk(int minors);
+void put_disk(struct gendisk *disk);
+void device_add_disk(struct device *parent, struct gendisk *disk,
+		     const struct attribute_group **groups);
+void del_gendisk(struct gendisk *disk);
+#define set_capacity(disk, size) ((disk)->capacity = (size))
+#define disk_to_dev(disk) (&(disk)->dev)
+
+/* Simulator interface, used by the benchmark */
+int sim_module_init(void);
+void sim_module_exit(void);
+
+/* Back the member opened as path with the file fd */
+int sim_member_add(const char *path, int fd);
+/* The disk added by the driver */
+extern struct gendisk *sim_disk;
+
+int sim_param_set(const char *name, const char *value);
+int sim_debugfs_set(const char *path, const char *value);
+void sim_debugfs_dump(FILE *out);
+ssize_t sim_sysfs_show(const char *name, char *buf);
+ssize_t sim_sysfs_store(const char *name, const char *buf);
+
+#endif /* SSR_SIM_SHIM_H_ */
@@ -0,0 +1,548 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - bio shape fuzzer
+ *
+ * Runs ssr.c, built against the shim, and submits bios of random shapes from
+ * several threads: sub-page segments at odd page offsets, many segments,
+ * the largest bios, I/O that crosses CRC sectors or touches the ends of the
+ * device, and sequential readers with writes landing in the readahead
+ * windows ahead of them. Every thread owns a slice of the device, with slice bounds that
+ * share CRC sectors and pages with the neighbours, and keeps the expected
+ * content of its slice: reads are checked against it as they complete, and
+ * at the end the data and CRCs on every member are checked against it
+ * directly.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "ssr.h"
+
+#define FUZZ_MAX_SEGS 256
+#define FUZZ_FILL_SECTORS 256
+/* Reads of a sequential stream, each one a write may land ahead of */
+#define FUZZ_STREAM_READS 64
+
+static const char * const member_names[] = {
+	PHYSICAL_DISK1_NAME,
+	PHYSICAL_DISK2_NAME,
+	PHYSICAL_DISK3_NAME,
+};
+
+static struct {
+	int threads;
+	int seconds;
+	u64 seed;
+	bool verbose;
+} opts = {
+	.threads = 4,
+	.seconds = 5,
+	.seed = 1,
+};
+
+/* Bio shapes, picked with equal odds */
+enum fuzz_shape {
+	FUZZ_SMALL,
+	FUZZ_MANY_SEGS,
+	FUZZ_MAX_SIZE,
+	FUZZ_CRC_EDGE,
+	FUZZ_SLICE_EDGE,
+	FUZZ_STREAM,
+	FUZZ_NR_SHAPES,
+};
+
+struct fuzz_thread {
+	pthread_t thread;
+	int cpu;
+	struct rnd_state rnd;
+	/* sectors [lo, hi) of the device */
+	sector_t lo, hi;
+	u64 bios[2];
+	u64 bytes;
+	u64 segs;
+	u64 errors;
+	/* readahead turned away by a congested array, not an error */
+	u64 aborted;
+	u64 bad_sectors;
+};
+
+/* What the array holds, each slice only ever touched by its thread */
+static u8 *expected;
+static int member_fds[SSR_NR_DISKS];
+static volatile bool fuzz_stop;
+
+static u32 rnd_below(struct rnd_state *rnd, u32 n)
+{
+	return prandom_u32_state(rnd) % n;
+}
+
+static void rnd_fill(struct rnd_state *rnd, void *buf, size_t len)
+{
+	u32 *w = buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*w); ++i)
+		w[i] = prandom_u32_state(rnd);
+}
+
+/* Build a bio of nr_segs sub-page segments covering nr_sectors */
+static struct bio *fuzz_bio(struct rnd_state *rnd, unsigned int op,
+			    sector_t sector, size_t nr_sectors,
+			    size_t nr_segs)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, nr_segs);
+	size_t left = nr_sectors, seg, off, len, after, lo, hi;
+	struct page *page;
+
+	if (bio == NULL)
+		abort();
+
+	bio->bi_disk = sim_disk;
+	bio->bi_opf = op;
+	bio->bi_iter.bi_sector = sector;
+
+	for (seg = 0; seg < nr_segs; ++seg) {
+		/* Leave the segments after this one between 1 and a page each */
+		after = nr_segs - seg - 1;
+		lo = left > after * SSR_SEG_MAX_SECTORS ?
+		     left - after * SSR_SEG_MAX_SECTORS : 1;
+		hi = min_t(size_t, left - after, SSR_SEG_MAX_SECTORS);
+		len = lo + rnd_below(rnd, hi - lo + 1);
+		off = rnd_below(rnd, SSR_SEG_MAX_SECTORS - len + 1);
+
+		page = alloc_page(GFP_NOIO);
+		if (page == NULL)
+			abort();
+		bio_add_page(bio, page, len * KERNEL_SECTOR_SIZE,
+			     off * KERNEL_SECTOR_SIZE);
+		left -= len;
+	}
+
+	return bio;
+}
+
+static void fuzz_bio_free(struct bio *bio)
+{
+	unsigned short i;
+
+	for (i = 0; i < bio->bi_vcnt; ++i)
+		__free_page(bio->bi_io_vec[i].bv_page);
+	bio_put(bio);
+}
+
+/* Copy between the bio pages and the expected content */
+static void fuzz_bio_copy(struct bio *bio, u8 *buf, bool to_bio)
+{
+	unsigned short i;
+	struct bio_vec *bv;
+	u8 *data;
+
+	for (i = 0; i < bio->bi_vcnt; ++i) {
+		bv = &bio->bi_io_vec[i];
+		data = (u8 *)page_address(bv->bv_page) + bv->bv_offset;
+		if (to_bio)
+			memcpy(data, buf, bv->bv_len);
+		else
+			memcpy(buf, data, bv->bv_len);
+		buf += bv->bv_len;
+	}
+}
+
+static u64 fuzz_bio_check(struct bio *bio, sector_t sector)
+{
+	const u8 *want = expected + sector * KERNEL_SECTOR_SIZE;
+	unsigned short i;
+	struct bio_vec *bv;
+	const u8 *data;
+	u64 bad = 0;
+	size_t s;
+
+	for (i = 0; i < bio->bi_vcnt; ++i) {
+		bv = &bio->bi_io_vec[i];
+		data = (u8 *)page_address(bv->bv_page) + bv->bv_offset;
+		for (s = 0; s < bv->bv_len; s += KERNEL_SECTOR_SIZE) {
+			if (memcmp(data + s, want, KERNEL_SECTOR_SIZE) != 0) {
+				if (opts.verbose)
+					printf("bad data at sector %llu\n",
+					       (unsigned long long)((want - expected) /
+								    KERNEL_SECTOR_SIZE));
+				++bad;
+			}
+			want += KERNEL_SECTOR_SIZE;
+		}
+	}
+
+	return bad;
+}
+
+/* Pick the start, length and number of segments of a bio of the slice */
+static void fuzz_shape(struct fuzz_thread *t, enum fuzz_shape shape,
+		       sector_t *sector, size_t *nr_sectors, size_t *nr_segs)
+{
+	sector_t size = t->hi - t->lo, crc_edge;
+	size_t max_sectors = FUZZ_MAX_SEGS * SSR_SEG_MAX_SECTORS;
+
+	*nr_segs = 1;
+	switch (shape) {
+	case FUZZ_SMALL:
+		*nr_sectors = 1 + rnd_below(&t->rnd, 2 * SSR_SEG_MAX_SECTORS);
+		*nr_segs = 1 + rnd_below(&t->rnd, *nr_sectors);
+		*sector = t->lo + rnd_below(&t->rnd, size);
+		break;
+	case FUZZ_MANY_SEGS:
+		*nr_sectors = 1 + rnd_below(&t->rnd, max_sectors / 4);
+		*sector = t->lo + rnd_below(&t->rnd, size);
+		*nr_segs = *nr_sectors;
+		break;
+	case FUZZ_MAX_SIZE:
+		*nr_sectors = max_sectors;
+		*sector = t->lo + rnd_below(&t->rnd, size);
+		*nr_segs = FUZZ_MAX_SEGS;
+		break;
+	case FUZZ_CRC_EDGE:
+		/* A few sectors either side of a CRC sector boundary */
+		crc_edge = round_up(t->lo + rnd_below(&t->rnd, size),
+				   CRC_PER_SECTOR);
+		*nr_sectors = 1 + rnd_below(&t->rnd, 2 * SSR_SEG_MAX_SECTORS);
+		*nr_segs = 1 + rnd_below(&t->rnd, *nr_sectors);
+		*sector = crc_edge - min_t(sector_t, crc_edge,
+					   rnd_below(&t->rnd, *nr_sectors + 1));
+		break;
+	default:
+		/* Ending at the end of the slice, or starting at its start */
+		*nr_sectors = 1 + rnd_below(&t->rnd, 4 * SSR_SEG_MAX_SECTORS);
+		*nr_segs = 1 + rnd_below(&t->rnd, *nr_sectors);
+		*sector = rnd_below(&t->rnd, 2) ? t->lo :
+			  t->hi - min_t(sector_t, size, *nr_sectors);
+		break;
+	}
+
+	*sector = clamp_t(sector_t, *sector, t->lo, t->hi - 1);
+	*nr_sectors = min_t(size_t, *nr_sectors, t->hi - *sector);
+	*nr_segs = clamp_t(size_t, *nr_segs,
+			   DIV_ROUND_UP(*nr_sectors, SSR_SEG_MAX_SECTORS),
+			   min_t(size_t, *nr_sectors, FUZZ_MAX_SEGS));
+}
+
+/* Submit a bio of the given shape and check what it read */
+static void fuzz_submit(struct fuzz_thread *t, u8 *buf, bool is_write,
+			sector_t sector, size_t nr_sectors, size_t nr_segs)
+{
+	static const unsigned int read_flags[] = { 0, REQ_SYNC, REQ_RAHEAD };
+	static const unsigned int write_flags[] = { 0, REQ_SYNC, REQ_FUA };
+	unsigned int flags = 0;
+	struct bio *bio;
+	int err;
+
+	if (is_write) {
+		bio = fuzz_bio(&t->rnd, REQ_OP_WRITE |
+			       write_flags[rnd_below(&t->rnd, 3)],
+			       sector, nr_sectors, nr_segs);
+		rnd_fill(&t->rnd, buf, nr_sectors * KERNEL_SECTOR_SIZE);
+		fuzz_bio_copy(bio, buf, true);
+	} else {
+		flags = read_flags[rnd_below(&t->rnd, 3)];
+		bio = fuzz_bio(&t->rnd, REQ_OP_READ | flags, sector,
+			       nr_sectors, nr_segs);
+	}
+
+	err = submit_bio_wait(bio);
+	if (err == -EAGAIN && !is_write && (flags & REQ_RAHEAD)) {
+		++t->aborted;
+	} else if (err != 0) {
+		if (opts.verbose)
+			printf("%s of %zu sectors at %llu in %zu segments failed: %d\n",
+			       is_write ? "write" : "read", nr_sectors,
+			       (unsigned long long)sector, nr_segs, err);
+		++t->errors;
+	} else if (is_write) {
+		memcpy(expected + sector * KERNEL_SECTOR_SIZE, buf,
+		       nr_sectors * KERNEL_SECTOR_SIZE);
+	} else {
+		t->bad_sectors += fuzz_bio_check(bio, sector);
+	}
+
+	++t->bios[is_write];
+	t->bytes += nr_sectors * KERNEL_SECTOR_SIZE;
+	t->segs += nr_segs;
+	fuzz_bio_free(bio);
+}
+
+/*
+ * A sequential reader whose next readahead windows are written to now and
+ * then, by small writes just ahead of it that it then reads back.
+ */
+static void fuzz_stream(struct fuzz_thread *t, u8 *buf)
+{
+	size_t len = 1 + rnd_below(&t->rnd, 2 * SSR_SEG_MAX_SECTORS);
+	sector_t sector = t->lo + rnd_below(&t->rnd, t->hi - t->lo);
+	size_t i, nr, min_segs;
+	sector_t ahead;
+
+	for (i = 0; i < FUZZ_STREAM_READS && sector + len <= t->hi; ++i) {
+		if (rnd_below(&t->rnd, 4) == 0) {
+			ahead = sector + rnd_below(&t->rnd, 2 * SSR_RA_MAX_SECTORS);
+			if (ahead < t->hi) {
+				nr = min_t(size_t, 1 + rnd_below(&t->rnd, 16),
+					   t->hi - ahead);
+				min_segs = DIV_ROUND_UP(nr, SSR_SEG_MAX_SECTORS);
+				fuzz_submit(t, buf, true, ahead, nr, min_segs +
+					    rnd_below(&t->rnd, nr - min_segs + 1));
+			}
+		}
+
+		fuzz_submit(t, buf, false, sector, len,
+			    DIV_ROUND_UP(len, SSR_SEG_MAX_SECTORS));
+		sector += len;
+	}
+}
+
+static void *fuzz_thread_fn(void *arg)
+{
+	u8 *buf = malloc(FUZZ_MAX_SEGS * PAGE_SIZE);
+	struct fuzz_thread *t = arg;
+	size_t nr_sectors, nr_segs;
+	enum fuzz_shape shape;
+	sector_t sector;
+
+	if (buf == NULL)
+		abort();
+
+	sim_cpu = t->cpu;
+
+	while (!fuzz_stop) {
+		shape = rnd_below(&t->rnd, FUZZ_NR_SHAPES);
+		if (shape == FUZZ_STREAM) {
+			fuzz_stream(t, buf);
+			continue;
+		}
+
+		fuzz_shape(t, shape, &sector, &nr_sectors, &nr_segs);
+		fuzz_submit(t, buf, rnd_below(&t->rnd, 2), sector, nr_sectors,
+			    nr_segs);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Write random content to the whole array, through the driver */
+static int fuzz_fill(void)
+{
+	struct rnd_state rnd;
+	struct bio *bio;
+	sector_t sector;
+	size_t nr;
+	int err = 0;
+
+	prandom_seed_state(&rnd, opts.seed);
+	rnd_fill(&rnd, expected, LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE);
+
+	for (sector = 0; sector < LOGICAL_DISK_SECTORS && err == 0;
+	     sector += nr) {
+		nr = min_t(size_t, FUZZ_FILL_SECTORS,
+			   LOGICAL_DISK_SECTORS - sector);
+		bio = fuzz_bio(&rnd, REQ_OP_WRITE, sector, nr,
+			       DIV_ROUND_UP(nr, SSR_SEG_MAX_SECTORS));
+		fuzz_bio_copy(bio, expected + sector * KERNEL_SECTOR_SIZE, true);
+		err = submit_bio_wait(bio);
+		fuzz_bio_free(bio);
+	}
+
+	return err;
+}
+
+/* Compare the data and CRCs of every member with the expected content */
+static u64 fuzz_check_members(void)
+{
+	size_t data_len = (size_t)LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE;
+	u8 *data = malloc(data_len);
+	u32 *crcs = malloc(LOGICAL_DISK_CRC_SIZE);
+	u64 bad = 0, bad_disk;
+	sector_t s;
+	int i;
+
+	if (data == NULL || crcs == NULL)
+		abort();
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		if (pread(member_fds[i], data, data_len, 0) != (ssize_t)data_len ||
+		    pread(member_fds[i], crcs, LOGICAL_DISK_CRC_SIZE,
+			  (off_t)LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE) !=
+		    (ssize_t)LOGICAL_DISK_CRC_SIZE)
+			abort();
+
+		bad_disk = 0;
+		for (s = 0; s < LOGICAL_DISK_SECTORS; ++s) {
+			const u8 *want = expected + s * KERNEL_SECTOR_SIZE;
+
+			if (memcmp(data + s * KERNEL_SECTOR_SIZE, want,
+				   KERNEL_SECTOR_SIZE) != 0 ||
+			    crcs[s] != crc32(CRC_SEED, want, KERNEL_SECTOR_SIZE)) {
+				if (opts.verbose && bad_disk < 16)
+					printf("%s: bad data or CRC at sector %llu\n",
+					       member_names[i],
+					       (unsigned long long)s);
+				++bad_disk;
+			}
+		}
+		if (bad_disk != 0)
+			printf("%s: %llu sectors with wrong data or CRC\n",
+			       member_names[i], (unsigned long long)bad_disk);
+		bad += bad_disk;
+	}
+
+	free(crcs);
+	free(data);
+	return bad;
+}
+
+static int run_fuzz(void)
+{
+	struct fuzz_thread *threads = calloc(opts.threads, sizeof(*threads));
+	u64 bios[2] = { 0 }, bytes = 0, segs = 0, errors = 0, bad = 0;
+	u64 aborted = 0;
+	sector_t slice = LOGICAL_DISK_SECTORS / opts.threads;
+	u64 start;
+	double secs;
+	int i;
+
+	if (threads == NULL)
+		return -ENOMEM;
+
+	/* Inner bounds off CRC sectors and pages, shared with the neighbour */
+	for (i = 0; i < opts.threads; ++i) {
+		threads[i].cpu = i;
+		threads[i].lo = i == 0 ? 0 : threads[i - 1].hi;
+		threads[i].hi = i == opts.threads - 1 ? LOGICAL_DISK_SECTORS :
+				(i + 1) * slice + CRC_PER_SECTOR / 2 + 3;
+		prandom_seed_state(&threads[i].rnd, opts.seed + i + 1);
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < opts.threads; ++i)
+		if (pthread_create(&threads[i].thread, NULL, fuzz_thread_fn,
+				   &threads[i]) != 0)
+			abort();
+
+	sleep(opts.seconds);
+	fuzz_stop = true;
+
+	for (i = 0; i < opts.threads; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		bios[READ] += threads[i].bios[READ];
+		bios[WRITE] += threads[i].bios[WRITE];
+		bytes += threads[i].bytes;
+		segs += threads[i].segs;
+		errors += threads[i].errors;
+		aborted += threads[i].aborted;
+		bad += threads[i].bad_sectors;
+	}
+	secs = (double)(ktime_get_ns() - start) / NSEC_PER_SEC;
+
+	printf("%llu reads, %llu writes, %.1f segments per bio, %.1f MiB/s, "
+	       "%llu errors, %llu readaheads aborted, "
+	       "%llu sectors read with wrong data\n",
+	       (unsigned long long)bios[READ], (unsigned long long)bios[WRITE],
+	       (double)segs / max_t(u64, bios[READ] + bios[WRITE], 1),
+	       bytes / secs / (1 << 20), (unsigned long long)errors,
+	       (unsigned long long)aborted, (unsigned long long)bad);
+
+	free(threads);
+	return errors != 0 || bad != 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -j N        submitting threads, one per simulated CPU (%d)\n"
+		"  -t SECS     run time (%d)\n"
+		"  -x SEED     seed of the content and shapes (%llu)\n"
+		"  -p N=V      set module parameter N, before loading\n"
+		"  -v          print every failure\n",
+		prog, opts.threads, opts.seconds,
+		(unsigned long long)opts.seed);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char *value;
+	int ret, c, i;
+
+	while ((c = getopt(argc, argv, "j:t:x:p:v")) != -1) {
+		switch (c) {
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 't':
+			opts.seconds = atoi(optarg);
+			break;
+		case 'x':
+			opts.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			value = strchr(optarg, '=');
+			if (value == NULL)
+				usage(argv[0]);
+			*value++ = '\0';
+			if (sim_param_set(optarg, value) != 0) {
+				fprintf(stderr, "unknown parameter %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.threads < 1 || opts.threads > SIM_MAX_CPUS)
+		usage(argv[0]);
+
+	sim_nr_cpus = opts.threads;
+
+	expected = malloc((size_t)LOGICAL_DISK_SECTORS * KERNEL_SECTOR_SIZE);
+	if (expected == NULL)
+		return 1;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		member_fds[i] = memfd_create(member_names[i], 0);
+		if (member_fds[i] < 0 ||
+		    ftruncate(member_fds[i],
+			      (off_t)(SSR_SB_SECTOR + 1) * KERNEL_SECTOR_SIZE) != 0 ||
+		    sim_member_add(member_names[i], member_fds[i]) != 0) {
+			perror(member_names[i]);
+			return 1;
+		}
+	}
+
+	if (sim_module_init() != 0) {
+		fprintf(stderr, "loading the array failed\n");
+		return 1;
+	}
+
+	if (fuzz_fill() != 0) {
+		fprintf(stderr, "filling the array failed\n");
+		return 1;
+	}
+
+	printf("seed %llu, %d threads\n", (unsigned long long)opts.seed,
+	       opts.threads);
+	ret = run_fuzz();
+
+	sim_module_exit();
+	if (fuzz_check_members() != 0)
+		ret = 1;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i)
+		close(member_fds[i]);
+	free(expected);
+
+	return ret;
+}
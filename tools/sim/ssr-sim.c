@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - userspace benchmark of the engine
+ *
+ * Runs ssr.c, built against the shim, on members backed by memory or files.
+ * The array is filled with a known pattern, then either a mixed read and
+ * write workload runs for a while, one thread per simulated CPU, or a
+ * maintenance operation is timed. Reads are checked against the pattern.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "ssr.h"
+
+#define SIM_MAX_KIB 1024
+#define SIM_FILL_KIB 128
+#define SIM_LAT_BUCKETS 64
+
+static const char * const member_names[] = {
+	PHYSICAL_DISK1_NAME,
+	PHYSICAL_DISK2_NAME,
+	PHYSICAL_DISK3_NAME,
+};
+
+static struct {
+	const char *dir;
+	int threads;
+	int seconds;
+	int read_pct;
+	unsigned int kib;
+	bool sequential;
+	bool fill;
+	bool counters;
+	u64 seed;
+	const char *op;
+} opts = {
+	.threads = 4,
+	.seconds = 5,
+	.read_pct = 70,
+	.kib = 4,
+	.fill = true,
+	.seed = 1,
+};
+
+/* Per direction results of a thread, merged at the end */
+struct sim_stats {
+	u64 ops;
+	u64 bytes;
+	u64 errors;
+	u64 lat_ns;
+	u64 lat_max_ns;
+	/* Requests by log2 of their latency in microseconds */
+	u64 lat_hist[SIM_LAT_BUCKETS];
+};
+
+struct sim_thread {
+	pthread_t thread;
+	int cpu;
+	struct rnd_state rnd;
+	struct sim_stats stats[2];
+	u64 bad_data;
+};
+
+static volatile bool sim_stop;
+
+/* The content of a sector never changes, so any read can be checked */
+static void pattern_fill(void *buf, sector_t sector)
+{
+	u64 *w = buf;
+	size_t i;
+
+	for (i = 0; i < KERNEL_SECTOR_SIZE / sizeof(*w); ++i)
+		w[i] = (sector * 0x9e3779b97f4a7c15ULL) ^ i;
+}
+
+static bool pattern_check(const void *buf, sector_t sector)
+{
+	u64 expected[KERNEL_SECTOR_SIZE / sizeof(u64)];
+
+	pattern_fill(expected, sector);
+	return memcmp(buf, expected, KERNEL_SECTOR_SIZE) == 0;
+}
+
+/* Submit a request to the array and wait for it */
+static int array_rw(unsigned int op, sector_t sector, struct page **pages,
+		    size_t len)
+{
+	struct bio *bio;
+	size_t i;
+	int err;
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(len, PAGE_SIZE));
+	if (bio == NULL)
+		return -ENOMEM;
+
+	bio->bi_disk = sim_disk;
+	bio->bi_opf = op;
+	bio->bi_iter.bi_sector = sector;
+	for (i = 0; i < len; i += PAGE_SIZE)
+		bio_add_page(bio, pages[i / PAGE_SIZE],
+			     min_t(size_t, len - i, PAGE_SIZE), 0);
+
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+
+	return err;
+}
+
+static void pages_fill(struct page **pages, size_t len, sector_t sector)
+{
+	size_t s;
+
+	for (s = 0; s < len / KERNEL_SECTOR_SIZE; ++s)
+		pattern_fill((char *)page_address(pages[s / SSR_SEG_MAX_SECTORS]) +
+			     (s % SSR_SEG_MAX_SECTORS) * KERNEL_SECTOR_SIZE,
+			     sector + s);
+}
+
+static u64 pages_check(struct page **pages, size_t len, sector_t sector)
+{
+	u64 bad = 0;
+	size_t s;
+
+	for (s = 0; s < len / KERNEL_SECTOR_SIZE; ++s)
+		bad += !pattern_check((char *)page_address(pages[s / SSR_SEG_MAX_SECTORS]) +
+				      (s % SSR_SEG_MAX_SECTORS) * KERNEL_SECTOR_SIZE,
+				      sector + s);
+	return bad;
+}
+
+static struct page **pages_alloc(size_t len)
+{
+	struct page **pages = calloc(DIV_ROUND_UP(len, PAGE_SIZE),
+				     sizeof(*pages));
+	size_t i;
+
+	if (pages == NULL)
+		abort();
+	for (i = 0; i < DIV_ROUND_UP(len, PAGE_SIZE); ++i) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (pages[i] == NULL)
+			abort();
+	}
+	return pages;
+}
+
+static void pages_free(struct page **pages, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < DIV_ROUND_UP(len, PAGE_SIZE); ++i)
+		__free_page(pages[i]);
+	free(pages);
+}
+
+static int array_fill(void)
+{
+	size_t len = SIM_FILL_KIB * 1024;
+	struct page **pages = pages_alloc(len);
+	sector_t sector;
+	int err = 0;
+
+	for (sector = 0; sector < LOGICAL_DISK_SECTORS && err == 0;
+	     sector += len / KERNEL_SECTOR_SIZE) {
+		len = min_t(size_t, len,
+			    (LOGICAL_DISK_SECTORS - sector) * KERNEL_SECTOR_SIZE);
+		pages_fill(pages, len, sector);
+		err = array_rw(REQ_OP_WRITE, sector, pages, len);
+	}
+
+	pages_free(pages, SIM_FILL_KIB * 1024);
+	return err;
+}
+
+static void stats_add(struct sim_stats *stats, size_t len, u64 lat_ns, int err)
+{
+	size_t b = 0;
+	u64 us = lat_ns / NSEC_PER_USEC;
+
+	while (us >>= 1)
+		++b;
+
+	++stats->ops;
+	stats->bytes += len;
+	stats->errors += err != 0;
+	stats->lat_ns += lat_ns;
+	stats->lat_max_ns = max(stats->lat_max_ns, lat_ns);
+	++stats->lat_hist[min_t(size_t, b, SIM_LAT_BUCKETS - 1)];
+}
+
+static void *sim_thread_fn(void *arg)
+{
+	struct sim_thread *t = arg;
+	size_t len = opts.kib * 1024;
+	sector_t nr = len / KERNEL_SECTOR_SIZE;
+	sector_t slots = LOGICAL_DISK_SECTORS / nr;
+	sector_t sector, next = (slots / opts.threads) * t->cpu;
+	struct page **pages = pages_alloc(len);
+	bool is_read;
+	u64 start;
+	int err;
+
+	sim_cpu = t->cpu;
+
+	while (!sim_stop) {
+		if (opts.sequential)
+			next = (next + 1) % slots;
+		else
+			next = prandom_u32_state(&t->rnd) % slots;
+		sector = next * nr;
+		is_read = (int)(prandom_u32_state(&t->rnd) % 100) < opts.read_pct;
+
+		if (!is_read)
+			pages_fill(pages, len, sector);
+
+		start = ktime_get_ns();
+		err = array_rw(is_read ? REQ_OP_READ : REQ_OP_WRITE | REQ_SYNC,
+			       sector, pages, len);
+		stats_add(&t->stats[is_read ? READ : WRITE], len,
+			  ktime_get_ns() - start, err);
+
+		if (is_read && err == 0)
+			t->bad_data += pages_check(pages, len, sector);
+	}
+
+	pages_free(pages, len);
+	return NULL;
+}
+
+/* Upper bound of the bucket holding the given fraction of the requests */
+static u64 stats_percentile_us(const struct sim_stats *stats, unsigned int pct)
+{
+	u64 seen = 0;
+	size_t b;
+
+	for (b = 0; b < SIM_LAT_BUCKETS; ++b) {
+		seen += stats->lat_hist[b];
+		if (seen * 100 >= stats->ops * pct)
+			break;
+	}
+	return 2ULL << b;
+}
+
+static void stats_print(const char *name, const struct sim_stats *stats,
+			double secs)
+{
+	if (stats->ops == 0)
+		return;
+
+	printf("%-6s %10llu ops %10.0f IOPS %9.1f MiB/s  lat avg %7.1f us "
+	       "p50 <%llu us p99 <%llu us max %7.1f us  errors %llu\n",
+	       name, (unsigned long long)stats->ops, stats->ops / secs,
+	       stats->bytes / secs / (1 << 20),
+	       (double)stats->lat_ns / stats->ops / NSEC_PER_USEC,
+	       (unsigned long long)stats_percentile_us(stats, 50),
+	       (unsigned long long)stats_percentile_us(stats, 99),
+	       (double)stats->lat_max_ns / NSEC_PER_USEC,
+	       (unsigned long long)stats->errors);
+}
+
+static int run_workload(void)
+{
+	struct sim_thread *threads = calloc(opts.threads, sizeof(*threads));
+	struct sim_stats total[2] = { 0 };
+	u64 start, bad_data = 0;
+	double secs;
+	int i, d;
+	size_t b;
+
+	if (threads == NULL)
+		return -ENOMEM;
+
+	start = ktime_get_ns();
+	for (i = 0; i < opts.threads; ++i) {
+		threads[i].cpu = i;
+		prandom_seed_state(&threads[i].rnd, opts.seed + i);
+		if (pthread_create(&threads[i].thread, NULL, sim_thread_fn,
+				   &threads[i]) != 0)
+			abort();
+	}
+
+	sleep(opts.seconds);
+	sim_stop = true;
+
+	for (i = 0; i < opts.threads; ++i)
+		pthread_join(threads[i].thread, NULL);
+	secs = (double)(ktime_get_ns() - start) / NSEC_PER_SEC;
+
+	for (i = 0; i < opts.threads; ++i) {
+		for (d = READ; d <= WRITE; ++d) {
+			total[d].ops += threads[i].stats[d].ops;
+			total[d].bytes += threads[i].stats[d].bytes;
+			total[d].errors += threads[i].stats[d].errors;
+			total[d].lat_ns += threads[i].stats[d].lat_ns;
+			total[d].lat_max_ns = max(total[d].lat_max_ns,
+						  threads[i].stats[d].lat_max_ns);
+			for (b = 0; b < SIM_LAT_BUCKETS; ++b)
+				total[d].lat_hist[b] +=
+					threads[i].stats[d].lat_hist[b];
+		}
+		bad_data += threads[i].bad_data;
+	}
+
+	stats_print("read", &total[READ], secs);
+	stats_print("write", &total[WRITE], secs);
+	if (bad_data != 0)
+		printf("sectors read with wrong data: %llu\n",
+		       (unsigned long long)bad_data);
+
+	free(threads);
+	return bad_data != 0 || total[READ].errors || total[WRITE].errors;
+}
+
+/* Start a maintenance operation through the "op" attribute and time it */
+static int run_op(void)
+{
+	char buf[PAGE_SIZE], type[16], state[16];
+	u64 start = ktime_get_ns();
+	ssize_t err;
+
+	err = sim_sysfs_store("op", opts.op);
+	if (err < 0) {
+		fprintf(stderr, "op %s: %s\n", opts.op, strerror(-err));
+		return 1;
+	}
+
+	do {
+		usleep(1000);
+		if (sim_sysfs_show("op", buf) < 0 ||
+		    sscanf(buf, "%15s %15s", type, state) != 2)
+			return 1;
+	} while (strcmp(state, "running") == 0);
+
+	printf("%.3f s: %s", (double)(ktime_get_ns() - start) / NSEC_PER_SEC,
+	       buf);
+	return strcmp(state, "done") != 0;
+}
+
+static int open_member(const char *path)
+{
+	const char *name = strrchr(path, '/') + 1;
+	char file[PATH_MAX];
+	int fd;
+
+	if (opts.dir != NULL) {
+		snprintf(file, sizeof(file), "%s/%s", opts.dir, name);
+		fd = open(file, O_RDWR | O_CREAT, 0644);
+	} else {
+		fd = memfd_create(name, 0);
+	}
+	if (fd < 0 ||
+	    ftruncate(fd, (off_t)(SSR_SB_SECTOR + 1) * KERNEL_SECTOR_SIZE) != 0 ||
+	    sim_member_add(path, fd) != 0) {
+		perror(name);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DIR      back the members with files in DIR, not memory\n"
+		"  -n          do not fill the array first, e.g. with -d\n"
+		"  -j N        submitting threads, one per simulated CPU (%d)\n"
+		"  -t SECS     run time (%d)\n"
+		"  -r PCT      percentage of reads (%d)\n"
+		"  -b KIB      request size in KiB (%u)\n"
+		"  -s          sequential instead of random offsets\n"
+		"  -x SEED     seed of the offsets (%llu)\n"
+		"  -o OP       time a maintenance operation instead, e.g. verify\n"
+		"  -p N=V      set module parameter N, before loading\n"
+		"  -f P=V      set debugfs file ssr/P, e.g. fault/enable=1\n"
+		"  -c          print the debugfs and sysfs counters at the end\n"
+		"  -T DIR      capture a bio trace of the run to DIR/bios0\n",
+		prog, opts.threads, opts.seconds, opts.read_pct, opts.kib,
+		(unsigned long long)opts.seed);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const sysfs_counters[] = { "health", "write_amp" };
+	static char buf[PAGE_SIZE];
+	const char *debugfs_sets[32];
+	char path[128], *value;
+	int fds[SSR_NR_DISKS];
+	int nr_sets = 0, ret, c, i;
+
+	while ((c = getopt(argc, argv, "d:nj:t:r:b:sx:o:p:f:cT:")) != -1) {
+		switch (c) {
+		case 'd':
+			opts.dir = optarg;
+			break;
+		case 'n':
+			opts.fill = false;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 't':
+			opts.seconds = atoi(optarg);
+			break;
+		case 'r':
+			opts.read_pct = atoi(optarg);
+			break;
+		case 'b':
+			opts.kib = atoi(optarg);
+			break;
+		case 's':
+			opts.sequential = true;
+			break;
+		case 'x':
+			opts.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			opts.op = optarg;
+			break;
+		case 'p':
+			value = strchr(optarg, '=');
+			if (value == NULL)
+				usage(argv[0]);
+			*value++ = '\0';
+			if (sim_param_set(optarg, value) != 0) {
+				fprintf(stderr, "unknown parameter %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'f':
+			if (nr_sets == ARRAY_SIZE(debugfs_sets) ||
+			    strchr(optarg, '=') == NULL)
+				usage(argv[0]);
+			debugfs_sets[nr_sets++] = optarg;
+			break;
+		case 'c':
+			opts.counters = true;
+			break;
+		case 'T':
+			sim_relay_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.threads < 1 || opts.threads > SIM_MAX_CPUS ||
+	    opts.kib < 1 || opts.kib > SIM_MAX_KIB ||
+	    opts.read_pct < 0 || opts.read_pct > 100)
+		usage(argv[0]);
+
+	sim_nr_cpus = opts.threads;
+
+	for (i = 0; i < SSR_NR_DISKS; ++i) {
+		fds[i] = open_member(member_names[i]);
+		if (fds[i] < 0)
+			return 1;
+	}
+
+	if (sim_module_init() != 0) {
+		fprintf(stderr, "loading the array failed\n");
+		return 1;
+	}
+
+	if (opts.fill && array_fill() != 0) {
+		fprintf(stderr, "filling the array failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_sets; ++i) {
+		value = strchr(debugfs_sets[i], '=');
+		*value++ = '\0';
+		snprintf(path, sizeof(path), LOGICAL_DISK_NAME "/%s",
+			 debugfs_sets[i]);
+		if (sim_debugfs_set(path, value) != 0) {
+			fprintf(stderr, "cannot set %s\n", path);
+			return 2;
+		}
+	}
+
+	/* Only the run is traced, not the fill */
+	if (sim_relay_dir != NULL &&
+	    sim_debugfs_set(LOGICAL_DISK_NAME "/trace/enable", "1") != 0) {
+		fprintf(stderr, "cannot trace to %s\n", sim_relay_dir);
+		return 1;
+	}
+
+	ret = opts.op != NULL ? run_op() : run_workload();
+
+	if (opts.counters) {
+		sim_debugfs_dump(stdout);
+		for (i = 0; i < (int)ARRAY_SIZE(sysfs_counters); ++i)
+			if (sim_sysfs_show(sysfs_counters[i], buf) >= 0)
+				printf("%s:\n%s", sysfs_counters[i], buf);
+	}
+
+	sim_module_exit();
+	for (i = 0; i < SSR_NR_DISKS; ++i)
+		close(fds[i]);
+
+	return ret;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0+
+#
+# Capture the bios submitted to ssr until interrupted, or for SECS seconds:
+#
+#   ssr-capture.sh -o trace [-t SECS]
+#
+# The per-CPU relay files of ssr/trace in debugfs are drained into the
+# output directory as they fill, then replayed with ssr-replay trace/bios*.
+# Records dropped because the buffers were not drained in time are counted
+# in ssr/trace/dropped.
+
+set -eu
+
+TRACE=/sys/kernel/debug/ssr/trace
+OUT=
+SECS=
+
+usage() {
+	echo "usage: $0 -o DIR [-t SECS]" >&2
+	exit 2
+}
+
+while getopts "o:t:" opt; do
+	case $opt in
+	o) OUT=$OPTARG ;;
+	t) SECS=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ -n "$OUT" ] || usage
+
+mkdir -p "$OUT"
+dropped=$(cat "$TRACE/dropped")
+
+drain() {
+	local f
+
+	for f in "$TRACE"/bios*; do
+		cat "$f" >> "$OUT/$(basename "$f")"
+	done
+}
+
+stop=false
+trap 'stop=true' INT TERM
+
+echo 1 > "$TRACE/enable"
+end=$(( ${SECS:-0} > 0 ? $(date +%s) + SECS : 0 ))
+while ! $stop && { [ "$end" -eq 0 ] || [ "$(date +%s)" -lt "$end" ]; }; do
+	drain
+	sleep 0.2
+done
+# Disabling flushes the partly filled sub-buffers
+echo 0 > "$TRACE/enable"
+drain
+
+echo "captured to $OUT, $(( $(cat "$TRACE/dropped") - dropped )) records dropped"
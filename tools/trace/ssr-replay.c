@@ -0,0 +1,437 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simple Software Raid - replay of captured bio traces
+ *
+ * Reads the struct ssr_trace_rec records captured through ssr/trace in
+ * debugfs, merges the per-CPU files by submission time and reissues them to
+ * the array with O_DIRECT, at the original pace, faster or as fast as the
+ * threads allow. The latency of every record can be saved and compared with
+ * the one of another run, e.g. of the previous version of the module.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ssr.h"
+
+#define REPLAY_ALIGN 4096
+#define REPLAY_MAX_THREADS 1024
+
+struct rec {
+	struct ssr_trace_rec trace;
+	/* order in the merged trace */
+	size_t index;
+};
+
+static struct {
+	const char *dev;
+	double speed;
+	int threads;
+	bool no_writes;
+	const char *out;
+	const char *base;
+	double threshold;
+} opts = {
+	.dev = LOGICAL_DISK_PATH,
+	.speed = 1.0,
+	.threads = 32,
+	.threshold = 10.0,
+};
+
+static struct rec *recs;
+static size_t nr_recs;
+/* per record: latency and how late it was issued, in ns */
+static uint64_t *lats;
+static uint64_t *lateness;
+static int *errors;
+
+static size_t next_rec;
+static uint64_t start_ns;
+static int fd, fd_fua;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static int load_trace(const char *path)
+{
+	struct ssr_trace_rec trace;
+	struct rec *grown;
+	size_t alloc = nr_recs;
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fread(&trace, sizeof(trace), 1, file) == 1) {
+		if (nr_recs == alloc) {
+			alloc = alloc ? 2 * alloc : 4096;
+			grown = realloc(recs, alloc * sizeof(*recs));
+			if (grown == NULL) {
+				fclose(file);
+				return -1;
+			}
+			recs = grown;
+		}
+		recs[nr_recs].trace = trace;
+		recs[nr_recs].index = nr_recs;
+		++nr_recs;
+	}
+	fclose(file);
+
+	return 0;
+}
+
+/* By submission time, records of the same time in file order */
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct rec *ra = a, *rb = b;
+
+	if (ra->trace.time_ns != rb->trace.time_ns)
+		return ra->trace.time_ns < rb->trace.time_ns ? -1 : 1;
+	return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+static int issue(const struct ssr_trace_rec *trace, void *buf)
+{
+	size_t len = (size_t)trace->nr_sectors * KERNEL_SECTOR_SIZE;
+	off_t offset = trace->sector * KERNEL_SECTOR_SIZE;
+	bool write = trace->flags & SSR_TRACE_WRITE;
+	ssize_t done;
+
+	if (trace->flags & SSR_TRACE_PREFLUSH && fdatasync(fd) != 0)
+		return -1;
+	/* A flush without data */
+	if (len == 0)
+		return 0;
+
+	if (write)
+		done = pwrite(trace->flags & SSR_TRACE_FUA ? fd_fua : fd, buf,
+			      len, offset);
+	else
+		done = pread(fd, buf, len, offset);
+
+	return done == (ssize_t)len ? 0 : -1;
+}
+
+static void *replay_thread(void *arg)
+{
+	size_t max_len = *(size_t *)arg;
+	uint64_t due, t0 = recs[0].trace.time_ns;
+	const struct ssr_trace_rec *trace;
+	void *buf;
+	size_t i;
+
+	if (posix_memalign(&buf, REPLAY_ALIGN, max_len) != 0)
+		return NULL;
+	memset(buf, 0xa5, max_len);
+
+	while ((i = __atomic_fetch_add(&next_rec, 1, __ATOMIC_RELAXED)) <
+	       nr_recs) {
+		trace = &recs[i].trace;
+		if (opts.no_writes && trace->flags & SSR_TRACE_WRITE)
+			continue;
+
+		due = start_ns;
+		if (opts.speed > 0) {
+			due += (trace->time_ns - t0) / opts.speed;
+			sleep_until(due);
+		}
+
+		lateness[i] = now_ns() - due;
+		errors[i] = issue(trace, buf);
+		lats[i] = now_ns() - due - lateness[i];
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+struct stats {
+	size_t count;
+	uint64_t avg, p50, p99, p999, max;
+};
+
+/* Of the records of one direction that were issued */
+static void stats_get(const uint64_t *vals, bool write, struct stats *st)
+{
+	uint64_t *sorted = malloc(nr_recs * sizeof(*sorted));
+	uint64_t sum = 0;
+	size_t i, n = 0;
+
+	memset(st, 0, sizeof(*st));
+	if (sorted == NULL)
+		return;
+
+	for (i = 0; i < nr_recs; ++i) {
+		if (!(recs[i].trace.flags & SSR_TRACE_WRITE) != !write)
+			continue;
+		if (opts.no_writes && write)
+			continue;
+		sorted[n++] = vals[i];
+		sum += vals[i];
+	}
+
+	if (n != 0) {
+		qsort(sorted, n, sizeof(*sorted), u64_cmp);
+		st->count = n;
+		st->avg = sum / n;
+		st->p50 = sorted[n / 2];
+		st->p99 = sorted[n * 99 / 100];
+		st->p999 = sorted[n * 999 / 1000];
+		st->max = sorted[n - 1];
+	}
+	free(sorted);
+}
+
+static void stats_print(const char *name, const struct stats *st)
+{
+	if (st->count == 0)
+		return;
+
+	printf("%-10s %9zu ops  lat avg %9.1f us p50 %9.1f us p99 %9.1f us p99.9 %9.1f us max %9.1f us\n",
+	       name, st->count, st->avg / 1e3, st->p50 / 1e3, st->p99 / 1e3,
+	       st->p999 / 1e3, st->max / 1e3);
+}
+
+static double delta_pct(uint64_t base, uint64_t val)
+{
+	return base ? 100.0 * ((double)val - base) / base : 0;
+}
+
+/* Returns whether the p99 regressed by more than the threshold */
+static bool stats_compare(const char *name, const struct stats *base,
+			  const struct stats *st)
+{
+	if (st->count == 0 || base->count == 0)
+		return false;
+
+	printf("%-10s delta    avg %+7.1f%%  p50 %+7.1f%%  p99 %+7.1f%%  p99.9 %+7.1f%%  max %+7.1f%%\n",
+	       name, delta_pct(base->avg, st->avg),
+	       delta_pct(base->p50, st->p50), delta_pct(base->p99, st->p99),
+	       delta_pct(base->p999, st->p999), delta_pct(base->max, st->max));
+
+	return delta_pct(base->p99, st->p99) > opts.threshold;
+}
+
+static int lats_save(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	int err = 0;
+
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fwrite(lats, sizeof(*lats), nr_recs, file) != nr_recs)
+		err = -1;
+	if (fclose(file) != 0)
+		err = -1;
+
+	return err;
+}
+
+static uint64_t *lats_load(const char *path)
+{
+	uint64_t *base = malloc(nr_recs * sizeof(*base));
+	FILE *file = fopen(path, "r");
+	struct stat st;
+
+	if (file == NULL || base == NULL) {
+		perror(path);
+		goto fail;
+	}
+	if (fstat(fileno(file), &st) != 0 ||
+	    (size_t)st.st_size != nr_recs * sizeof(*base)) {
+		fprintf(stderr, "%s: not saved from a replay of this trace\n",
+			path);
+		goto fail;
+	}
+	if (fread(base, sizeof(*base), nr_recs, file) != nr_recs)
+		goto fail;
+
+	fclose(file);
+	return base;
+
+fail:
+	if (file != NULL)
+		fclose(file);
+	free(base);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] TRACE...\n"
+		"  -d DEV      device to replay to (%s)\n"
+		"  -s SPEED    pace relative to the capture, 0 as fast as possible (%.1f)\n"
+		"  -j N        replaying threads, bounds the IO in flight (%d)\n"
+		"  -R          skip the writes, so the array content is kept\n"
+		"  -o FILE     save the latency of every record to FILE\n"
+		"  -c FILE     compare with the latencies saved in FILE\n"
+		"  -t PCT      with -c, fail if a p99 grew more than PCT%% (%.0f)\n",
+		prog, opts.dev, opts.speed, opts.threads, opts.threshold);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[REPLAY_MAX_THREADS];
+	struct stats reads, writes, base_reads, base_writes, late;
+	uint64_t *base = NULL;
+	size_t i, max_len = KERNEL_SECTOR_SIZE;
+	int failed = 0, c, t;
+	bool regressed;
+
+	while ((c = getopt(argc, argv, "d:s:j:Ro:c:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			opts.dev = optarg;
+			break;
+		case 's':
+			opts.speed = atof(optarg);
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'R':
+			opts.no_writes = true;
+			break;
+		case 'o':
+			opts.out = optarg;
+			break;
+		case 'c':
+			opts.base = optarg;
+			break;
+		case 't':
+			opts.threshold = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || opts.speed < 0 || opts.threads < 1 ||
+	    opts.threads > REPLAY_MAX_THREADS)
+		usage(argv[0]);
+
+	for (; optind < argc; ++optind)
+		if (load_trace(argv[optind]) != 0)
+			return 1;
+	if (nr_recs == 0) {
+		fprintf(stderr, "the trace is empty\n");
+		return 1;
+	}
+	qsort(recs, nr_recs, sizeof(*recs), rec_cmp);
+
+	for (i = 0; i < nr_recs; ++i)
+		if ((size_t)recs[i].trace.nr_sectors * KERNEL_SECTOR_SIZE >
+		    max_len)
+			max_len = (size_t)recs[i].trace.nr_sectors *
+				  KERNEL_SECTOR_SIZE;
+
+	if (opts.base != NULL) {
+		base = lats_load(opts.base);
+		if (base == NULL)
+			return 1;
+	}
+
+	lats = calloc(nr_recs, sizeof(*lats));
+	lateness = calloc(nr_recs, sizeof(*lateness));
+	errors = calloc(nr_recs, sizeof(*errors));
+	if (lats == NULL || lateness == NULL || errors == NULL)
+		return 1;
+
+	fd = open(opts.dev, (opts.no_writes ? O_RDONLY : O_RDWR) | O_DIRECT);
+	fd_fua = open(opts.dev, (opts.no_writes ? O_RDONLY : O_RDWR) |
+				O_DIRECT | O_DSYNC);
+	if (fd < 0 || fd_fua < 0) {
+		perror(opts.dev);
+		return 1;
+	}
+
+	start_ns = now_ns();
+	for (t = 0; t < opts.threads; ++t)
+		if (pthread_create(&threads[t], NULL, replay_thread,
+				   &max_len) != 0)
+			break;
+	while (t-- > 0)
+		pthread_join(threads[t], NULL);
+
+	for (i = 0; i < nr_recs; ++i)
+		failed += errors[i] != 0;
+
+	printf("%zu records over %.3f s, replayed in %.3f s, %d errors\n",
+	       nr_recs,
+	       (recs[nr_recs - 1].trace.time_ns - recs[0].trace.time_ns) / 1e9,
+	       (now_ns() - start_ns) / 1e9, failed);
+
+	stats_get(lats, false, &reads);
+	stats_get(lats, true, &writes);
+	stats_print("read", &reads);
+	stats_print("write", &writes);
+
+	/* Issued behind the schedule: the replay could not keep the pace */
+	if (opts.speed > 0) {
+		stats_get(lateness, false, &late);
+		stats_print("read late", &late);
+		stats_get(lateness, true, &late);
+		stats_print("write late", &late);
+	}
+
+	if (opts.out != NULL && lats_save(opts.out) != 0) {
+		fprintf(stderr, "cannot save the latencies to %s\n", opts.out);
+		return 1;
+	}
+
+	if (base != NULL) {
+		memcpy(lats, base, nr_recs * sizeof(*lats));
+		stats_get(lats, false, &base_reads);
+		stats_get(lats, true, &base_writes);
+		regressed = stats_compare("read", &base_reads, &reads);
+		regressed |= stats_compare("write", &base_writes, &writes);
+		if (regressed) {
+			printf("p99 latency regressed by more than %.0f%%\n",
+			       opts.threshold);
+			return 3;
+		}
+	}
+
+	return failed != 0;
+}